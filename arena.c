@@ -0,0 +1,151 @@
+/*
+ * Bump allocator for variable-size data, such as keys copied into a dict.
+ *
+ * Memory is handed out from the current chunk, and individual allocations
+ * are never freed. Chunks start at ARENA_MIN_CHUNK bytes and double up to
+ * ARENA_MAX_CHUNK; larger allocations get a chunk of their own.
+ * arena_reset() discards everything in one go, keeping the newest chunk
+ * around for reuse.
+ */
+
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ARENA_MIN_CHUNK 4096
+#define ARENA_MAX_CHUNK (1024 * 1024)
+
+// Chunk headers are padded so the data that follows stays aligned.
+#define ARENA_HEADER (((sizeof(struct arena_chunk)) + sizeof(void *) * 2 - 1) & ~(sizeof(void *) * 2 - 1))
+
+void arena_init(struct arena *arena)
+{
+    arena->chunks = NULL;
+    arena->bump = NULL;
+    arena->bump_end = NULL;
+    arena->chunk_size = ARENA_MIN_CHUNK;
+}
+
+/**
+ * Allocates size bytes, with no particular alignment.
+ *
+ * Returns a pointer to the memory, or NULL on error.
+ **/
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk;
+    size_t chunk_size;
+    void *p;
+    
+    if ((size_t)(arena->bump_end - arena->bump) < size || arena->bump == NULL) {
+        chunk_size = arena->chunk_size;
+        if (size > chunk_size) {
+            chunk_size = size;
+        }
+        
+        chunk = malloc(ARENA_HEADER + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        
+        chunk->size = chunk_size;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->bump = (char *)chunk + ARENA_HEADER;
+        arena->bump_end = arena->bump + chunk_size;
+        
+        if (arena->chunk_size < ARENA_MAX_CHUNK) {
+            arena->chunk_size <<= 1;
+        }
+    }
+    
+    p = arena->bump;
+    arena->bump += size;
+    return p;
+}
+
+/**
+ * Makes sure the next allocations, up to size bytes in total, come from the
+ * current chunk, so they can't fail.
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int arena_reserve(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk;
+    size_t chunk_size;
+    
+    if ((size_t)(arena->bump_end - arena->bump) >= size) {
+        return 1;
+    }
+    
+    chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+    chunk = malloc(ARENA_HEADER + chunk_size);
+    if (chunk == NULL) {
+        return 0;
+    }
+    
+    chunk->size = chunk_size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->bump = (char *)chunk + ARENA_HEADER;
+    arena->bump_end = arena->bump + chunk_size;
+    
+    if (arena->chunk_size < ARENA_MAX_CHUNK) {
+        arena->chunk_size <<= 1;
+    }
+    
+    return 1;
+}
+
+/**
+ * Discards every allocation. The newest chunk is kept for reuse, the rest
+ * are freed.
+ **/
+void arena_reset(struct arena *arena)
+{
+    struct arena_chunk *chunk, *next;
+    
+    if (arena->chunks == NULL) {
+        return;
+    }
+    
+    for (chunk = arena->chunks->next; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    
+    arena->chunks->next = NULL;
+    arena->bump = (char *)arena->chunks + ARENA_HEADER;
+    arena->bump_end = arena->bump + arena->chunks->size;
+}
+
+/**
+ * Frees every chunk. The arena stays usable.
+ **/
+void arena_release(struct arena *arena)
+{
+    struct arena_chunk *chunk, *next;
+    
+    for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    
+    arena_init(arena);
+}
+
+/**
+ * Returns the number of bytes allocated for chunks, headers included.
+ **/
+size_t arena_bytes(const struct arena *arena)
+{
+    struct arena_chunk *chunk;
+    size_t bytes = 0;
+    
+    for (chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+        bytes += ARENA_HEADER + chunk->size;
+    }
+    
+    return bytes;
+}
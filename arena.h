@@ -0,0 +1,29 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+};
+
+struct arena {
+    struct arena_chunk *chunks;
+    char *bump;
+    char *bump_end;
+    size_t chunk_size;
+};
+
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+int arena_reserve(struct arena *arena, size_t size);
+void arena_reset(struct arena *arena);
+void arena_release(struct arena *arena);
+size_t arena_bytes(const struct arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
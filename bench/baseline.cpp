@@ -0,0 +1,55 @@
+#include <string_view>
+#include <unordered_map>
+
+#include "baseline.h"
+
+struct baseline {
+    std::unordered_map<std::string_view, void *> map;
+};
+
+struct baseline *baseline_new(void)
+{
+    return new baseline();
+}
+
+struct baseline *baseline_clone(struct baseline *map)
+{
+    return new baseline(*map);
+}
+
+void baseline_delete(struct baseline *map)
+{
+    delete map;
+}
+
+size_t baseline_size(struct baseline *map)
+{
+    return map->map.size();
+}
+
+size_t baseline_buckets(struct baseline *map)
+{
+    return map->map.bucket_count();
+}
+
+void baseline_rehash(struct baseline *map, size_t buckets)
+{
+    map->map.rehash(buckets);
+}
+
+int baseline_set(struct baseline *map, const char *key, size_t len, void *value)
+{
+    map->map[std::string_view(key, len)] = value;
+    return 1;
+}
+
+void *baseline_get(struct baseline *map, const char *key, size_t len)
+{
+    auto it = map->map.find(std::string_view(key, len));
+    return it != map->map.end() ? it->second : NULL;
+}
+
+int baseline_del(struct baseline *map, const char *key, size_t len)
+{
+    return map->map.erase(std::string_view(key, len)) > 0;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+ * std::unordered_map, wrapped for dict-bench. Keys are not copied, the map
+ * holds views of the caller's key bytes, just like a dict without
+ * DICT_F_OWN_KEYS holds the caller's pointers.
+ */
+
+struct baseline;
+
+struct baseline *baseline_new(void);
+struct baseline *baseline_clone(struct baseline *map);
+void baseline_delete(struct baseline *map);
+size_t baseline_size(struct baseline *map);
+size_t baseline_buckets(struct baseline *map);
+void baseline_rehash(struct baseline *map, size_t buckets);
+
+int baseline_set(struct baseline *map, const char *key, size_t len, void *value);
+void *baseline_get(struct baseline *map, const char *key, size_t len);
+int baseline_del(struct baseline *map, const char *key, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,528 @@
+/*
+ * Benchmarks for struct dict, with std::unordered_map as a baseline.
+ *
+ * Every workload runs against both dict engines and the baseline, for a
+ * table that fits in the last level cache and one that is much bigger, and
+ * for several key lengths. Keys and access sequences come from a fixed seed
+ * and are generated before timing starts, so runs are reproducible and only
+ * the table operations are measured.
+ *
+ * Results are printed as one JSON object per line: the workload, the
+ * implementation, the table size, key length and number of operations,
+ * ns/op, millions of operations per second, the peak RSS of the process so
+ * far, and cache and branch misses when perf_event_open() is available (null
+ * otherwise). Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "dict.h"
+#include "baseline.h"
+
+#define SEED 0x5eed
+#define ZIPF_S 0.99
+
+// Set in the hit50 sequence for indexes into the miss keys.
+#define MISS_BIT 0x80000000u
+
+// A table implementation under test.
+struct impl {
+    const char *name;
+    void *(*create)(void);
+    void *(*clone)(void *table);
+    void (*destroy)(void *table);
+    void (*grow)(void *table);
+    int (*set)(void *table, char *key, size_t len, void *value);
+    int (*get)(void *table, char *key, size_t len);
+    int (*del)(void *table, char *key, size_t len);
+};
+
+// n keys of len bytes each, back to back and not terminated.
+struct keys {
+    char *buf;
+    size_t n;
+    size_t len;
+};
+
+static uint64_t rng = SEED;
+static int perf_fds[2] = {-1, -1};
+static struct timespec started;
+
+/**
+ * xorshift64*, so runs don't depend on the platform's rand().
+ **/
+static uint64_t _rand(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * UINT64_C(2685821657736338717);
+}
+
+static void *_xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    
+    if (p == NULL) {
+        fprintf(stderr, "dict-bench: out of memory\n");
+        exit(1);
+    }
+    
+    return p;
+}
+
+static void *_dict_create(int engine)
+{
+    struct dict_opts opts;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.engine = engine;
+    return dict_new_opts(&opts);
+}
+
+static void *_chained_create(void)
+{
+    return _dict_create(DICT_ENGINE_CHAINED);
+}
+
+static void *_probed_create(void)
+{
+    return _dict_create(DICT_ENGINE_PROBED);
+}
+
+static void *_dict_clone(void *table)
+{
+    return dict_clone(table, NULL, NULL);
+}
+
+static void _dict_destroy(void *table)
+{
+    dict_delete(table);
+}
+
+static void _dict_grow(void *table)
+{
+    struct dict *dict = table;
+    
+    dict_resize(dict, (dict->rehash_table != NULL ? dict->rehash_capacity : dict->capacity) * 2);
+}
+
+static int _dict_set(void *table, char *key, size_t len, void *value)
+{
+    return dict_set_n(table, key, len, value);
+}
+
+static int _dict_get(void *table, char *key, size_t len)
+{
+    return dict_get_n(table, key, len) != NULL;
+}
+
+static int _dict_del(void *table, char *key, size_t len)
+{
+    return dict_del_n(table, key, len);
+}
+
+static void *_baseline_create(void)
+{
+    return baseline_new();
+}
+
+static void *_baseline_clone(void *table)
+{
+    return baseline_clone(table);
+}
+
+static void _baseline_destroy(void *table)
+{
+    baseline_delete(table);
+}
+
+static void _baseline_grow(void *table)
+{
+    baseline_rehash(table, baseline_buckets(table) * 2);
+}
+
+static int _baseline_set(void *table, char *key, size_t len, void *value)
+{
+    return baseline_set(table, key, len, value);
+}
+
+static int _baseline_get(void *table, char *key, size_t len)
+{
+    return baseline_get(table, key, len) != NULL;
+}
+
+static int _baseline_del(void *table, char *key, size_t len)
+{
+    return baseline_del(table, key, len);
+}
+
+static const struct impl impls[] = {
+    {"chained", _chained_create, _dict_clone, _dict_destroy, _dict_grow, _dict_set, _dict_get, _dict_del},
+    {"probed", _probed_create, _dict_clone, _dict_destroy, _dict_grow, _dict_set, _dict_get, _dict_del},
+    {"unordered_map", _baseline_create, _baseline_clone, _baseline_destroy, _baseline_grow, _baseline_set, _baseline_get, _baseline_del},
+};
+
+/**
+ * Generates n distinct keys of len bytes, starting with tag. The last five
+ * characters spell out the index, so keys with different tags or indexes
+ * never collide.
+ **/
+static void _keys_fill(struct keys *keys, size_t n, size_t len, char tag)
+{
+    static const char alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    size_t i, j, idx;
+    char *key;
+    
+    keys->buf = _xmalloc(n * len);
+    keys->n = n;
+    keys->len = len;
+    
+    for (i = 0; i < n; i++) {
+        key = keys->buf + i * len;
+        for (j = 0; j < len; j++) {
+            key[j] = alphabet[_rand() % 62];
+        }
+        
+        key[0] = tag;
+        for (j = len - 1, idx = i; j >= len - 5; j--, idx /= 62) {
+            key[j] = alphabet[idx % 62];
+        }
+    }
+}
+
+static char *_key(struct keys *keys, size_t i)
+{
+    return keys->buf + i * keys->len;
+}
+
+/**
+ * Fills seq with ops indexes below n drawn from a Zipf distribution, with
+ * ranks assigned to indexes in a random order.
+ **/
+static void _zipf_fill(uint32_t *seq, size_t ops, size_t n)
+{
+    double *cdf = _xmalloc(n * sizeof(*cdf));
+    uint32_t *rank = _xmalloc(n * sizeof(*rank));
+    double sum = 0.0, u;
+    size_t i, j, lo, hi, mid;
+    uint32_t tmp;
+    
+    for (i = 0; i < n; i++) {
+        sum += 1.0 / pow((double)(i + 1), ZIPF_S);
+        cdf[i] = sum;
+        rank[i] = (uint32_t)i;
+    }
+    
+    for (i = n - 1; i > 0; i--) {
+        j = _rand() % (i + 1);
+        tmp = rank[i];
+        rank[i] = rank[j];
+        rank[j] = tmp;
+    }
+    
+    for (i = 0; i < ops; i++) {
+        u = (double)(_rand() >> 11) / (double)(UINT64_C(1) << 53) * sum;
+        
+        for (lo = 0, hi = n - 1; lo < hi; ) {
+            mid = lo + (hi - lo) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        
+        seq[i] = rank[lo];
+    }
+    
+    free(rank);
+    free(cdf);
+}
+
+#ifdef __linux__
+static int _perf_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+    
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/**
+ * Opens the cache and branch miss counters, where the kernel allows it.
+ **/
+static void _perf_init(void)
+{
+#ifdef __linux__
+    perf_fds[0] = _perf_open(PERF_COUNT_HW_CACHE_MISSES);
+    perf_fds[1] = _perf_open(PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+}
+
+static void _bench_start(void)
+{
+#ifdef __linux__
+    int i;
+    
+    for (i = 0; i < 2; i++) {
+        if (perf_fds[i] >= 0) {
+            ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+    
+    clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+/**
+ * Prints the result of the workload timed since _bench_start().
+ **/
+static void _bench_end(const char *bench, const struct impl *impl, size_t entries, size_t key_len, size_t ops)
+{
+    struct timespec now;
+    struct rusage usage;
+    long long misses[2] = {-1, -1};
+    uint64_t count;
+    double ns;
+    int i;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+#ifdef __linux__
+    for (i = 0; i < 2; i++) {
+        if (perf_fds[i] >= 0) {
+            ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(perf_fds[i], &count, sizeof(count)) == sizeof(count)) {
+                misses[i] = (long long)count;
+            }
+        }
+    }
+#endif
+    
+    getrusage(RUSAGE_SELF, &usage);
+    ns = (double)(now.tv_sec - started.tv_sec) * 1e9 + (double)(now.tv_nsec - started.tv_nsec);
+    
+    printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"entries\":%lu,\"key_len\":%lu,\"ops\":%lu,"
+           "\"ns_per_op\":%.2f,\"mops\":%.3f,\"peak_rss_kb\":%ld",
+           bench, impl->name, (unsigned long)entries, (unsigned long)key_len, (unsigned long)ops,
+           ns / (double)ops, (double)ops / ns * 1e3, usage.ru_maxrss);
+        
+    for (i = 0; i < 2; i++) {
+        printf(i == 0 ? ",\"cache_misses\":" : ",\"branch_misses\":");
+        if (misses[i] >= 0) {
+            printf("%lld", misses[i]);
+        } else {
+            printf("null");
+        }
+    }
+        
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void _check(const char *bench, size_t found, size_t expected)
+{
+    if (found != expected) {
+        fprintf(stderr, "dict-bench: %s found %lu keys, expected %lu\n", bench, (unsigned long)found, (unsigned long)expected);
+        exit(1);
+    }
+}
+
+/**
+ * Runs every workload against one implementation. uniform and zipf hold ops
+ * indexes below keys->n, and hit50 as many that are half misses.
+ **/
+static void _run(const struct impl *impl, struct keys *keys, struct keys *misses,
+    uint32_t *uniform, uint32_t *zipf, uint32_t *hit50, size_t ops)
+{
+    size_t n = keys->n, len = keys->len;
+    size_t i, found = 0, expected = 0;
+    void *table, *clone;
+    char *key;
+    
+    table = impl->create();
+    
+    _bench_start();
+    for (i = 0; i < n; i++) {
+        impl->set(table, _key(keys, i), len, (void *)(uintptr_t)(i + 1));
+    }
+    _bench_end("insert", impl, n, len, n);
+    
+    _bench_start();
+    for (i = 0; i < ops; i++) {
+        found += impl->get(table, _key(keys, uniform[i]), len);
+    }
+    _bench_end("get_uniform", impl, n, len, ops);
+    _check("get_uniform", found, ops);
+    
+    found = 0;
+    _bench_start();
+    for (i = 0; i < ops; i++) {
+        found += impl->get(table, _key(keys, zipf[i]), len);
+    }
+    _bench_end("get_zipf", impl, n, len, ops);
+    _check("get_zipf", found, ops);
+    
+    for (i = 0; i < ops; i++) {
+        expected += !(hit50[i] & MISS_BIT);
+    }
+    
+    found = 0;
+    _bench_start();
+    for (i = 0; i < ops; i++) {
+        key = hit50[i] & MISS_BIT ? _key(misses, hit50[i] & ~MISS_BIT) : _key(keys, hit50[i]);
+        found += impl->get(table, key, len);
+    }
+    _bench_end("get_hit50", impl, n, len, ops);
+    _check("get_hit50", found, expected);
+    
+    found = 0;
+    _bench_start();
+    for (i = 0; i < ops; i++) {
+        found += impl->get(table, _key(misses, uniform[i]), len);
+    }
+    _bench_end("get_miss", impl, n, len, ops);
+    _check("get_miss", found, 0);
+    
+    // Each round deletes a key and inserts it back.
+    found = 0;
+    _bench_start();
+    for (i = 0; i < ops / 2; i++) {
+        found += impl->del(table, _key(keys, uniform[i]), len);
+        impl->set(table, _key(keys, uniform[i]), len, (void *)(uintptr_t)(uniform[i] + 1));
+    }
+    _bench_end("churn", impl, n, len, ops / 2 * 2);
+    _check("churn", found, ops / 2);
+    
+    // Resizing and cloning are timed per entry moved.
+    _bench_start();
+    impl->grow(table);
+    _bench_end("resize", impl, n, len, n);
+    
+    _bench_start();
+    clone = impl->clone(table);
+    _bench_end("clone", impl, n, len, n);
+    
+    impl->destroy(clone);
+    impl->destroy(table);
+}
+
+static void _usage(void)
+{
+    fprintf(stderr,
+        "usage: dict-bench [-q] [-n entries] [-k key_len] [-o ops]\n"
+        "  -q  quick run, with small tables and few operations\n"
+        "  -n  only benchmark tables of this many entries\n"
+        "  -k  only benchmark keys of this many bytes (at least 6)\n"
+        "  -o  operations per lookup workload\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    // A table that fits in the last level cache, and one much bigger.
+    size_t sizes[2] = {1 << 14, 1 << 21};
+    size_t key_lens[3] = {8, 32, 64};
+    size_t nsizes = 2, nkey_lens = 3, ops = 1 << 20;
+    struct keys keys, misses;
+    uint32_t *uniform, *zipf, *hit50;
+    size_t s, k, i, m;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "qn:k:o:")) != -1) {
+        switch (opt) {
+        case 'q':
+            sizes[0] = 1 << 10;
+            sizes[1] = 1 << 14;
+            ops = 1 << 14;
+            break;
+        case 'n':
+            sizes[0] = strtoul(optarg, NULL, 10);
+            nsizes = 1;
+            break;
+        case 'k':
+            key_lens[0] = strtoul(optarg, NULL, 10);
+            nkey_lens = 1;
+            break;
+        case 'o':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            _usage();
+        }
+    }
+    
+    for (s = 0; s < nsizes; s++) {
+        if (sizes[s] == 0 || sizes[s] >= MISS_BIT) {
+            _usage();
+        }
+    }
+    
+    for (k = 0; k < nkey_lens; k++) {
+        if (key_lens[k] < 6) {
+            _usage();
+        }
+    }
+    
+    if (ops < 2) {
+        _usage();
+    }
+    
+    _perf_init();
+    
+    uniform = _xmalloc(ops * sizeof(*uniform));
+    zipf = _xmalloc(ops * sizeof(*zipf));
+    hit50 = _xmalloc(ops * sizeof(*hit50));
+    
+    for (s = 0; s < nsizes; s++) {
+        for (i = 0; i < ops; i++) {
+            uniform[i] = (uint32_t)(_rand() % sizes[s]);
+            hit50[i] = (uint32_t)(_rand() % sizes[s]) | (_rand() & 1 ? MISS_BIT : 0);
+        }
+        
+        _zipf_fill(zipf, ops, sizes[s]);
+        
+        for (k = 0; k < nkey_lens; k++) {
+            _keys_fill(&keys, sizes[s], key_lens[k], 'h');
+            _keys_fill(&misses, sizes[s], key_lens[k], 'm');
+            
+            for (m = 0; m < sizeof(impls) / sizeof(impls[0]); m++) {
+                _run(&impls[m], &keys, &misses, uniform, zipf, hit50, ops);
+            }
+            
+            free(keys.buf);
+            free(misses.buf);
+        }
+    }
+    
+    free(uniform);
+    free(zipf);
+    free(hit50);
+    return 0;
+}
@@ -5,8 +5,10 @@
 #include <string.h>
 #include <memory.h>
 
-#include "crc32.h"
 #include "dict.h"
+#include "dict_private.h"
+#include "hash.h"
+#include "probe.h"
 
 // Dummy clone function.
 static void *_dummy_clone_fn(void *p) { return p; }
@@ -14,510 +16,2717 @@ static void *_dummy_clone_fn(void *p) { return p; }
 // Dummy free function.
 static void _dummy_free_fn(void *p) { return; }
 
+// Number of empty buckets a single rehash step may skip over, per bucket it
+// is allowed to migrate. Bounds the work done by any one call.
+#define REHASH_EMPTY_VISITS 10
+
+static int _set_entry(struct dict *dict, char *key, size_t len, uint32_t hash, void *value, uint64_t expires);
+static inline int _key_fits_inline(struct dict *dict, size_t len);
+static int _del_hashed(struct dict *dict, char *key, size_t len, uint32_t hash);
+
+/**
+ * Returns the bucket head that hash belongs to. While rehashing, buckets of
+ * the old table below rehash_idx have already been migrated, so keys that map
+ * there live in the new table instead.
+ **/
+static struct dict_node *_dict_bucket(struct dict *dict, uint32_t hash)
+{
+    uint32_t idx = hash & (dict->capacity - 1);
+    
+    if (dict->rehash_table != NULL && idx < dict->rehash_idx) {
+        return DICT_NODE_AT(dict->rehash_table, dict->node_size, hash & (dict->rehash_capacity - 1));
+    }
+    
+    return dict_table_bucket(dict, idx);
+}
+
+/**
+ * Same as _dict_bucket(), for a bucket about to be modified. A segment still
+ * shared with a snapshot is copied in first.
+ *
+ * Returns NULL if the copy fails.
+ **/
+static struct dict_node *_dict_bucket_mut(struct dict *dict, uint32_t hash)
+{
+    uint32_t idx = hash & (dict->capacity - 1);
+    
+    if (dict->rehash_table != NULL && idx < dict->rehash_idx) {
+        return DICT_NODE_AT(dict->rehash_table, dict->node_size, hash & (dict->rehash_capacity - 1));
+    }
+    
+    if (dict->cow_base != NULL && !dict_cow_fault(dict, idx)) {
+        return NULL;
+    }
+    
+    return DICT_NODE_AT(dict->table, dict->node_size, idx);
+}
+
+/**
+ * Frees the key and value of an entry, or queues them until the snapshots
+ * that may still see them are released.
+ **/
+static void _free_entry(struct dict *dict, char *key, void *value)
+{
+    if (__atomic_load_n(&dict->snapshots, __ATOMIC_ACQUIRE) > 0) {
+        if (dict->key_free_fn != _dummy_free_fn) {
+            dict_defer_free(dict, dict->key_free_fn, key);
+        }
+        
+        if (dict->value_free_fn != _dummy_free_fn) {
+            dict_defer_free(dict, dict->value_free_fn, value);
+        }
+        
+        return;
+    }
+    
+    if (dict->garbage_len > 0) {
+        dict_collect_garbage(dict);
+    }
+    
+    dict->key_free_fn(key);
+    dict->value_free_fn(value);
+}
+
+/**
+ * Same as _free_entry(), for dict_cache.c.
+ **/
+void dict_free_entry(struct dict *dict, char *key, void *value)
+{
+    _free_entry(dict, key, value);
+}
+
+/**
+ * Returns the function dict frees its values with, or NULL if it has none,
+ * for dict_freeze().
+ **/
+void (*dict_value_free_fn(struct dict *dict))(void *)
+{
+    return dict->value_free_fn != _dummy_free_fn ? dict->value_free_fn : NULL;
+}
+
+/**
+ * Stops dict from freeing its values, once they were handed over to a
+ * frozen dict.
+ **/
+void dict_keep_values(struct dict *dict)
+{
+    dict->value_free_fn = _dummy_free_fn;
+}
+
+/**
+ * Returns the expiry of node, an entry of dict, or 0 if it has none.
+ **/
+static inline uint64_t _expires_of(struct dict *dict, struct dict_node *node)
+{
+    return (dict->flags & DICT_F_CACHE) ? DICT_CACHE_ENTRY(dict, node)->expires : 0;
+}
+
+/**
+ * Links node into the bucket it hashes to in table. If that bucket is still
+ * empty, the entry is copied into the bucket head instead, and node is
+ * returned so the caller can recycle it. Returns NULL otherwise.
+ **/
+static struct dict_node *_relink_node(struct dict *dict, struct dict_node *node, struct dict_node *table, uint32_t mask)
+{
+    struct dict_node *dst = DICT_NODE_AT(table, dict->node_size, node->hash & mask);
+    
+    if (dst->key == NULL) {
+        dict_node_copy(dict, dst, node);
+        dst->next = NULL;
+        return node;
+    }
+    
+    node->next = dst->next;
+    dst->next = node;
+    return NULL;
+}
+
+/**
+ * Moves the entry stored in a bucket head into table. Head entries live
+ * inside the old bucket array, so if the destination bucket is occupied the
+ * entry needs a chain node, which is taken from the spare list.
+ **/
+static void _relink_head(struct dict *dict, struct dict_node *head, struct dict_node *table, uint32_t mask, struct dict_node **spare)
+{
+    struct dict_node *dst = DICT_NODE_AT(table, dict->node_size, head->hash & mask);
+    struct dict_node *node;
+    
+    if (dst->key == NULL) {
+        dict_node_copy(dict, dst, head);
+        dst->next = NULL;
+    } else {
+        node = *spare;
+        *spare = node->next;
+        
+        dict_node_copy(dict, node, head);
+        node->next = dst->next;
+        dst->next = node;
+    }
+    
+    memset(head, 0, dict->node_size);
+}
+
+/**
+ * Moves every entry of the bucket at head into table, reusing the chain nodes
+ * and the cached hashes. When growing, the destination buckets of a single
+ * source bucket are disjoint from those of every other source bucket, so the
+ * head entry always lands in an empty bucket and no allocation is needed.
+ * When shrinking, buckets merge, and the head entry may take the node on the
+ * spare list.
+ **/
+static void _rehash_bucket(struct dict *dict, struct dict_node *head, struct dict_node *table, uint32_t mask, struct dict_node **spare)
+{
+    struct dict_node *cur, *next;
+    
+    if (head->key == NULL) {
+        return;
+    }
+    
+    cur = head->next;
+    _relink_head(dict, head, table, mask, spare);
+    
+    while (cur != NULL) {
+        next = cur->next;
+        pool_free(&dict->pool, _relink_node(dict, cur, table, mask));
+        cur = next;
+    }
+}
+
+/**
+ * Swaps in the new table once every bucket of the old one has been migrated.
+ **/
+static void _rehash_finish(struct dict *dict)
+{
+    // Every entry has moved out, so nothing is left to copy from a snapshot.
+    if (dict->cow_base != NULL) {
+        dict_cow_drop(dict);
+    }
+    
+    free(dict->table);
+    dict->table = dict->rehash_table;
+    dict->capacity = dict->rehash_capacity;
+    dict->rehash_table = NULL;
+    dict->rehash_capacity = 0;
+    dict->rehash_idx = 0;
+}
+
+/**
+ * Performs one step of incremental rehashing: migrates up to n non-empty
+ * buckets, visiting at most REHASH_EMPTY_VISITS empty buckets per migration.
+ *
+ * Returns 0 if a bucket shared with a snapshot couldn't be copied, or a
+ * chain node allocated while shrinking, and 1 otherwise.
+ **/
+static int _rehash_step(struct dict *dict, uint32_t n)
+{
+    struct dict_node *head, *spare = NULL;
+    uint32_t empty_visits = n > UINT32_MAX / REHASH_EMPTY_VISITS ? UINT32_MAX : n * REHASH_EMPTY_VISITS;
+    int status = 1;
+    
+    if (dict->rehash_table == NULL) {
+        return 1;
+    }
+    
+    while (n > 0 && dict->rehash_idx < dict->capacity) {
+        head = dict_table_bucket(dict, dict->rehash_idx);
+        if (head->key == NULL) {
+            dict->rehash_idx++;
+            if (--empty_visits == 0) {
+                break;
+            }
+            
+            continue;
+        }
+        
+        if (dict->cow_base != NULL) {
+            if (!dict_cow_fault(dict, dict->rehash_idx)) {
+                status = 0;
+                break;
+            }
+            
+            head = DICT_NODE_AT(dict->table, dict->node_size, dict->rehash_idx);
+        }
+        
+        // Shrinking: the bucket's head entry may need a chain node of its
+        // own, which is kept for the next bucket if it doesn't.
+        if (spare == NULL && dict->rehash_capacity < dict->capacity) {
+            spare = pool_alloc(&dict->pool);
+            if (spare == NULL) {
+                status = 0;
+                break;
+            }
+            
+            spare->next = NULL;
+        }
+        
+        _rehash_bucket(dict, head, dict->rehash_table, dict->rehash_capacity - 1, &spare);
+        dict->rehash_idx++;
+        n--;
+    }
+    
+    if (spare != NULL) {
+        pool_free(&dict->pool, spare);
+    }
+    
+    if (dict->rehash_idx >= dict->capacity) {
+        _rehash_finish(dict);
+    }
+    
+    return status;
+}
+
+/**
+ * Migrates every remaining bucket, completing an in-progress rehash. The
+ * rehash is left in progress if a bucket can't be copied from a snapshot,
+ * or a chain node can't be allocated.
+ **/
+static void _rehash_all(struct dict *dict)
+{
+    while (dict->rehash_table != NULL && _rehash_step(dict, UINT32_MAX)) {
+        continue;
+    }
+}
+
+/**
+ * Migrates up to n buckets of an in-progress rehash, for dict_expire().
+ **/
+void dict_rehash_step(struct dict *dict, uint32_t n)
+{
+    _rehash_step(dict, n);
+}
+
+/**
+ * Completes an in-progress rehash, for dict_snapshot().
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_rehash_all(struct dict *dict)
+{
+    _rehash_all(dict);
+    
+    return dict->rehash_table == NULL;
+}
+
+/**
+ * Starts an incremental rehash when the load factor exceeds max_load. If the
+ * new table cannot be allocated, the dict simply keeps its current size.
+ **/
+static void _expand_if_needed(struct dict *dict)
+{
+    struct dict_node *table;
+    uint32_t capacity;
+    
+    if (dict->max_load <= 0.0f) {
+        return;
+    }
+    
+    if (dict->rehash_table != NULL) {
+        // Inserts are outpacing the migration, so finish it off before the
+        // new table overloads as well.
+        if ((float)dict->used > (float)dict->rehash_capacity * dict->max_load) {
+            _rehash_all(dict);
+            if (dict->rehash_table != NULL) {
+                return;
+            }
+        } else {
+            return;
+        }
+    }
+    
+    if ((float)dict->used <= (float)dict->capacity * dict->max_load) {
+        return;
+    }
+    
+    capacity = dict->capacity;
+    while ((float)dict->used > (float)capacity * dict->max_load && capacity < (UINT32_C(1) << 31)) {
+        capacity <<= 1;
+    }
+    
+    if (capacity == dict->capacity) {
+        return;
+    }
+    
+    table = calloc(capacity, dict->node_size);
+    if (table == NULL) {
+        return;
+    }
+    
+    dict->rehash_table = table;
+    dict->rehash_capacity = capacity;
+    dict->rehash_idx = 0;
+    DICT_COUNT(dict, resizes, 1);
+}
+
+/**
+ * Creates a new dict object.
+ *
+ * @param   uint32_t seed - Hash seed.
+ * @param   uint32_t capacity - Number of buckets to allocate. Rounded up to
+ *                              the next power of two.
+ * @param   void (*key_free_fn)(void *) - Either a function pointer, or NULL.
+ * @param   void (*value_free_fn)(void *) - Either a function pointer, or NULL.
+ *
+ * @return  struct dict *
+ *
+ * Returns a newly allocated struct dict pointer, or NULL on error.
+ **/
+struct dict *dict_new(uint32_t seed, uint32_t capacity, void (*key_free_fn)(void *), void (*value_free_fn)(void *))
+{
+    struct dict_opts opts;
+    
+    dict_opts_init(&opts);
+    opts.seed = seed;
+    opts.capacity = capacity;
+    opts.key_free_fn = key_free_fn;
+    opts.value_free_fn = value_free_fn;
+    
+    return dict_new_opts(&opts);
+}
+
+/**
+ * Fills opts with the defaults used by dict_new().
+ *
+ * @param   struct dict_opts *opts
+ * @return  void
+ **/
+void dict_opts_init(struct dict_opts *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->capacity = 16;
+    opts->engine = DICT_ENGINE_CHAINED;
+}
+
+/**
+ * Creates a new dict object from an options struct, which must have been
+ * initialized with dict_opts_init().
+ *
+ * engine selects the collision resolution scheme. DICT_ENGINE_CHAINED keeps
+ * one entry per bucket, and chains collisions in separately allocated nodes.
+ * DICT_ENGINE_PROBED stores entries in a flat open addressing table, probed a
+ * group of 1-byte hash tags at a time with SIMD compares. A max_load of 0
+ * selects the default for the engine. Tables shrink once deletes take the
+ * load factor below min_load (0 selects DICT_DEFAULT_MIN_LOAD, < 0 never
+ * shrinks), but never below capacity, see dict_set_min_load().
+ *
+ * With DICT_F_OWN_KEYS set in flags, dict_set copies every new key, and
+ * key_free_fn is ignored. Keys shorter than key_inline bytes (0 selects
+ * DICT_DEFAULT_KEY_INLINE) are stored inline in the node, longer ones in an
+ * arena owned by the dict. Arena space of deleted keys is only reclaimed by
+ * dict_clear().
+ *
+ * DICT_F_U64_KEYS makes a dict for 64-bit integer keys, see dict_u64_set().
+ * It implies DICT_F_OWN_KEYS, with key_inline set to 8 bytes so every key
+ * is stored as a word in its node, and the default hash policy becomes
+ * DICT_HASH_U64.
+ *
+ * A value_size above 0 stores values inline: every node carries a slot of
+ * value_size bytes, and dict_set copies value_size bytes from the value
+ * pointer it is given into it, instead of storing the pointer. node->value
+ * then points at the slot, and value_free_fn is ignored. Suits small
+ * records, which no longer need an allocation of their own.
+ *
+ * DICT_F_CACHE makes the dict a bounded cache. Once it holds more than
+ * max_entries entries, or more than max_bytes bytes of keys and values (0
+ * for no bound), dict_set evicts entries that haven't been looked up
+ * recently, by the CLOCK algorithm, freeing them with key_free_fn and
+ * value_free_fn. Values are counted as value_bytes_fn(value) bytes (0 if
+ * it's NULL), or value_size for inline values. Entries stored with
+ * dict_set_ttl() expire after a while, measured by clock_fn (default: a
+ * monotonic clock in milliseconds).
+ *
+ * hash selects the hash policy. DICT_HASH_CRC32 (default) and
+ * DICT_HASH_FAST64 are seeded with seed, and are fine for trusted keys.
+ * Anyone who controls the keys can craft collisions for them regardless of
+ * the seed, though, so hash untrusted input with DICT_HASH_SIPHASH. It is
+ * keyed with hash_key, which should come from a random source. If hash_key
+ * is left zeroed, it is derived from seed. DICT_HASH_U64 is for 8 byte
+ * integer keys, and hashes them with one multiply-xorshift finalizer.
+ *
+ * @param   const struct dict_opts *opts
+ * @return  struct dict *
+ *
+ * Returns a newly allocated struct dict pointer, or NULL on error.
+ **/
+struct dict *dict_new_opts(const struct dict_opts *opts)
+{
+    struct dict *dict;
+    struct dict_node *table;
+    uint32_t capacity;
+    
+    capacity = dict_next_capacity(opts->capacity);
+    
+    dict = malloc(sizeof(*dict));
+    if (dict == NULL) {
+        return NULL;
+    }
+    
+    memset(dict, 0, sizeof(*dict));
+    dict->flags = opts->flags;
+    dict->node_size = sizeof(struct dict_node);
+    dict->hash = opts->hash;
+    
+    if (dict->flags & DICT_F_U64_KEYS) {
+        dict->flags |= DICT_F_OWN_KEYS;
+        dict->hash = dict->hash == DICT_HASH_CRC32 ? DICT_HASH_U64 : dict->hash;
+        dict->key_inline = sizeof(uint64_t);
+        dict->node_size += dict->key_inline;
+    } else if (dict->flags & DICT_F_OWN_KEYS) {
+        dict->key_inline = opts->key_inline > 0 ? opts->key_inline : DICT_DEFAULT_KEY_INLINE;
+        dict->node_size = (sizeof(struct dict_node) + dict->key_inline + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        dict->key_inline = dict->node_size - sizeof(struct dict_node);
+    }
+    
+    if (opts->value_size > 0) {
+        if (opts->value_size > UINT32_MAX / 2) {
+            free(dict);
+            return NULL;
+        }
+        
+        dict->value_size = opts->value_size;
+        dict->value_offset = dict->node_size;
+        dict->node_size += (opts->value_size + sizeof(void *) - 1) & ~(uint32_t)(sizeof(void *) - 1);
+    }
+    
+    if (dict->flags & DICT_F_CACHE) {
+        dict->cache_offset = dict->node_size;
+        dict->node_size += sizeof(struct dict_cache_entry);
+        dict->max_entries = opts->max_entries;
+        dict->max_bytes = opts->max_bytes;
+        dict->value_bytes_fn = opts->value_bytes_fn;
+        dict->clock_fn = opts->clock_fn != NULL ? opts->clock_fn : dict_cache_clock;
+    }
+    
+    pool_init(&dict->pool, dict->node_size);
+    arena_init(&dict->arena);
+    dict->engine = opts->engine;
+    dict->hash_fn = hash_policy_fn(dict->hash);
+    
+    if (dict->hash_fn == NULL) {
+        free(dict);
+        return NULL;
+    }
+    
+    if (dict->hash == DICT_HASH_SIPHASH) {
+        dict->hash_key[0] = opts->hash_key[0];
+        dict->hash_key[1] = opts->hash_key[1];
+        
+        if (dict->hash_key[0] == 0 && dict->hash_key[1] == 0) {
+            hash_derive_key(opts->seed, dict->hash_key);
+        }
+    } else {
+        dict->hash_key[0] = opts->seed;
+        dict->hash_key[1] = 0;
+    }
+    
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        if (!probe_alloc(dict, capacity)) {
+            free(dict);
+            return NULL;
+        }
+        
+        dict->max_load = DICT_DEFAULT_PROBED_MAX_LOAD;
+    } else {
+        table = calloc(capacity, dict->node_size);
+        if (table == NULL) {
+            free(dict);
+            return NULL;
+        }
+        
+        dict->table = table;
+        dict->capacity = capacity;
+        dict->max_load = DICT_DEFAULT_MAX_LOAD;
+    }
+    
+    dict->used = 0;
+    dict->seed = opts->seed;
+    dict->key_free_fn = opts->key_free_fn != NULL && !(dict->flags & DICT_F_OWN_KEYS) ? opts->key_free_fn : _dummy_free_fn;
+    dict->value_free_fn = opts->value_free_fn != NULL && dict->value_size == 0 ? opts->value_free_fn : _dummy_free_fn;
+    dict->rehash_table = NULL;
+    dict->rehash_capacity = 0;
+    dict->rehash_idx = 0;
+    
+    if (opts->max_load > 0.0f) {
+        dict->max_load = opts->max_load;
+    }
+    
+    dict->min_load = opts->min_load == 0.0f ? DICT_DEFAULT_MIN_LOAD : opts->min_load;
+    dict->min_capacity = dict->capacity;
+    
+    return dict;
+}
+
+/**
+ * Sets the load factor (used / capacity) above which dict_set starts growing
+ * the table. Growth is incremental: entries are migrated a few buckets at a
+ * time by later calls to dict_set and dict_del, never by lookups, so nodes
+ * returned by dict_get stay put until the dict is modified.
+ *
+ * DICT_ENGINE_PROBED tables are rebuilt in one go instead, and always grow
+ * once they are about to run out of empty slots.
+ *
+ * @param   struct dict *dict
+ * @param   float max_load - Maximum load factor, or <= 0 to disable growth.
+ * @return  void
+ **/
+void dict_set_max_load(struct dict *dict, float max_load)
+{
+    dict->max_load = max_load;
+}
+
+/**
+ * Sets the load factor below which dict_del and dict_expire start shrinking
+ * the table (default DICT_DEFAULT_MIN_LOAD), to the smallest capacity loaded
+ * to at most max_load / 2, but not below the capacity the dict was created
+ * with, so iterating over it follows the number of entries rather than its
+ * peak. Chained dicts move their entries over incrementally, as when
+ * growing; DICT_ENGINE_PROBED dicts resize in one go. Lookups never shrink
+ * the table, not even when they delete expired cache entries. Memory of
+ * deleted entries is kept for reuse, see dict_compact() to release it.
+ *
+ * Values above max_load / 4 are treated as max_load / 4. Growing leaves the
+ * table loaded to about max_load / 2, so the gap keeps a dict whose size
+ * hovers around either threshold from growing and shrinking by turns.
+ *
+ * @param   struct dict *dict
+ * @param   float min_load - Minimum load factor, or <= 0 to never shrink.
+ * @return  void
+ **/
+void dict_set_min_load(struct dict *dict, float min_load)
+{
+    dict->min_load = min_load;
+}
+
+/**
+ * Returns the smallest capacity at which dict is loaded to at most load.
+ **/
+static uint32_t _fit_capacity(struct dict *dict, float load)
+{
+    uint32_t capacity = 1;
+    
+    while ((float)dict->used > (float)capacity * load && capacity < (UINT32_C(1) << 31)) {
+        capacity <<= 1;
+    }
+    
+    return capacity;
+}
+
+/**
+ * Returns 1 if node's key is owned by dict and kept in its arena.
+ **/
+static inline int _key_in_arena(struct dict *dict, struct dict_node *node)
+{
+    return (dict->flags & DICT_F_OWN_KEYS) && node->key != DICT_NODE_DATA(node);
+}
+
+/**
+ * Moves the chain nodes and the owned keys kept in the arena into a new
+ * pool and arena, sized for the live entries only, and releases the old
+ * ones. Memory of deleted entries is otherwise only recycled by the pool,
+ * and only reclaimed from the arena by dict_clear(). Everything is
+ * allocated before anything is moved, so a failure leaves dict unchanged.
+ *
+ * dict must not be rehashing, or share buckets with a snapshot.
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+static int _repack(struct dict *dict)
+{
+    struct dict_node *head, *cur, *node, **link;
+    struct pool pool;
+    struct arena arena;
+    size_t nodes = 0, bytes = 0;
+    char *keys = NULL;
+    uint32_t i;
+    
+    for (i = 0; i < dict->capacity; i++) {
+        head = DICT_NODE_AT(dict->table, dict->node_size, i);
+        for (cur = head->key != NULL ? head : NULL; cur != NULL; cur = cur->next) {
+            nodes += cur != head;
+            bytes += _key_in_arena(dict, cur) ? (size_t)cur->key_len + 1 : 0;
+        }
+    }
+    
+    pool_init(&pool, dict->node_size);
+    arena_init(&arena);
+    
+    if (!pool_reserve(&pool, nodes) || (bytes > 0 && (keys = arena_alloc(&arena, bytes)) == NULL)) {
+        pool_release(&pool);
+        arena_release(&arena);
+        return 0;
+    }
+    
+    for (i = 0; i < dict->capacity; i++) {
+        head = DICT_NODE_AT(dict->table, dict->node_size, i);
+        if (head->key == NULL) {
+            continue;
+        }
+        
+        link = &head->next;
+        for (cur = head; cur != NULL; cur = cur->next) {
+            node = cur;
+            
+            if (cur != head) {
+                node = pool_alloc(&pool);
+                dict_node_copy(dict, node, cur);
+                *link = node;
+                link = &node->next;
+            }
+            
+            if (_key_in_arena(dict, node)) {
+                memcpy(keys, node->key, (size_t)node->key_len + 1);
+                node->key = keys;
+                keys += (size_t)node->key_len + 1;
+            }
+        }
+    }
+    
+    pool_release(&dict->pool);
+    arena_release(&dict->arena);
+    dict->pool = pool;
+    dict->arena = arena;
+    
+    return 1;
+}
+
+/**
+ * Starts shrinking the table after a delete, once its load factor drops
+ * below min_load, see dict_set_min_load(). Chained dicts shrink by the same
+ * incremental rehash as they grow by, into a smaller table, so no single
+ * delete pays for more than a step of it. Not while a rehash is in progress,
+ * or while dict shares buckets with a snapshot.
+ **/
+void dict_shrink_if_needed(struct dict *dict)
+{
+    float min_load = dict->min_load;
+    struct dict_node *table;
+    uint32_t capacity;
+    
+    if (min_load <= 0.0f || dict->max_load <= 0.0f || dict->rehash_table != NULL || dict->cow_base != NULL) {
+        return;
+    }
+    
+    if (min_load > dict->max_load / 4) {
+        min_load = dict->max_load / 4;
+    }
+    
+    if (dict->capacity <= dict->min_capacity || (float)dict->used >= (float)dict->capacity * min_load) {
+        return;
+    }
+    
+    capacity = _fit_capacity(dict, dict->max_load / 2);
+    if (capacity < dict->min_capacity) {
+        capacity = dict->min_capacity;
+    }
+    
+    if (capacity >= dict->capacity) {
+        return;
+    }
+    
+    // The probed engine has no incremental rehash, and resizes in one go,
+    // as it does to grow.
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        probe_resize(dict, capacity);
+        return;
+    }
+    
+    table = calloc(capacity, dict->node_size);
+    if (table == NULL) {
+        return;
+    }
+    
+    dict->rehash_table = table;
+    dict->rehash_capacity = capacity;
+    dict->rehash_idx = 0;
+    DICT_COUNT(dict, resizes, 1);
+}
+
+/**
+ * Shrinks dict to the smallest capacity that holds its entries at max_load,
+ * regardless of the capacity it was created with, and moves its chain nodes
+ * and owned keys into memory sized for the live entries, releasing what
+ * deleted entries left behind to the allocator. Useful after deleting most
+ * of a dict, for it to take the memory and iteration time of the entries
+ * that are left, rather than of its peak.
+ *
+ * Takes time in proportion to the capacity, and copies in any buckets still
+ * shared with a snapshot.
+ *
+ * @param   struct dict *dict
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_compact(struct dict *dict)
+{
+    float max_load = dict->max_load;
+    
+    if (max_load <= 0.0f) {
+        max_load = dict->engine == DICT_ENGINE_PROBED ? DICT_DEFAULT_PROBED_MAX_LOAD : DICT_DEFAULT_MAX_LOAD;
+    }
+    
+    if (dict->cow_base != NULL && !dict_cow_fault_all(dict)) {
+        return 0;
+    }
+    
+    if (!dict_resize(dict, _fit_capacity(dict, max_load))) {
+        return 0;
+    }
+    
+    return _repack(dict);
+}
+
+/**
+ * Frees the keys/values of a single bucket array, and empties it. Chain
+ * nodes are left to the caller, which releases the node pool in one go.
+ * Entries of dict->table still shared with a snapshot are freed too, as
+ * they belong to the dict.
+ **/
+static void _clear_table(struct dict *dict, struct dict_node *table, uint32_t capacity)
+{
+    struct dict_node *head, *cur;
+    uint32_t i;
+    
+    // Nothing to free per entry, so don't walk the chains at all.
+    if (dict->key_free_fn == _dummy_free_fn && dict->value_free_fn == _dummy_free_fn) {
+        memset(table, 0, (size_t)dict->node_size * capacity);
+        return;
+    }
+    
+    for (i = 0; i < capacity; i++) {
+        head = table == dict->table ? dict_table_bucket(dict, i) : DICT_NODE_AT(table, dict->node_size, i);
+        if (head->key != NULL) {
+            for (cur = head->next; cur != NULL; cur = cur->next) {
+                // Free key/value.
+                _free_entry(dict, cur->key, cur->value);
+            }
+            
+            // Free key/value.
+            _free_entry(dict, head->key, head->value);
+        }
+    }
+    
+    memset(table, 0, (size_t)dict->node_size * capacity);
+}
+
+/**
+ * Clears all key/value pairs in dict object. An in-progress rehash is
+ * abandoned, and the dict keeps its current (old) table. Chain nodes are
+ * released a whole slab at a time.
+ *
+ * @param   struct dict *dict
+ * @return  void
+ **/
+void dict_clear(struct dict *dict)
+{
+    _clear_table(dict, dict->table, dict->capacity);
+    
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        probe_reset(dict);
+    }
+    
+    if (dict->rehash_table != NULL) {
+        _clear_table(dict, dict->rehash_table, dict->rehash_capacity);
+        free(dict->rehash_table);
+        dict->rehash_table = NULL;
+        dict->rehash_capacity = 0;
+        dict->rehash_idx = 0;
+    }
+    
+    if (dict->cow_base != NULL) {
+        dict_cow_drop(dict);
+    }
+    
+    pool_release(&dict->pool);
+    arena_reset(&dict->arena);
+    dict->used = 0;
+    dict->bytes = 0;
+    dict->ttls = 0;
+}
+
+/**
+ * Deletes a dict object, and frees all associated memory. Snapshots of
+ * dict must be released first.
+ *
+ * @param   struct dict *dict
+ * @return  void
+ **/
+void dict_delete(struct dict *dict)
+{
+    dict_clear(dict);
+    dict_collect_garbage(dict);
+    free(dict->garbage);
+    arena_release(&dict->arena);
+    free(dict->table);
+    free(dict->ctrl);
+    free(dict);
+}
+
+/**
+ * When shrinking, several source buckets fold into one destination bucket, so
+ * more entries end up in chain nodes than before. Counts how many extra nodes
+ * a resize into table needs, by marking the destination buckets in use.
+ **/
+static size_t _resize_shortage(struct dict *dict, struct dict_node *table, uint32_t capacity)
+{
+    struct dict_node *cur, *dst;
+    size_t occupied_src = 0;
+    size_t occupied_dst = 0;
+    uint32_t i;
+    
+    for (i = 0; i < dict->capacity; i++) {
+        cur = DICT_NODE_AT(dict->table, dict->node_size, i);
+        if (cur->key == NULL) {
+            continue;
+        }
+        
+        occupied_src++;
+        for (; cur != NULL; cur = cur->next) {
+            dst = DICT_NODE_AT(table, dict->node_size, cur->hash & (capacity - 1));
+            if (dst->next == NULL) {
+                dst->next = dst;
+                occupied_dst++;
+            }
+        }
+    }
+    
+    memset(table, 0, (size_t)dict->node_size * capacity);
+    return occupied_src > occupied_dst ? occupied_src - occupied_dst : 0;
+}
+
+/**
+ * Resizes a dict object in place. Any in-progress incremental rehash is
+ * completed first. The capacity is rounded up to the next power of two.
+ * DICT_ENGINE_PROBED dicts need at least one slot more than they hold
+ * entries, and fail to resize below that.
+ *
+ * Existing chain nodes are relinked into the new bucket array using their
+ * cached hashes, so no key is hashed again. Growing only allocates the new
+ * bucket array. Shrinking may also need a few chain nodes, which are
+ * allocated before anything is moved, so a failed resize leaves the dict
+ * untouched.
+ *
+ * @param   struct dict *dict
+ * @param   uint32_t capacity
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_resize(struct dict *dict, uint32_t capacity)
+{
+    struct dict_node *table;
+    struct dict_node *spare = NULL;
+    struct dict_node *head, *cur, *next, *node;
+    size_t shortage = 0;
+    uint32_t i;
+    
+    capacity = dict_next_capacity(capacity);
+    
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        return capacity == dict->capacity || probe_resize(dict, capacity);
+    }
+    
+    _rehash_all(dict);
+    
+    if (dict->rehash_table != NULL) {
+        return 0;
+    }
+    
+    if (capacity == dict->capacity) {
+        return 1;
+    }
+    
+    // Entries are relinked in place, so they must all be the dict's own.
+    if (dict->cow_base != NULL && !dict_cow_fault_all(dict)) {
+        return 0;
+    }
+    
+    table = calloc(capacity, dict->node_size);
+    if (table == NULL) {
+        return 0;
+    }
+    
+    if (capacity < dict->capacity) {
+        shortage = _resize_shortage(dict, table, capacity);
+    }
+    
+    for (; shortage > 0; shortage--) {
+        node = pool_alloc(&dict->pool);
+        if (node == NULL) {
+            while (spare != NULL) {
+                next = spare->next;
+                pool_free(&dict->pool, spare);
+                spare = next;
+            }
+            
+            free(table);
+            return 0;
+        }
+        
+        node->next = spare;
+        spare = node;
+    }
+    
+    // Chain nodes go first. Any that land in an empty bucket free up a node
+    // for the head entries moved afterwards.
+    for (i = 0; i < dict->capacity; i++) {
+        head = DICT_NODE_AT(dict->table, dict->node_size, i);
+        cur = head->next;
+        head->next = NULL;
+        
+        while (cur != NULL) {
+            next = cur->next;
+            node = _relink_node(dict, cur, table, capacity - 1);
+            if (node != NULL) {
+                node->next = spare;
+                spare = node;
+            }
+            
+            cur = next;
+        }
+    }
+    
+    for (i = 0; i < dict->capacity; i++) {
+        head = DICT_NODE_AT(dict->table, dict->node_size, i);
+        if (head->key != NULL) {
+            _relink_head(dict, head, table, capacity - 1, &spare);
+        }
+    }
+    
+    while (spare != NULL) {
+        next = spare->next;
+        pool_free(&dict->pool, spare);
+        spare = next;
+    }
+    
+    free(dict->table);
+    dict->table = table;
+    dict->capacity = capacity;
+    DICT_COUNT(dict, resizes, 1);
+    return 1;
+}
+
+/**
+ * Clone dict object, using key_clone_fn and value_clone_fn, function pointers.
+ *
+ * If the clone function pointer for key/value is NULL, then it will simply do a
+ * static copy of the pointer. Doing this on heap allocated memory may lead to
+ * memory errors. key_clone_fn isn't used for dicts that own their keys.
+ *
+ * @param   struct dict *to_clone
+ * @param   void *(*key_clone_fn)(void *)
+ * @param   void *(*value_clone_fn)(void *)
+ * @return  struct dict *
+ *
+ * Returns NULL on error.
+ **/
+struct dict *dict_clone(struct dict *to_clone, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
+{
+    void *key_clone;
+    void *value_clone;
+    struct dict_iterator it;
+    struct dict_node *cur;
+    struct dict_opts opts;
+    struct dict *clone;
+    
+    dict_opts_of(to_clone, &opts);
+    
+    clone = dict_new_opts(&opts);
+    if (clone == NULL) {
+        return NULL;
+    }
+    
+    clone->max_load = to_clone->max_load;
+    
+    if (key_clone_fn == NULL) {
+        key_clone_fn = _dummy_clone_fn;
+    }
+    
+    if (value_clone_fn == NULL) {
+        value_clone_fn = _dummy_clone_fn;
+    }
+    
+    dict_iterate_start(to_clone, &it);
+    while ((cur = dict_iterate_next(&it)) != NULL) {
+        // Owned keys are copied by dict_set itself.
+        key_clone = (clone->flags & DICT_F_OWN_KEYS) ? cur->key : key_clone_fn(cur->key);
+        value_clone = clone->value_size > 0 ? cur->value : value_clone_fn(cur->value);
+        
+        if (_set_entry(clone, key_clone, cur->key_len, cur->hash, value_clone, _expires_of(to_clone, cur)) == 0) {
+            // Make sure key/value gets freed
+            clone->key_free_fn(key_clone);
+            clone->value_free_fn(value_clone);
+            
+            dict_delete(clone);
+            return NULL;
+        }
+    }
+    
+    return clone;
+}
+
+/**
+ * Places the entries of a bulk load, grouped by bucket in order, into the
+ * empty table of dict. Within a bucket, a later duplicate of a key replaces
+ * the earlier one, whose key and value are freed as dict_set() would. Every
+ * chain node comes from a single slab reserved up front.
+ *
+ * ends[b] is the index in order where bucket b's entries end.
+ *
+ * Returns 1 on success, and 0 on error (with the dict unchanged).
+ **/
+static int _place_grouped(struct dict *dict, char **keys, void **values, const uint32_t *hashes,
+                          const size_t *lens, const size_t *order, const size_t *ends, size_t n)
+{
+    struct dict_node *head, *node;
+    size_t b, i, j, k, start, overflow = n;
+    
+    // Every bucket's first entry goes in its head. Duplicates only lower
+    // the count, so this is an upper bound.
+    for (b = 0, start = 0; b < dict->capacity; start = ends[b], b++) {
+        if (ends[b] > start) {
+            overflow--;
+        }
+    }
+    
+    if (!pool_reserve(&dict->pool, overflow)) {
+        return 0;
+    }
+    
+    for (b = 0, start = 0; b < dict->capacity; start = ends[b], b++) {
+        head = DICT_NODE_AT(dict->table, dict->node_size, b);
+        
+        for (j = start; j < ends[b]; j++) {
+            i = order[j];
+            
+            for (k = j + 1; k < ends[b]; k++) {
+                if (hashes[order[k]] == hashes[i] && lens[order[k]] == lens[i] &&
+                    memcmp(keys[order[k]], keys[i], lens[i]) == 0) {
+                    break;
+                }
+            }
+            
+            if (k < ends[b]) {
+                dict->key_free_fn(keys[i]);
+                dict->value_free_fn(values[i]);
+                continue;
+            }
+            
+            if (head->key == NULL) {
+                node = head;
+                node->next = NULL;
+            } else {
+                node = pool_alloc(&dict->pool);
+                node->next = head->next;
+                head->next = node;
+            }
+            
+            node->hash = hashes[i];
+            node->key_len = (uint32_t)lens[i];
+            node->key = keys[i];
+            dict_store_value(dict, node, values[i]);
+            dict->used++;
+        }
+    }
+    
+    return 1;
+}
+
+/**
+ * Creates a dict holding keys[i] => values[i] for every i below n, sized for
+ * n entries up front. opts may be NULL for the defaults of dict_new(), and
+ * its capacity is raised to fit n entries at max_load.
+ *
+ * All keys are hashed in one pass, then counting-sorted by bucket and
+ * written into the table in bucket order, with all chain nodes carved out of
+ * one allocation. If a key occurs more than once, the last one wins, and
+ * the earlier duplicates are freed as dict_set() would. DICT_ENGINE_PROBED
+ * dicts, and dicts that own their keys, are sized and hashed the same way,
+ * but filled with dict_set_hashed(), after reserving the chain nodes and key
+ * copies they need, so nothing can fail once the first entry is stored.
+ *
+ * @param   char **keys
+ * @param   void **values
+ * @param   size_t n
+ * @param   const struct dict_opts *opts
+ * @return  struct dict *
+ *
+ * Returns NULL on error, before any key or value was freed. The caller
+ * still owns all of them.
+ **/
+struct dict *dict_from_arrays(char **keys, void **values, size_t n, const struct dict_opts *opts)
+{
+    struct dict_opts local;
+    struct dict *dict;
+    uint32_t *hashes = NULL;
+    size_t *lens = NULL, *order = NULL, *ends = NULL;
+    size_t i, b, ext = 0;
+    float max_load, buckets;
+    uint32_t requested;
+    int ok = 0;
+    
+    if (opts != NULL) {
+        local = *opts;
+    } else {
+        dict_opts_init(&local);
+    }
+    
+    max_load = local.max_load > 0.0f ? local.max_load :
+        local.engine == DICT_ENGINE_PROBED ? DICT_DEFAULT_PROBED_MAX_LOAD : DICT_DEFAULT_MAX_LOAD;
+    buckets = (float)n / max_load + (local.engine == DICT_ENGINE_PROBED ? 2 : 0);
+    
+    requested = dict_next_capacity(local.capacity);
+    if (buckets > (float)local.capacity) {
+        local.capacity = buckets >= 2147483648.0f ? (UINT32_C(1) << 31) : (uint32_t)buckets + 1;
+    }
+    
+    dict = dict_new_opts(&local);
+    if (dict == NULL) {
+        return NULL;
+    }
+    
+    // Sized for n, but free to shrink back to the capacity asked for.
+    if (requested < dict->min_capacity) {
+        dict->min_capacity = requested;
+    }
+    
+    hashes = malloc(n * sizeof(*hashes));
+    lens = malloc(n * sizeof(*lens));
+    if (n > 0 && (hashes == NULL || lens == NULL)) {
+        goto out;
+    }
+    
+    for (i = 0; i < n; i++) {
+        lens[i] = strlen(keys[i]);
+        if (lens[i] > UINT32_MAX) {
+            goto out;
+        }
+        
+        hashes[i] = dict->hash_fn(dict->hash_key, keys[i], lens[i]);
+    }
+    
+    if (dict->engine == DICT_ENGINE_PROBED || (dict->flags & (DICT_F_OWN_KEYS | DICT_F_CACHE))) {
+        // Duplicates and evictions free entries as they go, so every
+        // allocation has to be made before the first of them.
+        if (dict->flags & DICT_F_OWN_KEYS) {
+            for (i = 0; i < n; i++) {
+                ext += _key_fits_inline(dict, lens[i]) ? 0 : lens[i] + 1;
+            }
+            
+            if (!arena_reserve(&dict->arena, ext)) {
+                goto out;
+            }
+        }
+        
+        if (dict->engine == DICT_ENGINE_CHAINED && !pool_reserve(&dict->pool, n)) {
+            goto out;
+        }
+        
+        for (i = 0; i < n; i++) {
+            if (!dict_set_hashed(dict, keys[i], lens[i], hashes[i], values[i])) {
+                goto out;
+            }
+        }
+        
+        ok = 1;
+        goto out;
+    }
+    
+    order = malloc(n * sizeof(*order));
+    ends = calloc((size_t)dict->capacity, sizeof(*ends));
+    if ((n > 0 && order == NULL) || ends == NULL) {
+        goto out;
+    }
+    
+    // Counting sort by bucket. ends[b] first counts bucket b - 1, then
+    // becomes the start of bucket b, and while filling moves on to its end.
+    for (i = 0; i < n; i++) {
+        b = hashes[i] & (dict->capacity - 1);
+        if (b + 1 < dict->capacity) {
+            ends[b + 1]++;
+        }
+    }
+    
+    for (b = 1; b < dict->capacity; b++) {
+        ends[b] += ends[b - 1];
+    }
+    
+    for (i = 0; i < n; i++) {
+        order[ends[hashes[i] & (dict->capacity - 1)]++] = i;
+    }
+    
+    ok = _place_grouped(dict, keys, values, hashes, lens, order, ends, n);
+    
+out:
+    free(hashes);
+    free(lens);
+    free(order);
+    free(ends);
+    
+    if (!ok) {
+        // The entries placed so far belong to the caller.
+        dict->key_free_fn = _dummy_free_fn;
+        dict->value_free_fn = _dummy_free_fn;
+        dict_delete(dict);
+        return NULL;
+    }
+    
+    return dict;
+}
+
+/**
+ * Compares node against a key, like NODE_MATCHES(). A node with the same
+ * hash that turns out to hold another key is counted as a tag miss.
+ **/
+static inline int _node_matches(struct dict *dict, struct dict_node *node, uint32_t hash, const char *key, size_t len)
+{
+    if (node->hash != hash) {
+        return 0;
+    }
+    
+    if (node->key_len == len) {
+        DICT_COUNT(dict, compares, 1);
+        
+        if (dict_key_equal(node->key, key, len)) {
+            return 1;
+        }
+    }
+    
+    DICT_COUNT(dict, tag_misses, 1);
+    return 0;
+}
+
+/**
+ * Returns 1 if an owned key of len bytes is stored inline. Inline keys are
+ * NUL terminated, except for the integer keys of DICT_F_U64_KEYS dicts,
+ * which fill key_inline exactly.
+ **/
+static inline int _key_fits_inline(struct dict *dict, size_t len)
+{
+    return len < dict->key_inline || ((dict->flags & DICT_F_U64_KEYS) && len == dict->key_inline);
+}
+
+/**
+ * Reserves room for a copy of a new key, when the dict owns its keys and the
+ * key is too long to be stored inline. Done before the table is touched, so
+ * a failed allocation leaves the dict unchanged.
+ *
+ * Returns 1 on success (with *ext NULL if no room was needed), 0 on error.
+ **/
+static int _reserve_key(struct dict *dict, size_t len, char **ext)
+{
+    *ext = NULL;
+    
+    if ((dict->flags & DICT_F_OWN_KEYS) && !_key_fits_inline(dict, len)) {
+        *ext = arena_alloc(&dict->arena, len + 1);
+        return *ext != NULL;
+    }
+    
+    return 1;
+}
+
+/**
+ * Fills in the key of a new node. Owned keys are copied, inline or into the
+ * room reserved by _reserve_key(), and NUL terminated.
+ **/
+static void _store_key(struct dict *dict, struct dict_node *node, char *key, size_t len, char *ext)
+{
+    node->key_len = (uint32_t)len;
+    
+    if (!(dict->flags & DICT_F_OWN_KEYS)) {
+        node->key = key;
+        return;
+    }
+    
+    node->key = ext != NULL ? ext : DICT_NODE_DATA(node);
+    memcpy(node->key, key, len);
+    
+    if (ext != NULL || len < dict->key_inline) {
+        node->key[len] = '\0';
+    }
+}
+
+/**
+ * Replaces the value of an existing entry. The new key pointer replaces the
+ * old one too, unless the dict owns its keys.
+ **/
+static void _replace(struct dict *dict, struct dict_node *node, char *key, void *value)
+{
+    // Free key/value.
+    _free_entry(dict, node->key, node->value);
+    
+    if (!(dict->flags & DICT_F_OWN_KEYS)) {
+        node->key = key;
+    }
+    
+    dict_store_value(dict, node, value);
+}
+
+/**
+ * Records the size and expiry of an entry just stored, in cache mode.
+ **/
+static inline void _cache_stored(struct dict *dict, struct dict_node *node, uint64_t expires, int replaced)
+{
+    if (dict->flags & DICT_F_CACHE) {
+        dict_cache_store(dict, node, expires, replaced);
+    }
+}
+
+/**
+ * Takes an entry about to be deleted off the byte count of a cache.
+ **/
+static inline void _cache_removed(struct dict *dict, struct dict_node *node)
+{
+    if (dict->flags & DICT_F_CACHE) {
+        dict->bytes -= DICT_CACHE_ENTRY(dict, node)->bytes;
+    }
+}
+
+/**
+ * dict_set() for DICT_ENGINE_PROBED. The table is grown before an insert
+ * that would exceed max_load, or leave it without an empty slot.
+ **/
+static int _probed_set(struct dict *dict, char *key, uint32_t len, uint32_t hash, void *value, uint64_t expires)
+{
+    struct dict_node *node;
+    char *ext;
+    
+    node = probe_find(dict, hash, key, len);
+    if (node != NULL) {
+        _replace(dict, node, key, value);
+        _cache_stored(dict, node, expires, 1);
+        return 1;
+    }
+    
+    if (dict->used + 2 > dict->capacity ||
+        (dict->max_load > 0.0f && (float)(dict->used + 1) > (float)dict->capacity * dict->max_load)) {
+        if (dict->capacity >= (UINT32_C(1) << 31) || !probe_resize(dict, dict->capacity << 1)) {
+            if (dict->used + 2 > dict->capacity) {
+                return 0;
+            }
+        }
+    }
+    
+    if (!_reserve_key(dict, len, &ext)) {
+        return 0;
+    }
+    
+    node = probe_insert(dict, hash);
+    _store_key(dict, node, key, len, ext);
+    dict_store_value(dict, node, value);
+    _cache_stored(dict, node, expires, 0);
+    dict->used++;
+    
+    return 1;
+}
+
+/**
+ * Hashes key with the dict's hash policy. The result can be passed to the
+ * _hashed functions of any dict created with the same policy and seed (or
+ * hash_key), so a key looked up in many such dicts is hashed only once.
+ *
+ * @param   struct dict *dict
+ * @param   const void *key
+ * @param   size_t len
+ * @return  uint32_t
+ **/
+uint32_t dict_hash(struct dict *dict, const void *key, size_t len)
+{
+    return dict->hash_fn(dict->hash_key, key, len);
+}
+
+/**
+ * Set an item on dict object. NOTE: If an insert fails, and you have
+ * free functions set, this WONT call free() on the key/value. You are
+ * responsible for maintaining that memory.
+ *
+ * Inserting a new key may start growing the table, see dict_set_max_load().
+ *
+ * With inline values (see dict_new_opts()), value bytes are copied from
+ * value, as by dict_set_copy().
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @param   void *value
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_set(struct dict *dict, char *key, void *value)
+{
+    return dict_set_n(dict, key, strlen(key), value);
+}
+
+/**
+ * Set an item on a dict with inline values, copying value_size bytes from
+ * value into the entry's value slot. A NULL value zeroes the slot.
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @param   const void *value
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error, or if dict doesn't store values
+ * inline.
+ **/
+int dict_set_copy(struct dict *dict, char *key, const void *value)
+{
+    if (dict->value_size == 0) {
+        return 0;
+    }
+    
+    return dict_set_n(dict, key, strlen(key), (void *)value);
+}
+
+/**
+ * Same as dict_set(), for a key of len bytes. The key may contain any bytes,
+ * including NUL, and doesn't need to be terminated.
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @param   size_t len
+ * @param   void *value
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_set_n(struct dict *dict, char *key, size_t len, void *value)
+{
+    return dict_set_hashed(dict, key, len, dict_hash(dict, key, len), value);
+}
+
+/**
+ * Set an item on a dict in cache mode (see dict_new_opts()), which expires
+ * ttl clock_fn units (by default milliseconds) from now. Expired entries
+ * are no longer found, and are deleted when looked up, or by the sweep of
+ * dict_expire(). A ttl of 0 never expires, like dict_set(), which also
+ * drops the expiry of an entry it replaces.
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @param   void *value
+ * @param   uint64_t ttl
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error, or if dict isn't a cache.
+ **/
+int dict_set_ttl(struct dict *dict, char *key, void *value, uint64_t ttl)
+{
+    size_t len = strlen(key);
+    
+    if (!(dict->flags & DICT_F_CACHE)) {
+        return 0;
+    }
+    
+    return _set_entry(dict, key, len, dict_hash(dict, key, len), value, ttl > 0 ? dict->clock_fn() + ttl : 0);
+}
+
+/**
+ * Inserts or replaces an entry, expiring at expires (0 for never) when dict
+ * is a cache.
+ **/
+static int _set_hashed(struct dict *dict, char *key, size_t len, uint32_t hash, void *value, uint64_t expires)
+{
+    struct dict_node *head;
+    struct dict_node *cur;
+    struct dict_node *node;
+    char *ext;
+    
+    if (len > UINT32_MAX) {
+        return 0;
+    }
+    
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        return _probed_set(dict, key, (uint32_t)len, hash, value, expires);
+    }
+    
+    _rehash_step(dict, 1);
+    head = _dict_bucket_mut(dict, hash);
+    if (head == NULL) {
+        return 0;
+    }
+    
+    DICT_COUNT(dict, lookups, 1);
+    
+    if (head->key == NULL) {
+        DICT_COUNT(dict, probes, 1);
+        
+        if (!_reserve_key(dict, len, &ext)) {
+            return 0;
+        }
+        
+        head->hash = hash;
+        _store_key(dict, head, key, len, ext);
+        dict_store_value(dict, head, value);
+        _cache_stored(dict, head, expires, 0);
+        dict->used++;
+        _expand_if_needed(dict);
+        return 1;
+    }
+    
+    for (cur = head; cur != NULL; cur = cur->next) {
+        DICT_COUNT(dict, probes, 1);
+        
+        if (_node_matches(dict, cur, hash, key, len)) {
+            _replace(dict, cur, key, value);
+            _cache_stored(dict, cur, expires, 1);
+            return 1;
+        }
+    }
+    
+    if (!_reserve_key(dict, len, &ext)) {
+        return 0;
+    }
+    
+    node = pool_alloc(&dict->pool);
+    if (node == NULL) {
+        return 0;
+    }
+    
+    node->hash = hash;
+    _store_key(dict, node, key, len, ext);
+    dict_store_value(dict, node, value);
+    _cache_stored(dict, node, expires, 0);
+    node->next = head->next;
+    head->next = node;
+    dict->used++;
+    _expand_if_needed(dict);
+    
+    return 1;
+}
+
+/**
+ * _set_hashed(), after which a cache is brought back within its bounds, and
+ * swept for expired entries a few buckets at a time.
+ **/
+static int _set_entry(struct dict *dict, char *key, size_t len, uint32_t hash, void *value, uint64_t expires)
+{
+    if (!_set_hashed(dict, key, len, hash, value, expires)) {
+        return 0;
+    }
+    
+    if (dict->flags & DICT_F_CACHE) {
+        dict_cache_maintain(dict);
+    }
+    
+    return 1;
+}
+
+/**
+ * Same as dict_set_n(), with hash precomputed by dict_hash().
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @param   size_t len
+ * @param   uint32_t hash
+ * @param   void *value
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_set_hashed(struct dict *dict, char *key, size_t len, uint32_t hash, void *value)
+{
+    return _set_entry(dict, key, len, hash, value, 0);
+}
+
+/**
+ * Searches the chain starting at bucket head cur for key.
+ **/
+static struct dict_node *_chain_find(struct dict *dict, struct dict_node *cur, const char *key, size_t len, uint32_t hash)
+{
+    DICT_COUNT(dict, lookups, 1);
+    
+    if (cur->key == NULL) {
+        DICT_COUNT(dict, probes, 1);
+        return NULL;
+    }
+    
+    do {
+        DICT_COUNT(dict, probes, 1);
+        
+        if (_node_matches(dict, cur, hash, key, len)) {
+            break;
+        }
+        
+        cur = cur->next;
+    } while (cur);
+    
+    return cur;
+}
+
+/**
+ * Looks up key without advancing an in-progress rehash, so it is safe to use
+ * while iterating over the same dict.
+ **/
+static struct dict_node *_dict_find(struct dict *dict, const char *key, size_t len, uint32_t hash)
+{
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        return probe_find(dict, hash, key, len);
+    }
+    
+    return _chain_find(dict, _dict_bucket(dict, hash), key, len, hash);
+}
+
+/**
+ * Check if dict contains key.
+ *
+ * @param    struct dict *dict
+ * @param    char *key
+ * @return   int
+ *
+ * Returns 1 if dict contains key, and 0 otherwise.
+ **/
+int dict_contains(struct dict *dict, char *key)
+{
+    return dict_get(dict, key) != NULL;
+}
+
+/**
+ * Same as dict_contains(), for a key of len bytes.
+ *
+ * @param    struct dict *dict
+ * @param    char *key
+ * @param    size_t len
+ * @return   int
+ *
+ * Returns 1 if dict contains key, and 0 otherwise.
+ **/
+int dict_contains_n(struct dict *dict, char *key, size_t len)
+{
+    return dict_get_n(dict, key, len) != NULL;
+}
+
+/**
+ * Same as dict_contains_n(), with hash precomputed by dict_hash().
+ *
+ * @param    struct dict *dict
+ * @param    char *key
+ * @param    size_t len
+ * @param    uint32_t hash
+ * @return   int
+ *
+ * Returns 1 if dict contains key, and 0 otherwise.
+ **/
+int dict_contains_hashed(struct dict *dict, char *key, size_t len, uint32_t hash)
+{
+    return dict_get_hashed(dict, key, len, hash) != NULL;
+}
+
+/**
+ * Get an item from dict. The returned node is valid until the next call that
+ * may modify the dict. Lookups don't advance an in-progress rehash, so they
+ * never move entries, and only write to cache mode dicts.
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @return  struct dict_node *
+ *
+ * Returns a pointer to the specified node, or NULL if it is not found.
+ **/
+struct dict_node *dict_get(struct dict *dict, char *key)
+{
+    return dict_get_n(dict, key, strlen(key));
+}
+
+/**
+ * Get the value of key. For dicts with inline values, this points at the
+ * entry's value slot, which may be read and written in place for as long as
+ * a node returned by dict_get() would be valid.
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @return  void *
+ *
+ * Returns the value, or NULL if key is not found.
+ **/
+void *dict_get_ptr(struct dict *dict, char *key)
+{
+    struct dict_node *node = dict_get_n(dict, key, strlen(key));
+    
+    return node != NULL ? node->value : NULL;
+}
+
+/**
+ * Same as dict_get(), for a key of len bytes.
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @param   size_t len
+ * @return  struct dict_node *
+ *
+ * Returns a pointer to the specified node, or NULL if it is not found.
+ **/
+struct dict_node *dict_get_n(struct dict *dict, char *key, size_t len)
+{
+    return dict_get_hashed(dict, key, len, dict_hash(dict, key, len));
+}
+
+/**
+ * Same as dict_get_n(), with hash precomputed by dict_hash().
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @param   size_t len
+ * @param   uint32_t hash
+ * @return  struct dict_node *
+ *
+ * Returns a pointer to the specified node, or NULL if it is not found.
+ **/
+struct dict_node *dict_get_hashed(struct dict *dict, char *key, size_t len, uint32_t hash)
+{
+    struct dict_node *node;
+    
+    node = _dict_find(dict, key, len, hash);
+    
+    // Expired cache entries are deleted on first sight.
+    if (node != NULL && (dict->flags & DICT_F_CACHE) && !dict_cache_touch(dict, node)) {
+        _del_hashed(dict, key, len, hash);
+        return NULL;
+    }
+    
+    return node;
+}
+
+/**
+ * Deletes an item from dict.
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @return  int
+ *
+ * Returns 1 on successful delete, and 0 otherwise.
+ **/
+int dict_del(struct dict *dict, char *key)
+{
+    return dict_del_n(dict, key, strlen(key));
+}
+
+/**
+ * Same as dict_del(), for a key of len bytes.
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @param   size_t len
+ * @return  int
+ *
+ * Returns 1 on successful delete, and 0 otherwise.
+ **/
+int dict_del_n(struct dict *dict, char *key, size_t len)
+{
+    return dict_del_hashed(dict, key, len, dict_hash(dict, key, len));
+}
+
+/**
+ * Deletes key, without advancing a rehash or shrinking the table
+ * afterwards, for lookups that find it expired.
+ **/
+static int _del_hashed(struct dict *dict, char *key, size_t len, uint32_t hash)
+{
+    struct dict_node *head, *cur, *prev, *next;
+    int status = 0;
+    
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        head = probe_find(dict, hash, key, len);
+        if (head == NULL) {
+            return 0;
+        }
+        
+        // Free key/value.
+        _cache_removed(dict, head);
+        _free_entry(dict, head->key, head->value);
+        
+        probe_erase(dict, head);
+        dict->used--;
+        return 1;
+    }
+    
+    head = _dict_bucket_mut(dict, hash);
+    
+    if (head == NULL) {
+        return status;
+    }
+    
+    DICT_COUNT(dict, lookups, 1);
+    DICT_COUNT(dict, probes, 1);
+    
+    if (head->key == NULL) {
+        return status;
+    }
+    
+    // Do free on linked list structure.
+    prev = head;
+    cur = head->next;
+    while (cur != NULL) {
+        DICT_COUNT(dict, probes, 1);
+        
+        if (_node_matches(dict, cur, hash, key, len)) {
+            // Free key/value.
+            _cache_removed(dict, cur);
+            _free_entry(dict, cur->key, cur->value);
+            
+            next = cur->next;
+            pool_free(&dict->pool, cur);
+            prev->next = next;
+            cur = next;
+            
+            dict->used--;
+            status = 1;
+        } else {
+            prev = cur;
+            cur = cur->next;
+        }
+    }
+    
+    // Do free on head node.
+    if (_node_matches(dict, head, hash, key, len)) {
+        // Free key/value.
+        _cache_removed(dict, head);
+        _free_entry(dict, head->key, head->value);
+        
+        if (head->next) {
+            next = head->next;
+            dict_node_copy(dict, head, next);
+            pool_free(&dict->pool, next);
+        } else {
+            memset(head, 0, dict->node_size);
+        }
+        
+        dict->used--;
+        status = 1;
+    }
+    
+    return status;
+}
+
+/**
+ * Same as dict_del_n(), with hash precomputed by dict_hash().
+ *
+ * @param   struct dict *dict
+ * @param   char *key
+ * @param   size_t len
+ * @param   uint32_t hash
+ * @return  int
+ *
+ * Returns 1 on successful delete, and 0 otherwise.
+ **/
+int dict_del_hashed(struct dict *dict, char *key, size_t len, uint32_t hash)
+{
+    _rehash_step(dict, 1);
+    
+    if (!_del_hashed(dict, key, len, hash)) {
+        return 0;
+    }
+    
+    dict_shrink_if_needed(dict);
+    return 1;
+}
+
 /**
- * Creates a new dict object.
+ * Hashes an integer key. DICT_HASH_U64 is computed inline; other policies
+ * hash the key's 8 bytes.
+ **/
+static inline uint32_t _u64_hash(struct dict *dict, const uint64_t *key)
+{
+    if (dict->hash == DICT_HASH_U64) {
+        return hash_u64_word(dict->hash_key[0], *key);
+    }
+    
+    return dict_hash(dict, key, sizeof(*key));
+}
+
+/**
+ * Set an item on a dict created with DICT_F_U64_KEYS. The key is stored in
+ * the node as an 8 byte word, so there is no key string to format, measure
+ * or free, and lookups compare it by value.
  *
- * @param   uint32_t seed - CRC32 Seed.
- * @param   uint32_t capacity - Number of buckets to allocate.
- * @param   void (*key_free_fn)(void *) - Either a function pointer, or NULL.
- * @param   void (*value_free_fn)(void *) - Either a function pointer, or NULL.
+ * Entries of such a dict are iterated, cloned and combined by the set
+ * operations like any other; read their keys with dict_u64_key().
  *
- * @return  struct dict *
+ * @param   struct dict *dict
+ * @param   uint64_t key
+ * @param   void *value
+ * @return  int
  *
- * Returns a newly allocated struct dict pointer, or NULL on error.
+ * Returns 1 on success, and 0 on error, or if dict wasn't created with
+ * DICT_F_U64_KEYS.
  **/
-struct dict *dict_new(uint32_t seed, uint32_t capacity, void (*key_free_fn)(void *), void (*value_free_fn)(void *))
+int dict_u64_set(struct dict *dict, uint64_t key, void *value)
 {
-    struct dict *dict;
-    struct dict_node *table;
+    if (!(dict->flags & DICT_F_U64_KEYS)) {
+        return 0;
+    }
     
-    dict = malloc(sizeof(*dict));
-    if (dict == NULL) {
-        return NULL;
+    return dict_set_hashed(dict, (char *)&key, sizeof(key), _u64_hash(dict, &key), value);
+}
+
+/**
+ * Get an item from a dict created with DICT_F_U64_KEYS.
+ *
+ * @param   struct dict *dict
+ * @param   uint64_t key
+ * @return  struct dict_node *
+ *
+ * Returns a pointer to struct dict_node *, or NULL if key isn't found.
+ **/
+struct dict_node *dict_u64_get(struct dict *dict, uint64_t key)
+{
+    return dict_get_hashed(dict, (char *)&key, sizeof(key), _u64_hash(dict, &key));
+}
+
+/**
+ * Delete an item from a dict created with DICT_F_U64_KEYS.
+ *
+ * @param   struct dict *dict
+ * @param   uint64_t key
+ * @return  int
+ *
+ * Returns 1 on successful delete, and 0 otherwise.
+ **/
+int dict_u64_del(struct dict *dict, uint64_t key)
+{
+    return dict_del_hashed(dict, (char *)&key, sizeof(key), _u64_hash(dict, &key));
+}
+
+/**
+ * Check if a dict created with DICT_F_U64_KEYS contains key.
+ *
+ * @param   struct dict *dict
+ * @param   uint64_t key
+ * @return  int
+ *
+ * Returns 1 if dict contains key, and 0 otherwise.
+ **/
+int dict_u64_contains(struct dict *dict, uint64_t key)
+{
+    return dict_contains_hashed(dict, (char *)&key, sizeof(key), _u64_hash(dict, &key));
+}
+
+/**
+ * Returns the integer key of node, an entry of a DICT_F_U64_KEYS dict.
+ *
+ * @param   const struct dict_node *node
+ * @return  uint64_t
+ **/
+uint64_t dict_u64_key(const struct dict_node *node)
+{
+    uint64_t key;
+    
+    memcpy(&key, node->key, sizeof(key));
+    return key;
+}
+
+/**
+ * Marks the cache entries found by a batched lookup as recently used, and
+ * drops the expired ones from the results. They are left in place, since
+ * deleting them could move entries found earlier in the batch.
+ **/
+static void _cache_filter(struct dict *dict, struct dict_node **results, size_t n)
+{
+    size_t i;
+    
+    if (!(dict->flags & DICT_F_CACHE)) {
+        return;
     }
     
-    table = malloc(sizeof(*table) * capacity);
-    if (table == NULL) {
-        free(dict);
-        return NULL;
+    for (i = 0; i < n; i++) {
+        if (results[i] != NULL && !dict_cache_touch(dict, results[i])) {
+            results[i] = NULL;
+        }
     }
+}
+
+/**
+ * Looks up a batch of up to DICT_BATCH keys. All keys are hashed and their
+ * buckets prefetched first, then the key bytes of each bucket head, and only
+ * then are the buckets searched, so the cache misses of the whole batch
+ * overlap instead of being paid one after another.
+ **/
+static void _get_batch(struct dict *dict, char **keys, size_t n, struct dict_node **results)
+{
+    struct dict_node *heads[DICT_BATCH];
+    uint32_t hashes[DICT_BATCH];
+    size_t lens[DICT_BATCH];
+    size_t i;
     
-    memset(dict, 0, sizeof(*dict));
-    memset(table, 0, sizeof(*table) * capacity);
+    for (i = 0; i < n; i++) {
+        lens[i] = strlen(keys[i]);
+        hashes[i] = dict->hash_fn(dict->hash_key, keys[i], lens[i]);
+        
+        if (dict->engine == DICT_ENGINE_PROBED) {
+            probe_prefetch(dict, hashes[i]);
+        } else {
+            heads[i] = _dict_bucket(dict, hashes[i]);
+            DICT_PREFETCH(heads[i]);
+        }
+    }
     
-    if (key_free_fn == NULL) {
-        key_free_fn = _dummy_free_fn;
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        for (i = 0; i < n; i++) {
+            results[i] = probe_find(dict, hashes[i], keys[i], lens[i]);
+        }
+        
+        _cache_filter(dict, results, n);
+        return;
     }
     
-    if (value_free_fn == NULL) {
-        value_free_fn = _dummy_free_fn;
+    for (i = 0; i < n; i++) {
+        if (heads[i]->key != NULL) {
+            DICT_PREFETCH(heads[i]->key);
+        }
     }
     
-    dict->capacity = capacity;
-    dict->used = 0;
-    dict->seed = seed;
-    dict->table = table;
-    dict->key_free_fn = key_free_fn;
-    dict->value_free_fn = value_free_fn;
+    for (i = 0; i < n; i++) {
+        results[i] = _chain_find(dict, heads[i], keys[i], lens[i], hashes[i]);
+    }
     
-    return dict;
+    _cache_filter(dict, results, n);
 }
 
 /**
- * Clears all key/value pairs in dict object.
+ * Looks up n keys at once, storing the node for keys[i] (or NULL) in
+ * results[i]. Much faster than n calls to dict_get() when the table is much
+ * larger than the CPU caches, since lookups are interleaved to overlap their
+ * memory accesses. The nodes are valid until the next call that may modify
+ * the dict.
  *
  * @param   struct dict *dict
+ * @param   char **keys
+ * @param   size_t n
+ * @param   struct dict_node **results
  * @return  void
  **/
-void dict_clear(struct dict *dict)
+void dict_get_many(struct dict *dict, char **keys, size_t n, struct dict_node **results)
 {
-    struct dict_node *cur;
-    struct dict_node *prev;
-    uint32_t i;
+    size_t i, batch;
     
-    for (i = 0; i < dict->capacity; i++) {
-        if (dict->table[i].key != NULL) {
-            cur = dict->table[i].next;
-            while (cur) {
-                prev = cur;
-                cur = cur->next;
-				
-                // Free key/value.
-                dict->key_free_fn(prev->key);
-                dict->value_free_fn(prev->value);
-				
-                free(prev);
-            }
-            
-            // Free key/value.
-            dict->key_free_fn(dict->table[i].key);
-            dict->value_free_fn(dict->table[i].value);
-			
-            dict->table[i].hash = 0;
-            dict->table[i].key = NULL;
-            dict->table[i].value = NULL;
-            dict->table[i].next = NULL;
+    for (i = 0; i < n; i += batch) {
+        batch = n - i < DICT_BATCH ? n - i : DICT_BATCH;
+        _get_batch(dict, keys + i, batch, results + i);
+    }
+}
+
+/**
+ * Checks n keys at once, like dict_get_many(), setting results[i] to 1 if
+ * the dict contains keys[i], and 0 otherwise.
+ *
+ * @param   struct dict *dict
+ * @param   char **keys
+ * @param   size_t n
+ * @param   int *results
+ * @return  size_t
+ *
+ * Returns the number of keys found.
+ **/
+size_t dict_contains_many(struct dict *dict, char **keys, size_t n, int *results)
+{
+    struct dict_node *nodes[DICT_BATCH];
+    size_t i, j, batch;
+    size_t found = 0;
+    
+    for (i = 0; i < n; i += batch) {
+        batch = n - i < DICT_BATCH ? n - i : DICT_BATCH;
+        _get_batch(dict, keys + i, batch, nodes);
+        
+        for (j = 0; j < batch; j++) {
+            results[i + j] = nodes[j] != NULL;
+            found += nodes[j] != NULL;
         }
     }
     
-    dict->used = 0;
+    return found;
 }
 
 /**
- * Deletes a dict object, and frees all associated memory.
+ * Returns 1 if a and b hash every key to the same value.
+ **/
+static int _same_hash(struct dict *a, struct dict *b)
+{
+    return a->hash == b->hash && a->hash_key[0] == b->hash_key[0] && a->hash_key[1] == b->hash_key[1];
+}
+
+/**
+ * Returns the hash that dict gives the key of node, an entry of from. Reuses
+ * the cached hash when both dicts hash alike.
+ **/
+static uint32_t _hash_from(struct dict *dict, struct dict *from, struct dict_node *node)
+{
+    return _same_hash(dict, from) ? node->hash : dict_hash(dict, node->key, node->key_len);
+}
+
+/**
+ * Looks up the key of node, an entry of from, in dict.
+ **/
+static struct dict_node *_find_from(struct dict *dict, struct dict *from, struct dict_node *node)
+{
+    return _dict_find(dict, node->key, node->key_len, _hash_from(dict, from, node));
+}
+
+/**
+ * Start iterating over dict object.
  *
  * @param   struct dict *dict
+ * @param   struct dict_iterator *it
  * @return  void
  **/
-void dict_delete(struct dict *dict)
+void dict_iterate_start(struct dict *dict, struct dict_iterator *it)
 {
-    dict_clear(dict);
-    free(dict->table);
-    free(dict);
+    it->dict = dict;
+    it->idx = 0;
+    it->cur = NULL;
+    it->table = 0;
 }
 
 /**
- * Resizes a dict object.
+ * Iterate to next item in dict. Modifying a dict, while using this method has
+ * undefined behavior. While a rehash is in progress, both tables are visited.
  *
- * @param   struct dict *dict
- * @param   uint32_t capacity
- * @return  int
+ * @param   struct dict_iterator *it
+ * @return  struct dict_node *
  *
- * Returns 1 on success, and 0 on error.
+ * Returns a pointer to struct dict_node *, or NULL if iteration has
+ * completed.
  **/
-int dict_resize(struct dict *dict, uint32_t capacity)
+struct dict_node *dict_iterate_next(struct dict_iterator *it)
 {
-    struct dict *dict_tmp;
-    struct dict_node *cur;
-    struct dict_node *table_tmp;
-    uint32_t capacity_tmp;
-    size_t i;
+    struct dict_node *prev;
+    struct dict_node *table;
+    uint32_t capacity;
     
-    // We pass in NULL as the free functions, otherwise we'll destroy memory
-    // that we want to keep around.
-    dict_tmp = dict_new(dict->seed, capacity, NULL, NULL);
-    if (dict_tmp == NULL) {
-        return 0;
+    if (it->cur != NULL) {
+        prev = it->cur;
+        it->cur = prev->next;
+        return prev;
     }
     
-    for (i = 0; i < dict->capacity; i++) {
-        cur = &dict->table[i];
+    while (it->table < 2) {
+        if (it->table == 0) {
+            table = it->dict->table;
+            capacity = it->dict->capacity;
+        } else {
+            table = it->dict->rehash_table;
+            capacity = it->dict->rehash_table != NULL ? it->dict->rehash_capacity : 0;
+        }
         
-        while (cur && cur->key != NULL) {
-            if (!dict_set(dict_tmp, cur->key, cur->value)) {
-                dict_delete(dict_tmp);
-                return 0;
+        while (it->idx < capacity) {
+            prev = it->table == 0 ? dict_table_bucket(it->dict, it->idx) : DICT_NODE_AT(table, it->dict->node_size, it->idx);
+            if (prev->key != NULL) {
+                it->cur = prev->next;
+                it->idx++;
+                return prev;
             }
             
-            cur = cur->next;
+            it->idx++;
+        }
+        
+        it->table++;
+        it->idx = 0;
+    }
+    
+    return NULL;
+}
+
+/**
+ * Iterate, using difference. Modifying a dict, while using this method has
+ * undefined behavior.
+ *
+ * @param   struct dict *b
+ * @param   struct dict_iterator *it
+ * @return  struct dict_node *
+ *
+ * Returns a pointer to struct dict_node *, or NULL if iteration has
+ * completed.
+ **/
+struct dict_node *dict_iterate_difference(struct dict *b, struct dict_iterator *it)
+{
+    struct dict_node *node;
+    
+    while (1) {
+        node = dict_iterate_next(it);
+        if (node == NULL) {
+            return NULL;
+        }
+        
+        if (_find_from(b, it->dict, node) == NULL) {
+            return node;
         }
     }
+}
+
+/**
+ * Iterate, using intersection. Modifying a dict, while using this method has
+ * undefined behavior.
+ *
+ * @param   struct dict *b
+ * @param   struct dict_iterator *it
+ * @return  struct dict_node *
+ *
+ * Returns a pointer to struct dict_node *, or NULL if iteration has
+ * completed.
+ **/
+struct dict_node *dict_iterate_intersection(struct dict *b, struct dict_iterator *it)
+{
+    struct dict_node *node;
     
-    table_tmp = dict->table;
-    capacity_tmp = dict->capacity;
+    while (1) {
+        node = dict_iterate_next(it);
+        if (node == NULL) {
+            return NULL;
+        }
+        
+        if (_find_from(b, it->dict, node) != NULL) {
+            return node;
+        }
+    }
+}
+
+/**
+ * Reverses the bits of v.
+ **/
+static uint32_t _rev32(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555U) | ((v & 0x55555555U) << 1);
+    v = ((v >> 2) & 0x33333333U) | ((v & 0x33333333U) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fU) | ((v & 0x0f0f0f0fU) << 4);
+    v = ((v >> 8) & 0x00ff00ffU) | ((v & 0x00ff00ffU) << 8);
+    
+    return (v >> 16) | (v << 16);
+}
+
+/**
+ * Advances cursor to the next bucket of a table of mask + 1 buckets,
+ * counting from the high bit down.
+ **/
+static uint32_t _scan_next(uint32_t cursor, uint32_t mask)
+{
+    cursor |= ~mask;
     
-    dict->table = dict_tmp->table;
-    dict->capacity = dict_tmp->capacity;
+    return _rev32(_rev32(cursor) + 1);
+}
+
+/**
+ * Calls fn for every entry of the chained bucket at head.
+ **/
+static void _scan_chain(struct dict_node *head, void (*fn)(struct dict_node *node, void *arg), void *arg)
+{
+    struct dict_node *cur;
     
-    dict_tmp->table = table_tmp;
-    dict_tmp->capacity = capacity_tmp;
+    if (head->key == NULL) {
+        return;
+    }
     
-    dict_delete(dict_tmp);
-    return 1;
+    for (cur = head; cur != NULL; cur = cur->next) {
+        fn(cur, arg);
+    }
 }
 
 /**
- * Clone dict object, using key_clone_fn and value_clone_fn, function pointers.
+ * Incrementally iterates over dict. Start with a cursor of 0, and pass the
+ * returned cursor to the next call, until it returns 0. Each call visits
+ * about budget buckets, calling fn for each entry in them.
  *
- * If the clone function pointer for key/value is NULL, then it will simply do a
- * static copy of the pointer. Doing this on heap allocated memory may lead to
- * memory errors.
+ * The cursor counts through the buckets with its bits reversed, so buckets
+ * that split or merge when the table is resized are visited together.
+ * The dict may be modified and resized between calls: every key present for
+ * the whole scan is passed to fn at least once, and may be passed more
+ * than once. fn itself must not modify the dict. Scanning doesn't advance
+ * an in-progress rehash.
  *
- * @param   struct dict *to_clone
- * @param   void *(*key_clone_fn)(void *)
- * @param   void *(*value_clone_fn)(void *)
- * @return  struct dict *
+ * @param   struct dict *dict
+ * @param   uint32_t cursor
+ * @param   void (*fn)(struct dict_node *node, void *arg)
+ * @param   void *arg
+ * @param   uint32_t budget
+ * @return  uint32_t
  *
- * Returns NULL on error.
+ * Returns the cursor to continue from, or 0 once the scan has completed.
+ **/
+uint32_t dict_scan(struct dict *dict, uint32_t cursor, void (*fn)(struct dict_node *node, void *arg), void *arg, uint32_t budget)
+{
+    struct dict_node *small, *large;
+    uint32_t m0, m1, visited = 0;
+    int swapped;
+    
+    do {
+        if (dict->engine == DICT_ENGINE_PROBED) {
+            m0 = dict->capacity - 1;
+            probe_scan(dict, cursor & m0, fn, arg);
+            cursor = _scan_next(cursor, m0);
+            visited++;
+        } else if (dict->rehash_table == NULL) {
+            m0 = dict->capacity - 1;
+            _scan_chain(dict_table_bucket(dict, cursor & m0), fn, arg);
+            cursor = _scan_next(cursor, m0);
+            visited++;
+        } else {
+            // Visit the bucket of the smaller table, and every bucket of the
+            // larger one that its entries may have moved to.
+            swapped = dict->rehash_capacity < dict->capacity;
+            m0 = (swapped ? dict->rehash_capacity : dict->capacity) - 1;
+            m1 = (swapped ? dict->capacity : dict->rehash_capacity) - 1;
+            
+            small = swapped ? DICT_NODE_AT(dict->rehash_table, dict->node_size, cursor & m0) : dict_table_bucket(dict, cursor & m0);
+            _scan_chain(small, fn, arg);
+            
+            do {
+                large = swapped ? dict_table_bucket(dict, cursor & m1) : DICT_NODE_AT(dict->rehash_table, dict->node_size, cursor & m1);
+                _scan_chain(large, fn, arg);
+                cursor = _scan_next(cursor, m1);
+                visited++;
+            } while (cursor & (m0 ^ m1));
+        }
+    } while (cursor != 0 && visited < budget);
+    
+    return cursor;
+}
+
+/**
+ * Adds the chain starting at bucket head to the histogram of stats.
  **/
-struct dict *dict_clone(struct dict *to_clone, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
+static void _chain_stats(struct dict_node *head, struct dict_stats *stats)
 {
-    size_t i;
-    void *key_clone;
-    void *value_clone;
     struct dict_node *cur;
-    struct dict *clone = dict_new(
-        to_clone->seed,
-        to_clone->capacity,
-        to_clone->key_free_fn,
-        to_clone->value_free_fn
-    );
+    uint32_t len = 0;
     
-    if (clone == NULL) {
-        return NULL;
+    if (head->key != NULL) {
+        for (cur = head; cur != NULL; cur = cur->next) {
+            len++;
+        }
     }
     
-    if (key_clone_fn == NULL) {
-        key_clone_fn = _dummy_clone_fn;
-    }
-
-    if (value_clone_fn == NULL) {
-        value_clone_fn = _dummy_clone_fn;
-    }
+    stats->chains[len < DICT_STATS_CHAINS ? len : DICT_STATS_CHAINS - 1]++;
     
-    for (i = 0; i < to_clone->capacity; i++) {
-        cur = &to_clone->table[i];
-        while (cur && cur->key) {
-            key_clone = key_clone_fn(cur->key);
-            value_clone = value_clone_fn(cur->value);
-        
-            if (dict_set(clone, key_clone, value_clone) == 0) {
-                // Make sure key/value gets freed
-                clone->key_free_fn(key_clone);
-                clone->value_free_fn(value_clone);
-                
-                dict_delete(clone);
-                return NULL;
-            }
-            
-            cur = cur->next;
-        }
+    if (len > stats->max_chain) {
+        stats->max_chain = len;
     }
     
-    return clone;
+    if (len > 1) {
+        stats->overflow += len - 1;
+    }
 }
 
 /**
- * Set an item on dict object. NOTE: If an insert fails, and you have
- * free functions set, this WONT call free() on the key/value. You are
- * responsible for maintaining that memory.
+ * Describes the shape of dict: its load factor, a histogram of chain lengths
+ * (or, for DICT_ENGINE_PROBED, of distances from the home slot), the share
+ * of empty buckets, and the bytes it has allocated. Walks the whole table,
+ * so it is meant for monitoring rather than the hot path.
  *
- * @param   struct dict *dict
- * @param   char *key
- * @param   void *value
- * @return  int
+ * The operation counters are only kept when built with DICT_STATS, and are
+ * zero otherwise. Dividing probes by lookups gives the average number of
+ * chain nodes (or control byte groups) looked at per lookup. tag_misses
+ * counts nodes whose hash (or control byte) matched that held another key;
+ * many of them point at a weak hash or seed.
  *
- * Returns 1 on success, and 0 on error.
+ * @param   struct dict *dict
+ * @param   struct dict_stats *stats
+ * @return  void
  **/
-int dict_set(struct dict *dict, char *key, void *value)
+void dict_stats(struct dict *dict, struct dict_stats *stats)
 {
-    struct dict_node *cur;
-    struct dict_node *node;
-    uint32_t hash;
-    uint32_t idx;
+    size_t buckets = 0;
+    size_t segs;
+    uint32_t i;
     
-    hash = crc32(dict->seed, key, strlen(key));
-    idx = hash % dict->capacity;
+    memset(stats, 0, sizeof(*stats));
+    stats->used = dict->used;
+    stats->capacity = dict->rehash_table != NULL ? dict->rehash_capacity : dict->capacity;
+    stats->load = (float)dict->used / (float)stats->capacity;
+    stats->counters = dict->counters;
+    stats->bytes = sizeof(*dict) + pool_bytes(&dict->pool) + arena_bytes(&dict->arena) +
+        dict->garbage_cap * sizeof(struct dict_garbage);
     
-    cur = &dict->table[idx];
-    if (cur->key == NULL) {
-        cur->hash = hash;
-        cur->key = key;
-        cur->value = value;
-        dict->used++;
-        return 1;
-    } else if (cur->hash == hash && strcmp(cur->key, key) == 0) {
-        // Free key/value.
-        dict->key_free_fn(cur->key);
-        dict->key_free_fn(cur->value);
-	
-        cur->hash = hash;
-        cur->key = key;
-        cur->value = value;
-        return 1;
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        stats->bytes += probe_stats(dict, stats);
+        return;
     }
     
-    node = malloc(sizeof(*node));
-    if (node == NULL) {
-        return 0;
+    // Buckets below rehash_idx have already been moved to rehash_table.
+    for (i = dict->rehash_table != NULL ? dict->rehash_idx : 0; i < dict->capacity; i++, buckets++) {
+        _chain_stats(dict_table_bucket(dict, i), stats);
     }
     
-    node->hash = hash;
-    node->key = key;
-    node->value = value;
-    node->next = cur->next;
-    cur->next = node;
-    dict->used++;
+    for (i = 0; i < dict->rehash_capacity; i++, buckets++) {
+        _chain_stats(DICT_NODE_AT(dict->rehash_table, dict->node_size, i), stats);
+    }
     
-    return 1;
+    stats->empty = buckets > 0 ? (float)stats->chains[0] / (float)buckets : 0.0f;
+    stats->bytes += ((size_t)dict->capacity + dict->rehash_capacity) * dict->node_size;
+    
+    if (dict->cow_present != NULL) {
+        segs = (dict->capacity + DICT_COW_SEGMENT - 1) / DICT_COW_SEGMENT;
+        stats->bytes += (segs + 63) / 64 * sizeof(uint64_t);
+    }
 }
 
 /**
- * Check if dict contains key.
- *
- * @param    struct dict *dict
- * @param    char *key
- * @return   int
+ * Zeroes the operation counters of dict.
  *
- * Returns 1 if dict contains key, and 0 otherwise.
+ * @param   struct dict *dict
+ * @return  void
  **/
-int dict_contains(struct dict *dict, char *key)
+void dict_stats_reset(struct dict *dict)
 {
-    struct dict_node *cur;
-    uint32_t hash;
-    uint32_t idx;
+    memset(&dict->counters, 0, sizeof(dict->counters));
+}
+
+/**
+ * Creates an empty dict for a set operation result, with the settings of
+ * like and room for capacity entries.
+ **/
+static struct dict *_result_new(struct dict *like, size_t capacity)
+{
+    struct dict_opts opts;
+    struct dict *result;
+    float buckets;
     
-    hash = crc32(dict->seed, key, strlen(key));
-    idx = hash % dict->capacity;
-    cur = &dict->table[idx];
+    buckets = like->max_load > 0.0f ? (float)capacity / like->max_load : (float)capacity;
     
-    if (cur->key == NULL) {
-        return 0;
-    }
+    dict_opts_of(like, &opts);
+    opts.capacity = buckets >= 2147483648.0f ? (UINT32_C(1) << 31) : (uint32_t)buckets;
     
-    do {
-        if (cur->hash == hash && strcmp(cur->key, key) == 0) {
-            return 1;
-        }
-        
-        cur = cur->next;
-    } while (cur);
+    result = dict_new_opts(&opts);
+    if (result != NULL) {
+        result->max_load = like->max_load;
+    }
     
-    return 0;
+    return result;
 }
 
 /**
- * Get an item from dict.
- *
- * @param   struct dict *dict
- * @param   char *key
- * @return  struct dict_node *
+ * Adds a clone of node, an entry of from, to result. On error, the clone is
+ * freed again.
  *
- * Returns a pointer to the specified node, or NULL if it is not found.
+ * Returns 1 on success, and 0 on error.
  **/
-struct dict_node *dict_get(struct dict *dict, char *key)
+static int _add_from(struct dict *result, struct dict *from, struct dict_node *node,
+                     void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
 {
-    struct dict_node *cur;
-    uint32_t hash;
-    uint32_t idx;
+    void *key, *value;
     
-    hash = crc32(dict->seed, key, strlen(key));
-    idx = hash % dict->capacity;
-    cur = &dict->table[idx];
+    // Owned keys are copied by dict_set itself.
+    key = (result->flags & DICT_F_OWN_KEYS) || key_clone_fn == NULL ? node->key : key_clone_fn(node->key);
+    value = value_clone_fn == NULL || result->value_size > 0 ? node->value : value_clone_fn(node->value);
     
-    if (cur->key == NULL) {
-        return NULL;
+    if (_set_entry(result, key, node->key_len, _hash_from(result, from, node), value, _expires_of(from, node)) == 0) {
+        result->key_free_fn(key);
+        result->value_free_fn(value);
+        return 0;
     }
     
-    do {
-        if (cur->hash == hash && strcmp(cur->key, key) == 0) {
-            break;
+    return 1;
+}
+
+/**
+ * Adds a clone of every entry of a whose key is (want == 0: not) in b.
+ **/
+static int _add_filtered(struct dict *result, struct dict *a, struct dict *b, int want,
+                         void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
+{
+    struct dict_iterator it;
+    struct dict_node *node;
+    
+    dict_iterate_start(a, &it);
+    while ((node = dict_iterate_next(&it)) != NULL) {
+        if ((_find_from(b, a, node) != NULL) == want &&
+            !_add_from(result, a, node, key_clone_fn, value_clone_fn)) {
+            return 0;
         }
-        
-        cur = cur->next;
-    } while (cur);
+    }
     
-    return cur;
+    return 1;
 }
 
 /**
- * Deletes an item from dict.
+ * Creates a new dict holding the entries of a whose keys are not in b.
  *
- * @param   struct dict *dict
- * @param   char *key
- * @return  int
+ * Like the other set operations, the result has the settings (seed, hash
+ * policy, engine, free functions) of a, and its entries are copied with
+ * key_clone_fn and value_clone_fn as in dict_clone(). Keys are looked up by
+ * their cached hash, rather than hashed again, whenever the dicts share a
+ * hash policy and seed.
  *
- * Returns 1 on successful delete, and 0 otherwise.
+ * @param   struct dict *a
+ * @param   struct dict *b
+ * @param   void *(*key_clone_fn)(void *)
+ * @param   void *(*value_clone_fn)(void *)
+ * @return  struct dict *
+ *
+ * Returns NULL on error.
  **/
-int dict_del(struct dict *dict, char *key)
+struct dict *dict_difference(struct dict *a, struct dict *b, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
 {
-    struct dict_node *head, *cur, *prev, *next;
-    uint32_t hash;
-    uint32_t idx;
-    int status = 0;
-    
-    hash = crc32(dict->seed, key, strlen(key));
-    idx = hash % dict->capacity;
-    head = &dict->table[idx];
-    
-    if (head->key == NULL) {
-        return status;
-    }
+    struct dict *result;
     
-    // Do free on linked list structure.
-    prev = head;
-    cur = head->next;
-    while (cur != NULL) {
-        if (cur->hash == hash && strcmp(cur->key, key) == 0) {
-            // Free key/value.
-            dict->key_free_fn(cur->key);
-            dict->value_free_fn(cur->value);
-            
-            next = cur->next;
-            free(cur);
-            prev->next = next;
-            cur = next;
-            
-            status = 1;
-        } else {
-            prev = cur;
-            cur = cur->next;
-        }
+    result = _result_new(a, a->used);
+    if (result == NULL) {
+        return NULL;
     }
     
-    // Do free on head node.
-    if (head->hash == hash && strcmp(head->key, key) == 0) {
-        // Free key/value.
-        dict->key_free_fn(head->key);
-        dict->value_free_fn(head->value);
-        
-        if (head->next) {
-            next = head->next;
-            head->hash = next->hash;
-            head->key = next->key;
-            head->value = next->value;
-            head->next = next->next;
-            free(next);
-        } else {
-            head->hash = 0;
-            head->key = NULL;
-            head->value = NULL;
-        }
-        
-        status = 1;
+    if (!_add_filtered(result, a, b, 0, key_clone_fn, value_clone_fn)) {
+        dict_delete(result);
+        return NULL;
     }
     
-    return status;
+    return result;
 }
 
 /**
- * Start iterating over dict object.
+ * Creates a new dict holding the entries of a whose keys are also in b.
+ * Iterates whichever dict is smaller, and looks its keys up in the other.
  *
- * @param   struct dict *dict
- * @param   struct dict_iterator *it
- * @return  void
+ * @param   struct dict *a
+ * @param   struct dict *b
+ * @param   void *(*key_clone_fn)(void *)
+ * @param   void *(*value_clone_fn)(void *)
+ * @return  struct dict *
+ *
+ * Returns NULL on error.
  **/
-void dict_iterate_start(struct dict *dict, struct dict_iterator *it)
+struct dict *dict_intersection(struct dict *a, struct dict *b, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
 {
-    it->dict = dict;
-    it->idx = 0;
-    it->cur = NULL;
+    struct dict *dicts[2];
+    
+    dicts[0] = a;
+    dicts[1] = b;
+    
+    return dict_intersection_many(dicts, 2, key_clone_fn, value_clone_fn);
 }
 
 /**
- * Iterate to next item in dict. Modifying a dict, while using this method has
- * undefined behavior.
+ * Creates a new dict holding the entries of a, and those of b whose keys
+ * are not in a.
  *
- * @param   struct dict_iterator *it
- * @return  struct dict_node *
+ * @param   struct dict *a
+ * @param   struct dict *b
+ * @param   void *(*key_clone_fn)(void *)
+ * @param   void *(*value_clone_fn)(void *)
+ * @return  struct dict *
  *
- * Returns a pointer to struct dict_node *, or NULL if iteration has
- * completed.
+ * Returns NULL on error.
  **/
-struct dict_node *dict_iterate_next(struct dict_iterator *it)
+struct dict *dict_union(struct dict *a, struct dict *b, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
 {
-    struct dict_node *prev;
-
-    if (it->cur != NULL) {
-        prev = it->cur;
-        it->cur = prev->next;
-        return prev;
+    struct dict_iterator it;
+    struct dict_node *node;
+    struct dict *result;
+    
+    result = _result_new(a, a->used + b->used);
+    if (result == NULL) {
+        return NULL;
     }
-
-    while (it->idx < it->dict->capacity) {
-        if (it->dict->table[it->idx].key != NULL) {
-            prev = &it->dict->table[it->idx];
-            it->cur = prev->next;
-            it->idx++;
-            return prev;
+    
+    dict_iterate_start(a, &it);
+    while ((node = dict_iterate_next(&it)) != NULL) {
+        if (!_add_from(result, a, node, key_clone_fn, value_clone_fn)) {
+            dict_delete(result);
+            return NULL;
         }
-        
-        it->idx++;
     }
     
-    return NULL;
+    if (!_add_filtered(result, b, a, 0, key_clone_fn, value_clone_fn)) {
+        dict_delete(result);
+        return NULL;
+    }
+    
+    return result;
 }
 
 /**
- * Iterate, using difference. Modifying a dict, while using this method has
- * undefined behavior.
+ * Creates a new dict holding the entries of a whose keys are not in b, and
+ * those of b whose keys are not in a.
  *
+ * @param   struct dict *a
  * @param   struct dict *b
- * @param   struct dict_iterator *it
- * @return  struct dict_node *
+ * @param   void *(*key_clone_fn)(void *)
+ * @param   void *(*value_clone_fn)(void *)
+ * @return  struct dict *
  *
- * Returns a pointer to struct dict_node *, or NULL if iteration has
- * completed.
+ * Returns NULL on error.
  **/
-struct dict_node *dict_iterate_difference(struct dict *b, struct dict_iterator *it)
+struct dict *dict_symmetric_difference(struct dict *a, struct dict *b, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
 {
-    struct dict_node *node;
+    struct dict *result;
     
-    while (1) {
-        node = dict_iterate_next(it);
-        if (node == NULL) {
-            return NULL;
-        }
-        
-        if (!dict_contains(b, node->key)) {
-            return node;
-        }
+    result = _result_new(a, a->used + b->used);
+    if (result == NULL) {
+        return NULL;
+    }
+    
+    if (!_add_filtered(result, a, b, 0, key_clone_fn, value_clone_fn) ||
+        !_add_filtered(result, b, a, 0, key_clone_fn, value_clone_fn)) {
+        dict_delete(result);
+        return NULL;
     }
+    
+    return result;
 }
 
 /**
- * Iterate, using intersection. Modifying a dict, while using this method has
- * undefined behavior.
+ * Creates a new dict holding the entries of dicts[0] whose keys are in every
+ * one of dicts[1..n-1]. The smallest dict is iterated, and its keys are
+ * looked up in the others from smallest to largest, so most misses are
+ * rejected by the first lookup.
  *
- * @param   struct dict *b
- * @param   struct dict_iterator *it
- * @return  struct dict_node *
+ * @param   struct dict **dicts
+ * @param   size_t n
+ * @param   void *(*key_clone_fn)(void *)
+ * @param   void *(*value_clone_fn)(void *)
+ * @return  struct dict *
  *
- * Returns a pointer to struct dict_node *, or NULL if iteration has
- * completed.
+ * Returns NULL on error, or if n is 0.
  **/
-struct dict_node *dict_iterate_intersection(struct dict *b, struct dict_iterator *it)
+struct dict *dict_intersection_many(struct dict **dicts, size_t n, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
 {
-    struct dict_node *node;
+    struct dict_iterator it;
+    struct dict_node *node, *match;
+    struct dict **order, *tmp;
+    struct dict *result;
+    size_t i, j;
     
-    while (1) {
-        node = dict_iterate_next(it);
-        if (node == NULL) {
-            return NULL;
+    if (n == 0) {
+        return NULL;
+    }
+    
+    order = malloc(n * sizeof(*order));
+    if (order == NULL) {
+        return NULL;
+    }
+    
+    // Insertion sort by size; n is small.
+    for (i = 0; i < n; i++) {
+        order[i] = dicts[i];
+        for (j = i; j > 0 && order[j - 1]->used > order[j]->used; j--) {
+            tmp = order[j - 1];
+            order[j - 1] = order[j];
+            order[j] = tmp;
+        }
+    }
+    
+    result = _result_new(dicts[0], order[0]->used);
+    if (result == NULL) {
+        free(order);
+        return NULL;
+    }
+    
+    dict_iterate_start(order[0], &it);
+    while ((node = dict_iterate_next(&it)) != NULL) {
+        for (i = 1; i < n; i++) {
+            if (_find_from(order[i], order[0], node) == NULL) {
+                break;
+            }
         }
         
-        if (dict_contains(b, node->key)) {
-            return node;
+        if (i < n) {
+            continue;
+        }
+        
+        match = order[0] == dicts[0] ? node : _find_from(dicts[0], order[0], node);
+        if (!_add_from(result, dicts[0], match, key_clone_fn, value_clone_fn)) {
+            dict_delete(result);
+            free(order);
+            return NULL;
         }
     }
+    
+    free(order);
+    
+    return result;
 }
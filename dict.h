@@ -6,46 +6,245 @@ extern "C" {
 #include <stdint.h>
 #include <stddef.h>
 
+#include "arena.h"
+#include "pool.h"
+
+struct threadpool;
+struct dict_snapshot;
+
 struct dict_node {
     uint32_t hash;
+    uint32_t key_len;
     char *key;
     void *value;
     struct dict_node *next;
 };
 
+// Operation counts, kept only when built with DICT_STATS, see dict_stats().
+struct dict_counters {
+    uint64_t lookups;
+    uint64_t probes;
+    uint64_t compares;
+    uint64_t tag_misses;
+    uint64_t resizes;
+};
+
 struct dict {
     size_t used;
     struct dict_node *table;
     uint32_t capacity;
     uint32_t seed;
-	
+    
 	void (*key_free_fn)(void *);
 	void (*value_free_fn)(void *);
+    
+    // Incremental rehashing state. While rehash_table is non-NULL, buckets
+    // of table below rehash_idx have been migrated into rehash_table.
+    struct dict_node *rehash_table;
+    uint32_t rehash_capacity;
+    uint32_t rehash_idx;
+    float max_load;
+    
+    // Deletes shrink the table once the load factor drops below min_load,
+    // down to min_capacity at most.
+    float min_load;
+    uint32_t min_capacity;
+    
+    // Collision resolution engine, and for DICT_ENGINE_PROBED the control
+    // bytes (hash tags) that parallel table.
+    int engine;
+    uint8_t *ctrl;
+    
+    // Hash policy (DICT_HASH_*), and the key it hashes with.
+    int hash;
+    uint64_t hash_key[2];
+    uint32_t (*hash_fn)(const uint64_t key[2], const void *buf, size_t size);
+    
+    // Chain nodes are allocated from here.
+    struct pool pool;
+    
+    // Bytes per node, in both the bucket arrays and the pool. Nodes are
+    // followed by key_inline bytes of inline key storage when the dict owns
+    // its keys, and by a value_size byte value slot at value_offset when
+    // values are stored inline, so index buckets with DICT_NODE_AT rather
+    // than table[i].
+    uint32_t node_size;
+    uint32_t key_inline;
+    uint32_t value_size;
+    uint32_t value_offset;
+    int flags;
+    struct arena arena;
+    
+    // Copy-on-write state, see dict_snapshot(). While cow_base is set,
+    // segments of table whose bit in cow_present is clear are still shared
+    // with cow_base, and are copied in before they are modified.
+    struct dict_snapshot *cow_base;
+    uint64_t *cow_present;
+    uint32_t cow_missing;
+    
+    // Number of unreleased snapshots. While any are left, keys and values
+    // are queued on garbage instead of being freed.
+    unsigned snapshots;
+    struct dict_garbage *garbage;
+    size_t garbage_len;
+    size_t garbage_cap;
+    
+    // Cache mode (DICT_F_CACHE), see dict_new_opts(). Nodes carry their
+    // expiry, size and CLOCK reference bit at cache_offset. The CLOCK hand
+    // and the expiry sweep each walk the buckets from their own position.
+    size_t max_entries;
+    size_t max_bytes;
+    size_t bytes;
+    uint32_t cache_offset;
+    uint32_t clock_hand;
+    uint32_t expire_idx;
+    int ttls;
+    size_t (*value_bytes_fn)(void *value);
+    uint64_t (*clock_fn)(void);
+    
+    struct dict_counters counters;
+};
+
+struct dict_opts {
+    uint32_t seed;
+    uint32_t capacity;
+    void (*key_free_fn)(void *);
+    void (*value_free_fn)(void *);
+    int engine;
+    float max_load;
+    float min_load;
+    int hash;
+    uint64_t hash_key[2];
+    int flags;
+    uint32_t key_inline;
+    uint32_t value_size;
+    size_t max_entries;
+    size_t max_bytes;
+    size_t (*value_bytes_fn)(void *value);
+    uint64_t (*clock_fn)(void);
+};
+
+// Chain lengths past the last bucket of dict_stats.chains are counted in it.
+#define DICT_STATS_CHAINS 16
+
+struct dict_stats {
+    size_t used;
+    uint32_t capacity;
+    float load;
+    
+    // chains[i] is the number of buckets holding i entries. For
+    // DICT_ENGINE_PROBED, the number of entries i slots past their home slot.
+    size_t chains[DICT_STATS_CHAINS];
+    uint32_t max_chain;
+    float empty;
+    
+    // Entries kept in chain nodes rather than in the buckets themselves.
+    size_t overflow;
+    size_t bytes;
+    
+    struct dict_counters counters;
 };
 
 struct dict_iterator {
     struct dict *dict;
     struct dict_node *cur;
     uint32_t idx;
+    int table;
 };
 
+#define DICT_ENGINE_CHAINED 0
+#define DICT_ENGINE_PROBED  1
+
+#define DICT_HASH_CRC32   0
+#define DICT_HASH_FAST64  1
+#define DICT_HASH_SIPHASH 2
+#define DICT_HASH_U64     3
+
+// The dict copies keys on insert, and owns the copies.
+#define DICT_F_OWN_KEYS 0x01
+
+// Keys are 64-bit integers, stored in the node, see dict_u64_set().
+#define DICT_F_U64_KEYS 0x02
+
+// Bounded cache, with eviction and expiring entries, see dict_new_opts().
+#define DICT_F_CACHE 0x04
+
+#define DICT_NODE_AT(table, node_size, idx) \
+    ((struct dict_node *)((char *)(table) + (size_t)(idx) * (node_size)))
+
+#define DICT_DEFAULT_KEY_INLINE 16
+#define DICT_DEFAULT_MAX_LOAD 1.0f
+#define DICT_DEFAULT_PROBED_MAX_LOAD 0.875f
+#define DICT_DEFAULT_MIN_LOAD 0.125f
+
+// Buckets the expiry sweep visits per dict_set() on a cache with TTLs.
+#define DICT_CACHE_SWEEP 4
+
+// Buckets per copy-on-write segment, see dict_snapshot().
+#define DICT_COW_SEGMENT 128
+
 struct dict *dict_new(uint32_t seed, uint32_t capacity, void (*key_free_fn)(void *), void (*value_free_fn)(void *));
+void dict_opts_init(struct dict_opts *opts);
+struct dict *dict_new_opts(const struct dict_opts *opts);
 int dict_resize(struct dict *dict, uint32_t capacity);
 struct dict *dict_clone(struct dict *to_clone, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *));
+struct dict *dict_clone_parallel(struct dict *to_clone, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *), struct threadpool *pool);
+int dict_resize_parallel(struct dict *dict, uint32_t capacity, struct threadpool *pool);
+struct dict *dict_from_arrays(char **keys, void **values, size_t n, const struct dict_opts *opts);
 void dict_clear(struct dict *dict);
 void dict_delete(struct dict *dict);
+void dict_set_max_load(struct dict *dict, float max_load);
+void dict_set_min_load(struct dict *dict, float min_load);
+int dict_compact(struct dict *dict);
 
 int dict_set(struct dict *dict, char *key, void *value);
+int dict_set_copy(struct dict *dict, char *key, const void *value);
+int dict_set_ttl(struct dict *dict, char *key, void *value, uint64_t ttl);
 struct dict_node *dict_get(struct dict *dict, char *key);
+void *dict_get_ptr(struct dict *dict, char *key);
 int dict_del(struct dict *dict, char *key);
 int dict_contains(struct dict *dict, char *key);
 
+void dict_get_many(struct dict *dict, char **keys, size_t n, struct dict_node **results);
+size_t dict_contains_many(struct dict *dict, char **keys, size_t n, int *results);
+
+uint32_t dict_hash(struct dict *dict, const void *key, size_t len);
+
+int dict_set_n(struct dict *dict, char *key, size_t len, void *value);
+struct dict_node *dict_get_n(struct dict *dict, char *key, size_t len);
+int dict_del_n(struct dict *dict, char *key, size_t len);
+int dict_contains_n(struct dict *dict, char *key, size_t len);
+
+int dict_u64_set(struct dict *dict, uint64_t key, void *value);
+struct dict_node *dict_u64_get(struct dict *dict, uint64_t key);
+int dict_u64_del(struct dict *dict, uint64_t key);
+int dict_u64_contains(struct dict *dict, uint64_t key);
+uint64_t dict_u64_key(const struct dict_node *node);
+
+int dict_set_hashed(struct dict *dict, char *key, size_t len, uint32_t hash, void *value);
+struct dict_node *dict_get_hashed(struct dict *dict, char *key, size_t len, uint32_t hash);
+int dict_del_hashed(struct dict *dict, char *key, size_t len, uint32_t hash);
+int dict_contains_hashed(struct dict *dict, char *key, size_t len, uint32_t hash);
+
 void dict_iterate_start(struct dict *dict, struct dict_iterator *it);
 struct dict_node *dict_iterate_next(struct dict_iterator *it);
 
 struct dict_node *dict_iterate_difference(struct dict *b, struct dict_iterator *it);
 struct dict_node *dict_iterate_intersection(struct dict *b, struct dict_iterator *it);
 
+void dict_stats(struct dict *dict, struct dict_stats *stats);
+void dict_stats_reset(struct dict *dict);
+
+size_t dict_expire(struct dict *dict, uint32_t budget);
+
+uint32_t dict_scan(struct dict *dict, uint32_t cursor, void (*fn)(struct dict_node *node, void *arg), void *arg, uint32_t budget);
+
+struct dict *dict_difference(struct dict *a, struct dict *b, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *));
+struct dict *dict_intersection(struct dict *a, struct dict *b, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *));
+struct dict *dict_union(struct dict *a, struct dict *b, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *));
+struct dict *dict_symmetric_difference(struct dict *a, struct dict *b, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *));
+struct dict *dict_intersection_many(struct dict **dicts, size_t n, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *));
+
 #ifdef __cplusplus
 }
 #endif
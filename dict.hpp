@@ -0,0 +1,838 @@
+#pragma once
+
+/*
+ * C++17 hash map: cdict::dict<K, V, Hash, KeyEqual>.
+ *
+ * This is a table of its own, not a wrapper around struct dict, because
+ * struct dict can't give a C++ map the guarantees it needs: it compares
+ * keys as bytes, so KeyEqual and keys such as std::string with a custom
+ * comparison have nowhere to go; its values are pointers or inline slots
+ * copied with memcpy(), so they can't hold types with constructors and
+ * destructors; and the first entry of every bucket lives in the bucket
+ * array, so entries move on rehash and erase.
+ *
+ * The layout follows DICT_ENGINE_CHAINED: a power of two number of
+ * buckets, chains of nodes that cache their 32-bit hash and are compared
+ * on it before the keys, nodes taken from a struct pool, and incremental
+ * growth once the load factor passes max_load_factor(), with inserts and
+ * erases each migrating a bucket or so.
+ *
+ * Keys and values are stored in the node itself, as a
+ * std::pair<const K, V>, and constructed in place by emplace() and
+ * try_emplace(), so move-only types work and deleting an entry is a plain
+ * destructor call. Hash and KeyEqual are template parameters, so they are
+ * called directly rather than through a function pointer. Every entry has
+ * a node of its own, even the first of a bucket, so an entry never moves:
+ * references to it stay valid until it is erased, although iterators are
+ * invalidated by inserts and erases like with struct dict.
+ *
+ * The header has no code of its own to compile, but it links against the
+ * dict library for pool.h and the hash functions.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "dict.h"
+#include "hash.h"
+#include "pool.h"
+
+namespace cdict {
+    
+namespace detail {
+        
+inline uint32_t next_capacity(size_t capacity)
+{
+    uint32_t n = 1;
+            
+    while (n < capacity && n < (UINT32_C(1) << 31)) {
+        n <<= 1;
+    }
+            
+    return n;
+}
+        
+}
+    
+/**
+ * Default hash policy. Integers, enums and pointers are hashed like
+ * DICT_HASH_U64, and strings like DICT_HASH_FAST64, so a cdict::dict and a
+ * struct dict with the same seed agree on every key's hash. Neither resists
+ * crafted collisions, use cdict::siphash for untrusted keys.
+ **/
+template <class K, class = void>
+struct hash;
+    
+template <class K>
+struct hash<K, std::enable_if_t<std::is_integral_v<K> || std::is_enum_v<K> || std::is_pointer_v<K>>> {
+    uint64_t seed;
+        
+    explicit hash(uint32_t seed = 0) : seed(seed) {}
+        
+    uint32_t operator()(K key) const noexcept
+    {
+        if constexpr (std::is_pointer_v<K>) {
+            return hash_u64_word(seed, (uint64_t)reinterpret_cast<uintptr_t>(key));
+        } else {
+            return hash_u64_word(seed, (uint64_t)key);
+        }
+    }
+};
+    
+template <>
+struct hash<std::string_view> {
+    uint64_t key[2];
+        
+    explicit hash(uint32_t seed = 0) : key{seed, 0} {}
+        
+    uint32_t operator()(std::string_view s) const noexcept
+    {
+        return hash_fast64(key, s.data(), s.size());
+    }
+};
+    
+template <>
+struct hash<std::string> : hash<std::string_view> {
+    using hash<std::string_view>::hash;
+};
+    
+/**
+ * SipHash-2-4 for string keys, like DICT_HASH_SIPHASH. Keyed from a seed
+ * the same way struct dict is, or with an explicit 128-bit key.
+ **/
+struct siphash {
+    uint64_t key[2];
+        
+    explicit siphash(uint32_t seed = 0)
+    {
+        hash_derive_key(seed, key);
+    }
+        
+    siphash(uint64_t k0, uint64_t k1) : key{k0, k1} {}
+        
+    uint32_t operator()(std::string_view s) const noexcept
+    {
+        return hash_siphash(key, s.data(), s.size());
+    }
+};
+    
+template <class K, class V, class Hash = cdict::hash<K>, class KeyEqual = std::equal_to<K>>
+class dict {
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<const K, V>;
+    using size_type = size_t;
+    using difference_type = ptrdiff_t;
+    using hasher = Hash;
+    using key_equal = KeyEqual;
+    using reference = value_type &;
+    using const_reference = const value_type &;
+        
+private:
+    struct node {
+        node *next;
+        uint32_t hash;
+        value_type entry;
+            
+        template <class... Args>
+        explicit node(Args &&...args) : next(nullptr), hash(0), entry(std::forward<Args>(args)...) {}
+    };
+        
+    // Buckets migrated per insert or erase, and empty buckets skipped per
+    // migration, while growing. Same as for struct dict.
+    static constexpr uint32_t rehash_empty_visits = 10;
+        
+    // The pool hands out items aligned to a pointer.
+    static constexpr bool pooled = alignof(node) <= alignof(void *);
+        
+    node **table_;
+    uint32_t capacity_;
+    size_t used_;
+        
+    // While rehash_table_ is set, buckets of table_ below rehash_idx_ have
+    // been migrated into it.
+    node **rehash_table_;
+    uint32_t rehash_capacity_;
+    uint32_t rehash_idx_;
+    float max_load_;
+        
+    struct pool pool_;
+    Hash hash_;
+    KeyEqual eq_;
+        
+    template <bool Const>
+    class iterator_base {
+        friend class dict;
+        template <bool>
+        friend class iterator_base;
+            
+        using owner = std::conditional_t<Const, const dict, dict>;
+            
+        owner *dict_;
+        node *node_;
+        uint32_t idx_;
+        bool rehash_;
+            
+        iterator_base(owner *d, node *n, uint32_t idx, bool rehash) : dict_(d), node_(n), idx_(idx), rehash_(rehash) {}
+            
+        // Moves on to the first entry of the next non-empty bucket, the old
+        // table first.
+        void seek()
+        {
+            for (;;) {
+                node **table = rehash_ ? dict_->rehash_table_ : dict_->table_;
+                uint32_t capacity = rehash_ ? dict_->rehash_capacity_ : dict_->capacity_;
+                    
+                for (; idx_ < capacity; idx_++) {
+                    if (table[idx_] != nullptr) {
+                        node_ = table[idx_];
+                        return;
+                    }
+                }
+                    
+                if (rehash_ || dict_->rehash_table_ == nullptr) {
+                    node_ = nullptr;
+                    return;
+                }
+                    
+                rehash_ = true;
+                idx_ = 0;
+            }
+        }
+            
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename dict::value_type;
+        using difference_type = ptrdiff_t;
+        using pointer = std::conditional_t<Const, const value_type *, value_type *>;
+        using reference = std::conditional_t<Const, const value_type &, value_type &>;
+            
+        iterator_base() : dict_(nullptr), node_(nullptr), idx_(0), rehash_(false) {}
+            
+        template <bool C = Const, class = std::enable_if_t<C>>
+        iterator_base(const iterator_base<false> &it) : dict_(it.dict_), node_(it.node_), idx_(it.idx_), rehash_(it.rehash_) {}
+            
+        reference operator*() const { return node_->entry; }
+        pointer operator->() const { return &node_->entry; }
+            
+        iterator_base &operator++()
+        {
+            node_ = node_->next;
+            if (node_ == nullptr) {
+                idx_++;
+                seek();
+            }
+                
+            return *this;
+        }
+            
+        iterator_base operator++(int)
+        {
+            iterator_base it = *this;
+            ++*this;
+            return it;
+        }
+            
+        friend bool operator==(const iterator_base &a, const iterator_base &b) { return a.node_ == b.node_; }
+        friend bool operator!=(const iterator_base &a, const iterator_base &b) { return a.node_ != b.node_; }
+    };
+        
+public:
+    using iterator = iterator_base<false>;
+    using const_iterator = iterator_base<true>;
+        
+    /**
+     * Creates an empty dict of at least capacity buckets.
+     **/
+    explicit dict(size_type capacity = 16, const Hash &hash = Hash(), const KeyEqual &eq = KeyEqual())
+        : table_(nullptr), capacity_(0), used_(0), rehash_table_(nullptr), rehash_capacity_(0), rehash_idx_(0),
+          max_load_(DICT_DEFAULT_MAX_LOAD), hash_(hash), eq_(eq)
+    {
+        pool_init(&pool_, sizeof(node));
+        capacity_ = detail::next_capacity(capacity);
+        table_ = alloc_table(capacity_);
+        if (table_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+        
+    dict(const dict &other) : dict(other.capacity_for(other.used_), other.hash_, other.eq_)
+    {
+        max_load_ = other.max_load_;
+            
+        for (const_iterator it = other.begin(); it != other.end(); ++it) {
+            node *n = new_node(*it);
+            n->hash = it.node_->hash;
+            link(table_, capacity_, n);
+            used_++;
+        }
+    }
+        
+    /**
+     * Takes over the entries of other, which is left empty and without a
+     * bucket array, until its next insert allocates one.
+     **/
+    dict(dict &&other) noexcept
+        : table_(other.table_), capacity_(other.capacity_), used_(other.used_), rehash_table_(other.rehash_table_),
+          rehash_capacity_(other.rehash_capacity_), rehash_idx_(other.rehash_idx_), max_load_(other.max_load_),
+          pool_(other.pool_), hash_(std::move(other.hash_)), eq_(std::move(other.eq_))
+    {
+        other.table_ = nullptr;
+        other.rehash_table_ = nullptr;
+        other.capacity_ = 0;
+        other.rehash_capacity_ = 0;
+        other.used_ = 0;
+        pool_init(&other.pool_, sizeof(node));
+    }
+        
+    dict &operator=(dict other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+        
+    ~dict()
+    {
+        destroy_all();
+        pool_release(&pool_);
+        std::free(table_);
+        std::free(rehash_table_);
+    }
+        
+    void swap(dict &other) noexcept
+    {
+        using std::swap;
+            
+        swap(table_, other.table_);
+        swap(capacity_, other.capacity_);
+        swap(used_, other.used_);
+        swap(rehash_table_, other.rehash_table_);
+        swap(rehash_capacity_, other.rehash_capacity_);
+        swap(rehash_idx_, other.rehash_idx_);
+        swap(max_load_, other.max_load_);
+        swap(pool_, other.pool_);
+        swap(hash_, other.hash_);
+        swap(eq_, other.eq_);
+    }
+        
+    size_type size() const noexcept { return used_; }
+    bool empty() const noexcept { return used_ == 0; }
+        
+    /**
+     * Number of buckets entries are being placed in: the new table's, while
+     * growing.
+     **/
+    size_type bucket_count() const noexcept
+    {
+        return rehash_table_ != nullptr ? rehash_capacity_ : capacity_;
+    }
+        
+    float load_factor() const noexcept { return bucket_count() > 0 ? (float)used_ / (float)bucket_count() : 0.0f; }
+    float max_load_factor() const noexcept { return max_load_; }
+        
+    /**
+     * Sets the load factor above which the table starts growing. A value
+     * <= 0 disables growth, as with dict_set_max_load().
+     **/
+    void max_load_factor(float max_load) noexcept { max_load_ = max_load; }
+        
+    hasher hash_function() const { return hash_; }
+    key_equal key_eq() const { return eq_; }
+        
+    iterator begin() noexcept { return first<iterator>(this); }
+    iterator end() noexcept { return iterator(this, nullptr, 0, false); }
+    const_iterator begin() const noexcept { return first<const_iterator>(this); }
+    const_iterator end() const noexcept { return const_iterator(this, nullptr, 0, false); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+        
+    /**
+     * Constructs an entry from args, and inserts it unless its key is
+     * already present.
+     *
+     * Returns the entry with that key, and whether it was inserted.
+     **/
+    template <class... Args>
+    std::pair<iterator, bool> emplace(Args &&...args)
+    {
+        node *n;
+        node *found;
+            
+        ensure_table();
+        n = new_node(std::forward<Args>(args)...);
+        n->hash = hash_of(n->entry.first);
+        found = find_node(n->entry.first, n->hash);
+        if (found != nullptr) {
+            free_node(n);
+            return {make_iterator(found), false};
+        }
+            
+        return {insert_node(n), true};
+    }
+        
+    /**
+     * Inserts an entry for key with a value constructed from args, unless
+     * the key is already present, in which case key and args are left
+     * untouched.
+     **/
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(const K &key, Args &&...args)
+    {
+        return try_emplace_key(key, std::forward<Args>(args)...);
+    }
+        
+    template <class... Args>
+    std::pair<iterator, bool> try_emplace(K &&key, Args &&...args)
+    {
+        return try_emplace_key(std::move(key), std::forward<Args>(args)...);
+    }
+        
+    std::pair<iterator, bool> insert(value_type &&entry) { return emplace(std::move(entry)); }
+    std::pair<iterator, bool> insert(const value_type &entry) { return emplace(entry); }
+        
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(K &&key, M &&value)
+    {
+        std::pair<iterator, bool> r = try_emplace(std::move(key), std::forward<M>(value));
+            
+        if (!r.second) {
+            r.first->second = std::forward<M>(value);
+        }
+            
+        return r;
+    }
+        
+    template <class M>
+    std::pair<iterator, bool> insert_or_assign(const K &key, M &&value)
+    {
+        std::pair<iterator, bool> r = try_emplace(key, std::forward<M>(value));
+            
+        if (!r.second) {
+            r.first->second = std::forward<M>(value);
+        }
+            
+        return r;
+    }
+        
+    V &operator[](const K &key) { return try_emplace(key).first->second; }
+    V &operator[](K &&key) { return try_emplace(std::move(key)).first->second; }
+        
+    V &at(const K &key)
+    {
+        node *n = find_node(key, hash_of(key));
+            
+        if (n == nullptr) {
+            throw std::out_of_range("cdict::dict::at");
+        }
+            
+        return n->entry.second;
+    }
+        
+    const V &at(const K &key) const
+    {
+        return const_cast<dict *>(this)->at(key);
+    }
+        
+    iterator find(const K &key)
+    {
+        node *n = find_node(key, hash_of(key));
+            
+        return n != nullptr ? make_iterator(n) : end();
+    }
+        
+    const_iterator find(const K &key) const
+    {
+        return const_cast<dict *>(this)->find(key);
+    }
+        
+    bool contains(const K &key) const { return find_node(key, hash_of(key)) != nullptr; }
+    size_type count(const K &key) const { return contains(key) ? 1 : 0; }
+        
+    /**
+     * Removes the entry with key, if any.
+     *
+     * Returns the number of entries removed.
+     **/
+    size_type erase(const K &key)
+    {
+        uint32_t h = hash_of(key);
+        node **prev;
+        node *n;
+            
+        if (table_ == nullptr) {
+            return 0;
+        }
+            
+        rehash_step(1);
+            
+        for (prev = bucket(h); (n = *prev) != nullptr; prev = &n->next) {
+            if (n->hash == h && eq_(n->entry.first, key)) {
+                *prev = n->next;
+                free_node(n);
+                used_--;
+                return 1;
+            }
+        }
+            
+        return 0;
+    }
+        
+    /**
+     * Removes the entry at pos, without advancing a rehash, so erasing while
+     * iterating visits every other entry exactly once.
+     *
+     * Returns the iterator following pos.
+     **/
+    iterator erase(const_iterator pos)
+    {
+        iterator next(this, pos.node_, pos.idx_, pos.rehash_);
+        node **prev;
+            
+        ++next;
+            
+        for (prev = bucket(pos.node_->hash); *prev != pos.node_; prev = &(*prev)->next) {
+        }
+            
+        *prev = pos.node_->next;
+        free_node(pos.node_);
+        used_--;
+        return next;
+    }
+        
+    iterator erase(iterator pos) { return erase(const_iterator(pos)); }
+        
+    /**
+     * Removes every entry, keeping the bucket array.
+     **/
+    void clear() noexcept
+    {
+        rehash_all();
+        destroy_all();
+        pool_release(&pool_);
+        used_ = 0;
+            
+        for (uint32_t i = 0; i < capacity_; i++) {
+            table_[i] = nullptr;
+        }
+    }
+        
+    /**
+     * Moves every entry into a table of at least count buckets, enough to
+     * keep the load factor under max_load_factor(). Like dict_resize(), this
+     * completes any growth in progress, and can also shrink the table.
+     **/
+    void rehash(size_type count)
+    {
+        uint32_t capacity;
+        node **table;
+        node *n, *next;
+            
+        rehash_all();
+            
+        capacity = detail::next_capacity(count > capacity_for(used_) ? count : capacity_for(used_));
+        if (capacity == capacity_) {
+            return;
+        }
+            
+        table = alloc_table(capacity);
+        if (table == nullptr) {
+            throw std::bad_alloc();
+        }
+            
+        for (uint32_t i = 0; i < capacity_; i++) {
+            for (n = table_[i]; n != nullptr; n = next) {
+                next = n->next;
+                link(table, capacity, n);
+            }
+        }
+            
+        std::free(table_);
+        table_ = table;
+        capacity_ = capacity;
+    }
+        
+    void reserve(size_type count) { rehash(capacity_for(count)); }
+        
+private:
+    uint32_t hash_of(const K &key) const
+    {
+        return static_cast<uint32_t>(hash_(key));
+    }
+        
+    static node **alloc_table(uint32_t capacity)
+    {
+        return static_cast<node **>(std::calloc(capacity, sizeof(node *)));
+    }
+        
+    /**
+     * Gives a dict that was moved from a bucket array again, before its
+     * first insert.
+     **/
+    void ensure_table()
+    {
+        if (table_ == nullptr) {
+            rehash(16);
+        }
+    }
+        
+    size_type capacity_for(size_type count) const
+    {
+        return max_load_ > 0.0f ? (size_type)((float)count / max_load_) + 1 : count;
+    }
+        
+    template <class It, class Self>
+    static It first(Self *self)
+    {
+        It it(self, nullptr, 0, false);
+            
+        it.seek();
+        return it;
+    }
+        
+    iterator make_iterator(node *n)
+    {
+        uint32_t idx = n->hash & (capacity_ - 1);
+            
+        if (rehash_table_ != nullptr && idx < rehash_idx_) {
+            return iterator(this, n, n->hash & (rehash_capacity_ - 1), true);
+        }
+            
+        return iterator(this, n, idx, false);
+    }
+        
+    /**
+     * Returns the chain that hash belongs to, as in _dict_bucket().
+     **/
+    node **bucket(uint32_t hash) const
+    {
+        uint32_t idx = hash & (capacity_ - 1);
+            
+        if (rehash_table_ != nullptr && idx < rehash_idx_) {
+            return &rehash_table_[hash & (rehash_capacity_ - 1)];
+        }
+            
+        return &table_[idx];
+    }
+        
+    node *find_node(const K &key, uint32_t hash) const
+    {
+        if (table_ == nullptr) {
+            return nullptr;
+        }
+            
+        for (node *n = *bucket(hash); n != nullptr; n = n->next) {
+            if (n->hash == hash && eq_(n->entry.first, key)) {
+                return n;
+            }
+        }
+            
+        return nullptr;
+    }
+        
+    template <class KK, class... Args>
+    std::pair<iterator, bool> try_emplace_key(KK &&key, Args &&...args)
+    {
+        uint32_t h = hash_of(key);
+        node *n = find_node(key, h);
+            
+        if (n != nullptr) {
+            return {make_iterator(n), false};
+        }
+            
+        ensure_table();
+        n = new_node(std::piecewise_construct, std::forward_as_tuple(std::forward<KK>(key)),
+                     std::forward_as_tuple(std::forward<Args>(args)...));
+        n->hash = h;
+        return {insert_node(n), true};
+    }
+        
+    template <class... Args>
+    node *new_node(Args &&...args)
+    {
+        void *mem;
+            
+        if constexpr (pooled) {
+            mem = pool_alloc(&pool_);
+            if (mem == nullptr) {
+                throw std::bad_alloc();
+            }
+        } else {
+            mem = ::operator new(sizeof(node), std::align_val_t(alignof(node)));
+        }
+            
+        try {
+            return new (mem) node(std::forward<Args>(args)...);
+        } catch (...) {
+            release_node(mem);
+            throw;
+        }
+    }
+        
+    void release_node(void *mem) noexcept
+    {
+        if constexpr (pooled) {
+            pool_free(&pool_, mem);
+        } else {
+            ::operator delete(mem, std::align_val_t(alignof(node)));
+        }
+    }
+        
+    void free_node(node *n) noexcept
+    {
+        n->~node();
+        release_node(n);
+    }
+        
+    void destroy_all() noexcept
+    {
+        node *n, *next;
+            
+        for (int t = 0; t < 2; t++) {
+            node **table = t == 0 ? table_ : rehash_table_;
+            uint32_t capacity = t == 0 ? capacity_ : rehash_capacity_;
+                
+            for (uint32_t i = 0; table != nullptr && i < capacity; i++) {
+                for (n = table[i]; n != nullptr; n = next) {
+                    next = n->next;
+                        
+                    if constexpr (pooled) {
+                        // Slabs are released all at once afterwards.
+                        n->~node();
+                    } else {
+                        free_node(n);
+                    }
+                }
+                    
+                table[i] = nullptr;
+            }
+        }
+    }
+        
+    static void link(node **table, uint32_t capacity, node *n) noexcept
+    {
+        node **head = &table[n->hash & (capacity - 1)];
+            
+        n->next = *head;
+        *head = n;
+    }
+        
+    iterator insert_node(node *n)
+    {
+        node **head;
+            
+        rehash_step(1);
+            
+        head = bucket(n->hash);
+        n->next = *head;
+        *head = n;
+        used_++;
+            
+        expand_if_needed();
+        return make_iterator(n);
+    }
+        
+    void rehash_step(uint32_t n) noexcept
+    {
+        uint32_t empty_visits = n * rehash_empty_visits;
+        node *cur, *next;
+            
+        if (rehash_table_ == nullptr) {
+            return;
+        }
+            
+        while (n > 0 && rehash_idx_ < capacity_) {
+            cur = table_[rehash_idx_];
+            if (cur == nullptr) {
+                rehash_idx_++;
+                if (--empty_visits == 0) {
+                    break;
+                }
+                    
+                continue;
+            }
+                
+            table_[rehash_idx_] = nullptr;
+            for (; cur != nullptr; cur = next) {
+                next = cur->next;
+                link(rehash_table_, rehash_capacity_, cur);
+            }
+                
+            rehash_idx_++;
+            n--;
+        }
+            
+        if (rehash_idx_ >= capacity_) {
+            std::free(table_);
+            table_ = rehash_table_;
+            capacity_ = rehash_capacity_;
+            rehash_table_ = nullptr;
+            rehash_capacity_ = 0;
+            rehash_idx_ = 0;
+        }
+    }
+        
+    void rehash_all() noexcept
+    {
+        while (rehash_table_ != nullptr) {
+            rehash_step(UINT32_MAX / rehash_empty_visits);
+        }
+    }
+        
+    /**
+     * Starts growing once the load factor passes max_load_, as in
+     * _expand_if_needed().
+     **/
+    void expand_if_needed() noexcept
+    {
+        uint32_t capacity;
+        node **table;
+            
+        if (max_load_ <= 0.0f) {
+            return;
+        }
+            
+        if (rehash_table_ != nullptr) {
+            if ((float)used_ <= (float)rehash_capacity_ * max_load_) {
+                return;
+            }
+                
+            rehash_all();
+        }
+            
+        if ((float)used_ <= (float)capacity_ * max_load_) {
+            return;
+        }
+            
+        capacity = capacity_;
+        while ((float)used_ > (float)capacity * max_load_ && capacity < (UINT32_C(1) << 31)) {
+            capacity <<= 1;
+        }
+            
+        if (capacity == capacity_ || (table = alloc_table(capacity)) == nullptr) {
+            return;
+        }
+            
+        rehash_table_ = table;
+        rehash_capacity_ = capacity;
+        rehash_idx_ = 0;
+    }
+};
+    
+template <class K, class V, class Hash, class KeyEqual>
+void swap(dict<K, V, Hash, KeyEqual> &a, dict<K, V, Hash, KeyEqual> &b) noexcept
+{
+    a.swap(b);
+}
+    
+}
@@ -0,0 +1,307 @@
+/*
+ * Cache mode for struct dict (DICT_F_CACHE).
+ *
+ * Every node carries a struct dict_cache_entry with the entry's expiry, the
+ * bytes it counts against max_bytes, and a CLOCK reference bit, which
+ * lookups set. When the dict goes over its bounds, the CLOCK hand walks the
+ * buckets from where it last stopped: entries with the bit set get it
+ * cleared and are passed over, and the first entry found without it is
+ * evicted. Entries looked up since the hand last passed survive, so eviction
+ * approximates LRU without any list to maintain on lookups.
+ *
+ * Expired entries are deleted when a lookup finds them, and by an
+ * incremental sweep that visits a few buckets per dict_set(), or as many as
+ * asked by dict_expire().
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+
+#include "dict_private.h"
+#include "probe.h"
+
+/**
+ * Default clock of cache mode dicts, in milliseconds.
+ **/
+uint64_t dict_cache_clock(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * Records the size and expiry of an entry just stored by dict_set. A new
+ * entry starts out referenced, so the hand doesn't take it on its next pass.
+ **/
+void dict_cache_store(struct dict *dict, struct dict_node *node, uint64_t expires, int replaced)
+{
+    struct dict_cache_entry *entry = DICT_CACHE_ENTRY(dict, node);
+    size_t bytes = node->key_len;
+    
+    if (replaced) {
+        dict->bytes -= entry->bytes;
+    }
+    
+    if (dict->value_size > 0) {
+        bytes += dict->value_size;
+    } else if (dict->value_bytes_fn != NULL && node->value != NULL) {
+        bytes += dict->value_bytes_fn(node->value);
+    }
+    
+    entry->bytes = bytes > UINT32_MAX ? UINT32_MAX : (uint32_t)bytes;
+    entry->expires = expires;
+    entry->referenced = 1;
+    dict->bytes += entry->bytes;
+    
+    if (expires != 0) {
+        dict->ttls = 1;
+    }
+}
+
+static inline int _expired(struct dict *dict, struct dict_node *node, uint64_t now)
+{
+    struct dict_cache_entry *entry = DICT_CACHE_ENTRY(dict, node);
+    
+    return entry->expires != 0 && now >= entry->expires;
+}
+
+/**
+ * Removes cur from bucket head of dict, freeing its key and value. prev is
+ * the entry before cur in the chain, or NULL if cur is head itself. For
+ * DICT_ENGINE_PROBED, head and cur are the same slot.
+ **/
+static void _remove(struct dict *dict, struct dict_node *head, struct dict_node *prev, struct dict_node *cur)
+{
+    struct dict_node *next;
+    
+    dict->bytes -= DICT_CACHE_ENTRY(dict, cur)->bytes;
+    dict->used--;
+    
+    // Free key/value.
+    dict_free_entry(dict, cur->key, cur->value);
+    
+    if (dict->engine == DICT_ENGINE_PROBED) {
+        probe_erase(dict, cur);
+    } else if (prev != NULL) {
+        prev->next = cur->next;
+        pool_free(&dict->pool, cur);
+    } else if (head->next != NULL) {
+        next = head->next;
+        dict_node_copy(dict, head, next);
+        pool_free(&dict->pool, next);
+    } else {
+        memset(head, 0, dict->node_size);
+    }
+}
+
+/**
+ * Returns bucket idx of dict->table, about to be modified. A segment still
+ * shared with a snapshot is copied in first.
+ *
+ * Returns NULL if the copy fails.
+ **/
+static struct dict_node *_bucket_mut(struct dict *dict, uint32_t idx)
+{
+    if (dict->cow_base != NULL && !dict_cow_fault(dict, idx)) {
+        return NULL;
+    }
+    
+    return DICT_NODE_AT(dict->table, dict->node_size, idx);
+}
+
+/**
+ * Returns the bucket at position pos of the hand's walk, for reading. While
+ * the table is resized, the walk covers the old table, whose buckets below
+ * rehash_idx are empty, followed by the new one.
+ **/
+static struct dict_node *_hand_bucket(struct dict *dict, uint32_t pos)
+{
+    if (pos < dict->capacity) {
+        return dict_table_bucket(dict, pos);
+    }
+    
+    return DICT_NODE_AT(dict->rehash_table, dict->node_size, pos - dict->capacity);
+}
+
+/**
+ * Returns 1 if the bucket at position pos of the hand's walk may be written
+ * without copying it from a snapshot first.
+ **/
+static inline int _hand_owns(struct dict *dict, uint32_t pos)
+{
+    uint32_t seg = pos / DICT_COW_SEGMENT;
+    
+    return dict->cow_base == NULL || pos >= dict->capacity || ((dict->cow_present[seg / 64] >> (seg % 64)) & 1);
+}
+
+/**
+ * Moves the CLOCK hand on until it finds an entry that wasn't referenced
+ * since its last pass, and evicts it. Every bit the hand passes is cleared,
+ * so it finds one within two turns of the tables.
+ *
+ * Buckets still shared with a snapshot are only read: their bits are left
+ * alone, and the segment is copied in just to evict from it. Should two
+ * turns go by without a victim, the next entry the hand meets is taken.
+ *
+ * Returns 1 if an entry was evicted, and 0 if dict is empty, or on error.
+ **/
+static int _evict(struct dict *dict)
+{
+    struct dict_cache_entry *entry;
+    struct dict_node *head, *prev, *cur;
+    uint32_t span, pos, k;
+    size_t visits = 0;
+    int owned;
+    
+    if (dict->used == 0) {
+        return 0;
+    }
+    
+    span = dict->capacity + (dict->rehash_table != NULL ? dict->rehash_capacity : 0);
+    
+    while (1) {
+        if (dict->clock_hand >= span) {
+            dict->clock_hand = 0;
+        }
+        
+        pos = dict->clock_hand;
+        head = _hand_bucket(dict, pos);
+        owned = _hand_owns(dict, pos);
+        
+        for (k = 0, cur = head->key != NULL ? head : NULL; cur != NULL; k++, cur = cur->next) {
+            entry = DICT_CACHE_ENTRY(dict, cur);
+            if (!entry->referenced || visits >= (size_t)span * 2) {
+                break;
+            }
+            
+            if (owned) {
+                entry->referenced = 0;
+            }
+        }
+        
+        // The hand moves on past the bucket, whose entries before cur just
+        // had their bits cleared.
+        dict->clock_hand++;
+        visits++;
+        
+        if (cur == NULL) {
+            continue;
+        }
+        
+        if (!owned) {
+            head = _bucket_mut(dict, pos);
+            if (head == NULL) {
+                return 0;
+            }
+        }
+        
+        for (prev = NULL, cur = head; k > 0; k--) {
+            prev = cur;
+            cur = cur->next;
+        }
+        
+        _remove(dict, head, prev, cur);
+        return 1;
+    }
+}
+
+/**
+ * Deletes the expired entries of bucket idx, returning how many there were.
+ **/
+static size_t _expire_bucket(struct dict *dict, uint32_t idx, uint64_t now)
+{
+    struct dict_node *head, *prev, *cur;
+    size_t n = 0;
+    
+    // Only buckets with something to delete are copied from a snapshot.
+    for (cur = dict_table_bucket(dict, idx); cur != NULL && cur->key != NULL; cur = cur->next) {
+        if (_expired(dict, cur, now)) {
+            break;
+        }
+    }
+    
+    if (cur == NULL || cur->key == NULL || (head = _bucket_mut(dict, idx)) == NULL) {
+        return 0;
+    }
+    
+    // A removed head or probed slot is refilled by the next entry, which is
+    // then looked at in turn.
+    prev = NULL;
+    cur = head;
+    while (cur != NULL && cur->key != NULL) {
+        if (!_expired(dict, cur, now)) {
+            prev = cur;
+            cur = cur->next;
+            continue;
+        }
+        
+        _remove(dict, head, prev, cur);
+        cur = prev != NULL ? prev->next : head;
+        n++;
+    }
+    
+    return n;
+}
+
+/**
+ * Brings a cache back within its bounds after an insert, and advances the
+ * expiry sweep, if any entry was given a TTL.
+ **/
+void dict_cache_maintain(struct dict *dict)
+{
+    while ((dict->max_entries > 0 && dict->used > dict->max_entries) ||
+           (dict->max_bytes > 0 && dict->bytes > dict->max_bytes)) {
+        if (!_evict(dict)) {
+            break;
+        }
+    }
+    
+    if (dict->ttls) {
+        dict_expire(dict, DICT_CACHE_SWEEP);
+    }
+}
+
+/**
+ * Sweeps budget buckets (or for DICT_ENGINE_PROBED, slots) of a cache for
+ * expired entries, and deletes them. Every call picks up where the last one
+ * stopped, so calling it regularly, say from a timer, reclaims the memory of
+ * entries that expire without being looked up again. dict_set() sweeps a
+ * few buckets by itself. While the table is being resized, the budget goes
+ * into moving buckets to the new table instead, and nothing is swept.
+ *
+ * @param   struct dict *dict
+ * @param   uint32_t budget
+ * @return  size_t
+ *
+ * Returns the number of entries deleted.
+ **/
+size_t dict_expire(struct dict *dict, uint32_t budget)
+{
+    uint64_t now;
+    size_t n = 0;
+    
+    if (!(dict->flags & DICT_F_CACHE) || !dict->ttls || dict->used == 0) {
+        return 0;
+    }
+    
+    if (dict->rehash_table != NULL) {
+        dict_rehash_step(dict, budget);
+        return 0;
+    }
+    
+    now = dict->clock_fn();
+    
+    for (; budget > 0; budget--, dict->expire_idx++) {
+        n += _expire_bucket(dict, dict->expire_idx & (dict->capacity - 1), now);
+    }
+    
+    if (n > 0) {
+        dict_shrink_if_needed(dict);
+    }
+    
+    return n;
+}
@@ -0,0 +1,620 @@
+/*
+ * Thread-safe dict with lock-free readers.
+ *
+ * Lookups never take a lock. Buckets are singly linked chains that writers
+ * only ever change by publishing a fully built node with a release store, so
+ * a reader walking a chain sees either the old or the new version of it.
+ * Nodes are never modified in place: dict_concurrent_set() on an existing key
+ * swaps in a new node.
+ *
+ * Writers lock one of DICT_CONCURRENT_STRIPES stripes, picked by the low bits
+ * of the hash. Tables are never smaller than the number of stripes, so all of
+ * a bucket's keys share a stripe at every capacity. Resizing takes all the
+ * stripes, copies the chains into a new table and publishes it; readers keep
+ * going on whichever table they loaded.
+ *
+ * Unlinked nodes and replaced tables are retired rather than freed, and freed
+ * in batches once every reader that might still see them has finished. This
+ * is epoch based: a reader counts itself under the parity of the current
+ * epoch, and reclamation advances the epoch and waits for the old parity's
+ * counters to drain.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "dict_concurrent.h"
+#include "dict_private.h"
+#include "hash.h"
+
+#define RETIRE_NODE  0
+#define RETIRE_TABLE 1
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// Reader slot of the calling thread, plus one. Threads are spread over the
+// slots round-robin.
+static __thread unsigned _reader_slot;
+static unsigned _reader_slots_used;
+
+static void _dummy_free_fn(void *ptr)
+{
+}
+
+static struct dict_concurrent_table *_table_new(uint32_t capacity)
+{
+    struct dict_concurrent_table *table;
+    
+    table = calloc(1, sizeof(*table) + (size_t)capacity * sizeof(struct dict_node *));
+    if (table == NULL) {
+        return NULL;
+    }
+    
+    table->capacity = capacity;
+    
+    return table;
+}
+
+/**
+ * Frees the chain nodes of table, but not their keys or values, which have
+ * been carried over into a newer table.
+ **/
+static void _table_free(struct dict_concurrent_table *table)
+{
+    struct dict_node *cur, *next;
+    uint32_t i;
+    
+    for (i = 0; i < table->capacity; i++) {
+        for (cur = table->buckets[i]; cur != NULL; cur = next) {
+            next = cur->next;
+            free(cur);
+        }
+    }
+    
+    free(table);
+}
+
+static void _free_retired(struct dict_concurrent *dict, struct dict_concurrent_retired *r)
+{
+    struct dict_node *node;
+    
+    if (r->kind == RETIRE_TABLE) {
+        _table_free(r->ptr);
+        return;
+    }
+    
+    node = r->ptr;
+    dict->key_free_fn(node->key);
+    dict->value_free_fn(node->value);
+    free(node);
+}
+
+/**
+ * Waits until no reader can still hold a reference retired before the call.
+ **/
+static void _synchronize(struct dict_concurrent *dict)
+{
+    unsigned long epoch;
+    unsigned i;
+    
+    epoch = __atomic_load_n(&dict->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&dict->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    
+    for (i = 0; i < DICT_CONCURRENT_READER_SLOTS; i++) {
+        while (__atomic_load_n(&dict->readers[i].count[epoch & 1], __ATOMIC_SEQ_CST) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Frees everything retired so far. Caller holds retire_lock.
+ **/
+static void _reclaim_locked(struct dict_concurrent *dict)
+{
+    size_t i;
+    
+    if (dict->retired_count == 0) {
+        return;
+    }
+    
+    _synchronize(dict);
+    
+    for (i = 0; i < dict->retired_count; i++) {
+        _free_retired(dict, &dict->retired[i]);
+    }
+    
+    dict->retired_count = 0;
+}
+
+/**
+ * Hands ptr over to be freed once no reader can see it anymore. Must not be
+ * called from inside a read section, which reclamation would wait on.
+ **/
+static void _retire(struct dict_concurrent *dict, void *ptr, int kind)
+{
+    struct dict_concurrent_retired *retired;
+    struct dict_concurrent_retired r;
+    size_t size;
+    
+    r.ptr = ptr;
+    r.kind = kind;
+    
+    pthread_mutex_lock(&dict->retire_lock);
+    
+    if (dict->retired_count == dict->retired_size) {
+        size = dict->retired_size > 0 ? dict->retired_size * 2 : 64;
+        retired = realloc(dict->retired, size * sizeof(*retired));
+        
+        if (retired == NULL) {
+            // Out of memory: wait for the readers right away instead.
+            _reclaim_locked(dict);
+            _synchronize(dict);
+            _free_retired(dict, &r);
+            pthread_mutex_unlock(&dict->retire_lock);
+            return;
+        }
+        
+        dict->retired = retired;
+        dict->retired_size = size;
+    }
+    
+    dict->retired[dict->retired_count++] = r;
+    
+    if (dict->retired_count >= DICT_CONCURRENT_RETIRE_BATCH) {
+        _reclaim_locked(dict);
+    }
+    
+    pthread_mutex_unlock(&dict->retire_lock);
+}
+
+static uint32_t _next_capacity(uint32_t capacity)
+{
+    uint32_t n = DICT_CONCURRENT_STRIPES;
+    
+    while (n < capacity && n < (UINT32_C(1) << 31)) {
+        n <<= 1;
+    }
+    
+    return n;
+}
+
+/**
+ * Create new concurrent dict from opts. Only the chained engine is
+ * supported, and the dict doesn't copy keys, so opts->engine must be
+ * DICT_ENGINE_CHAINED and opts->flags must not contain DICT_F_OWN_KEYS.
+ *
+ * @param   const struct dict_opts *opts
+ * @return  struct dict_concurrent *
+ *
+ * Returns the new dict, or NULL on error.
+ **/
+struct dict_concurrent *dict_concurrent_new(const struct dict_opts *opts)
+{
+    struct dict_concurrent *dict;
+    unsigned i;
+    
+    if (opts->engine != DICT_ENGINE_CHAINED || (opts->flags & DICT_F_OWN_KEYS)) {
+        return NULL;
+    }
+    
+    dict = malloc(sizeof(*dict));
+    if (dict == NULL) {
+        return NULL;
+    }
+    
+    memset(dict, 0, sizeof(*dict));
+    dict->hash = opts->hash;
+    dict->hash_fn = hash_policy_fn(opts->hash);
+    
+    if (dict->hash_fn == NULL) {
+        free(dict);
+        return NULL;
+    }
+    
+    if (dict->hash == DICT_HASH_SIPHASH) {
+        dict->hash_key[0] = opts->hash_key[0];
+        dict->hash_key[1] = opts->hash_key[1];
+        
+        if (dict->hash_key[0] == 0 && dict->hash_key[1] == 0) {
+            hash_derive_key(opts->seed, dict->hash_key);
+        }
+    } else {
+        dict->hash_key[0] = opts->seed;
+        dict->hash_key[1] = 0;
+    }
+    
+    dict->table = _table_new(_next_capacity(opts->capacity));
+    if (dict->table == NULL) {
+        free(dict);
+        return NULL;
+    }
+    
+    dict->seed = opts->seed;
+    dict->max_load = opts->max_load > 0.0f ? opts->max_load : DICT_DEFAULT_MAX_LOAD;
+    dict->key_free_fn = opts->key_free_fn != NULL ? opts->key_free_fn : _dummy_free_fn;
+    dict->value_free_fn = opts->value_free_fn != NULL ? opts->value_free_fn : _dummy_free_fn;
+    
+    for (i = 0; i < DICT_CONCURRENT_STRIPES; i++) {
+        pthread_mutex_init(&dict->stripes[i].lock, NULL);
+    }
+    
+    pthread_mutex_init(&dict->resize_lock, NULL);
+    pthread_mutex_init(&dict->retire_lock, NULL);
+    
+    return dict;
+}
+
+/**
+ * Frees the dict and every entry in it. No other thread may be using it.
+ *
+ * @param   struct dict_concurrent *dict
+ * @return  void
+ **/
+void dict_concurrent_delete(struct dict_concurrent *dict)
+{
+    struct dict_concurrent_table *table = dict->table;
+    struct dict_node *cur, *next;
+    uint32_t i;
+    
+    dict_concurrent_reclaim(dict);
+    
+    for (i = 0; i < table->capacity; i++) {
+        for (cur = table->buckets[i]; cur != NULL; cur = next) {
+            next = cur->next;
+            dict->key_free_fn(cur->key);
+            dict->value_free_fn(cur->value);
+            free(cur);
+        }
+    }
+    
+    for (i = 0; i < DICT_CONCURRENT_STRIPES; i++) {
+        pthread_mutex_destroy(&dict->stripes[i].lock);
+    }
+    
+    pthread_mutex_destroy(&dict->resize_lock);
+    pthread_mutex_destroy(&dict->retire_lock);
+    free(dict->retired);
+    free(table);
+    free(dict);
+}
+
+/**
+ * Copies every chain into a new table of capacity buckets and publishes it.
+ * Caller holds resize_lock.
+ **/
+static int _resize_locked(struct dict_concurrent *dict, uint32_t capacity)
+{
+    struct dict_concurrent_table *old, *table;
+    struct dict_node *cur, *node;
+    uint32_t i, idx;
+    
+    table = _table_new(capacity);
+    if (table == NULL) {
+        return 0;
+    }
+    
+    for (i = 0; i < DICT_CONCURRENT_STRIPES; i++) {
+        pthread_mutex_lock(&dict->stripes[i].lock);
+    }
+    
+    old = dict->table;
+    
+    // The old chains stay intact for readers still walking them, so the
+    // new table gets copies.
+    for (i = 0; i < old->capacity; i++) {
+        for (cur = old->buckets[i]; cur != NULL; cur = cur->next) {
+            node = malloc(sizeof(*node));
+            if (node == NULL) {
+                for (i = 0; i < DICT_CONCURRENT_STRIPES; i++) {
+                    pthread_mutex_unlock(&dict->stripes[i].lock);
+                }
+                
+                _table_free(table);
+                return 0;
+            }
+            
+            memcpy(node, cur, sizeof(*node));
+            idx = node->hash & (capacity - 1);
+            node->next = table->buckets[idx];
+            table->buckets[idx] = node;
+        }
+    }
+    
+    STORE(&dict->table, table);
+    
+    for (i = 0; i < DICT_CONCURRENT_STRIPES; i++) {
+        pthread_mutex_unlock(&dict->stripes[i].lock);
+    }
+    
+    _retire(dict, old, RETIRE_TABLE);
+    
+    return 1;
+}
+
+/**
+ * Resizes the table to capacity buckets, rounded up to a power of two and at
+ * least DICT_CONCURRENT_STRIPES. Readers carry on during the resize, writers
+ * wait for it.
+ *
+ * @param   struct dict_concurrent *dict
+ * @param   uint32_t capacity
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_concurrent_resize(struct dict_concurrent *dict, uint32_t capacity)
+{
+    int ret;
+    
+    pthread_mutex_lock(&dict->resize_lock);
+    ret = _resize_locked(dict, _next_capacity(capacity));
+    pthread_mutex_unlock(&dict->resize_lock);
+    
+    return ret;
+}
+
+/**
+ * Returns the number of entries. With concurrent writers, this is only a
+ * snapshot.
+ *
+ * @param   struct dict_concurrent *dict
+ * @return  size_t
+ **/
+size_t dict_concurrent_size(struct dict_concurrent *dict)
+{
+    return __atomic_load_n(&dict->used, __ATOMIC_RELAXED);
+}
+
+/**
+ * Doubles the table once it exceeds max_load. If another thread is already
+ * resizing, that resize will do.
+ **/
+static void _expand_if_needed(struct dict_concurrent *dict)
+{
+    struct dict_concurrent_table *table = LOAD(&dict->table);
+    
+    if ((float)dict_concurrent_size(dict) <= (float)table->capacity * dict->max_load) {
+        return;
+    }
+    
+    if (pthread_mutex_trylock(&dict->resize_lock) != 0) {
+        return;
+    }
+    
+    table = dict->table;
+    if (table->capacity < (UINT32_C(1) << 31) &&
+        (float)dict_concurrent_size(dict) > (float)table->capacity * dict->max_load) {
+        _resize_locked(dict, table->capacity << 1);
+    }
+    
+    pthread_mutex_unlock(&dict->resize_lock);
+}
+
+/**
+ * Enters a read section. Nodes returned by dict_concurrent_get() stay valid
+ * until the matching dict_concurrent_read_unlock(). Read sections may nest,
+ * but the thread must not write to the dict while inside one.
+ *
+ * @param   struct dict_concurrent *dict
+ * @return  unsigned
+ *
+ * Returns a token to pass to dict_concurrent_read_unlock().
+ **/
+unsigned dict_concurrent_read_lock(struct dict_concurrent *dict)
+{
+    unsigned long epoch;
+    unsigned slot;
+    
+    if (_reader_slot == 0) {
+        _reader_slot = __atomic_fetch_add(&_reader_slots_used, 1, __ATOMIC_RELAXED) % DICT_CONCURRENT_READER_SLOTS + 1;
+    }
+    
+    slot = _reader_slot - 1;
+    
+    for (;;) {
+        epoch = __atomic_load_n(&dict->epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&dict->readers[slot].count[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        
+        // Counted under a parity that reclamation had already moved past,
+        // so it may not wait for us. Try again under the new one.
+        if (__atomic_load_n(&dict->epoch, __ATOMIC_SEQ_CST) == epoch) {
+            return slot * 2 + (unsigned)(epoch & 1);
+        }
+        
+        __atomic_fetch_sub(&dict->readers[slot].count[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Leaves a read section.
+ *
+ * @param   struct dict_concurrent *dict
+ * @param   unsigned token
+ * @return  void
+ **/
+void dict_concurrent_read_unlock(struct dict_concurrent *dict, unsigned token)
+{
+    __atomic_fetch_sub(&dict->readers[token / 2].count[token & 1], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Frees all retired nodes and tables, waiting for readers that may still
+ * see them. Retired memory is also freed automatically every
+ * DICT_CONCURRENT_RETIRE_BATCH retirements.
+ *
+ * @param   struct dict_concurrent *dict
+ * @return  void
+ **/
+void dict_concurrent_reclaim(struct dict_concurrent *dict)
+{
+    pthread_mutex_lock(&dict->retire_lock);
+    _reclaim_locked(dict);
+    pthread_mutex_unlock(&dict->retire_lock);
+}
+
+/**
+ * Set key to value, replacing the previous entry for key if there is one.
+ * The replaced key and value are freed once no reader can see them.
+ *
+ * @param   struct dict_concurrent *dict
+ * @param   char *key
+ * @param   void *value
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_concurrent_set(struct dict_concurrent *dict, char *key, void *value)
+{
+    pthread_mutex_t *lock;
+    struct dict_concurrent_table *table;
+    struct dict_node **link, *cur, *node;
+    size_t len = strlen(key);
+    uint32_t hash;
+    
+    hash = dict->hash_fn(dict->hash_key, key, len);
+    
+    node = malloc(sizeof(*node));
+    if (node == NULL) {
+        return 0;
+    }
+    
+    node->hash = hash;
+    node->key_len = len;
+    node->key = key;
+    node->value = value;
+    
+    lock = &dict->stripes[hash & (DICT_CONCURRENT_STRIPES - 1)].lock;
+    pthread_mutex_lock(lock);
+    
+    table = dict->table;
+    link = &table->buckets[hash & (table->capacity - 1)];
+    
+    for (cur = *link; cur != NULL; cur = cur->next) {
+        if (NODE_MATCHES(cur, hash, key, len)) {
+            break;
+        }
+        
+        link = &cur->next;
+    }
+    
+    if (cur != NULL) {
+        node->next = cur->next;
+        STORE(link, node);
+        pthread_mutex_unlock(lock);
+        
+        _retire(dict, cur, RETIRE_NODE);
+        return 1;
+    }
+    
+    node->next = *link;
+    STORE(link, node);
+    __atomic_fetch_add(&dict->used, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(lock);
+    
+    _expand_if_needed(dict);
+    
+    return 1;
+}
+
+/**
+ * Get node for key. Must be called inside a read section, and the node is
+ * only valid until it ends.
+ *
+ * @param   struct dict_concurrent *dict
+ * @param   char *key
+ * @return  struct dict_node *
+ *
+ * Returns the node, or NULL if it is not found.
+ **/
+struct dict_node *dict_concurrent_get(struct dict_concurrent *dict, char *key)
+{
+    struct dict_concurrent_table *table;
+    struct dict_node *cur;
+    size_t len = strlen(key);
+    uint32_t hash;
+    
+    hash = dict->hash_fn(dict->hash_key, key, len);
+    table = LOAD(&dict->table);
+    
+    for (cur = LOAD(&table->buckets[hash & (table->capacity - 1)]); cur != NULL; cur = LOAD(&cur->next)) {
+        if (NODE_MATCHES(cur, hash, key, len)) {
+            return cur;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Delete key from dict. Its key and value are freed once no reader can see
+ * them.
+ *
+ * @param   struct dict_concurrent *dict
+ * @param   char *key
+ * @return  int
+ *
+ * Returns 1 if the key was deleted, and 0 if it was not found.
+ **/
+int dict_concurrent_del(struct dict_concurrent *dict, char *key)
+{
+    pthread_mutex_t *lock;
+    struct dict_concurrent_table *table;
+    struct dict_node **link, *cur;
+    size_t len = strlen(key);
+    uint32_t hash;
+    
+    hash = dict->hash_fn(dict->hash_key, key, len);
+    lock = &dict->stripes[hash & (DICT_CONCURRENT_STRIPES - 1)].lock;
+    pthread_mutex_lock(lock);
+    
+    table = dict->table;
+    link = &table->buckets[hash & (table->capacity - 1)];
+    
+    for (cur = *link; cur != NULL; cur = cur->next) {
+        if (NODE_MATCHES(cur, hash, key, len)) {
+            break;
+        }
+        
+        link = &cur->next;
+    }
+    
+    if (cur == NULL) {
+        pthread_mutex_unlock(lock);
+        return 0;
+    }
+    
+    STORE(link, cur->next);
+    __atomic_fetch_sub(&dict->used, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(lock);
+    
+    _retire(dict, cur, RETIRE_NODE);
+    
+    return 1;
+}
+
+/**
+ * Check if dict contains key. Lock-free, and may be called outside a read
+ * section.
+ *
+ * @param   struct dict_concurrent *dict
+ * @param   char *key
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise.
+ **/
+int dict_concurrent_contains(struct dict_concurrent *dict, char *key)
+{
+    unsigned token;
+    int ret;
+    
+    token = dict_concurrent_read_lock(dict);
+    ret = dict_concurrent_get(dict, key) != NULL;
+    dict_concurrent_read_unlock(dict, token);
+    
+    return ret;
+}
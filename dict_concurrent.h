@@ -0,0 +1,86 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "dict.h"
+
+// Writers lock one of DICT_CONCURRENT_STRIPES stripes, chosen by the low
+// bits of the hash. Readers announce themselves in one of
+// DICT_CONCURRENT_READER_SLOTS counters.
+#define DICT_CONCURRENT_STRIPES 64
+#define DICT_CONCURRENT_READER_SLOTS 64
+
+// Retired nodes and tables are freed in batches of this many.
+#define DICT_CONCURRENT_RETIRE_BATCH 1024
+
+struct dict_concurrent_table {
+    uint32_t capacity;
+    struct dict_node *buckets[];
+};
+
+// Padded to a cache line each, so threads on different stripes or reader
+// slots don't contend for the same line.
+union dict_concurrent_stripe {
+    pthread_mutex_t lock;
+    char pad[64];
+};
+
+union dict_concurrent_readers {
+    unsigned long count[2];
+    char pad[64];
+};
+
+struct dict_concurrent_retired {
+    void *ptr;
+    int kind;
+};
+
+struct dict_concurrent {
+    struct dict_concurrent_table *table;
+    size_t used;
+    uint32_t seed;
+    float max_load;
+    
+    void (*key_free_fn)(void *);
+    void (*value_free_fn)(void *);
+    
+    int hash;
+    uint64_t hash_key[2];
+    uint32_t (*hash_fn)(const uint64_t key[2], const void *buf, size_t size);
+    
+    union dict_concurrent_stripe stripes[DICT_CONCURRENT_STRIPES];
+    pthread_mutex_t resize_lock;
+    
+    // Epoch based reclamation. Readers count themselves in the parity of
+    // the epoch they entered. Memory retired before the epoch is advanced
+    // is freed once every reader counted in the old parity has left.
+    unsigned long epoch;
+    union dict_concurrent_readers readers[DICT_CONCURRENT_READER_SLOTS];
+    pthread_mutex_t retire_lock;
+    struct dict_concurrent_retired *retired;
+    size_t retired_count;
+    size_t retired_size;
+};
+
+struct dict_concurrent *dict_concurrent_new(const struct dict_opts *opts);
+void dict_concurrent_delete(struct dict_concurrent *dict);
+int dict_concurrent_resize(struct dict_concurrent *dict, uint32_t capacity);
+size_t dict_concurrent_size(struct dict_concurrent *dict);
+
+unsigned dict_concurrent_read_lock(struct dict_concurrent *dict);
+void dict_concurrent_read_unlock(struct dict_concurrent *dict, unsigned token);
+void dict_concurrent_reclaim(struct dict_concurrent *dict);
+
+int dict_concurrent_set(struct dict_concurrent *dict, char *key, void *value);
+struct dict_node *dict_concurrent_get(struct dict_concurrent *dict, char *key);
+int dict_concurrent_del(struct dict_concurrent *dict, char *key);
+int dict_concurrent_contains(struct dict_concurrent *dict, char *key);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,475 @@
+/*
+ * Frozen dicts: immutable tables on a minimal perfect hash.
+ *
+ * dict_freeze() hashes every key to 64 bits, and splits the keys into
+ * buckets of about FREEZE_BUCKET_LOAD keys. Buckets are placed largest
+ * first: each gets the first pilot that sends all its keys to distinct free
+ * slots, the slot of a key being a mix of its hash and its bucket's pilot
+ * (the CHD / PTHash scheme). With as many slots as keys, the pilots form a
+ * minimal perfect hash, and the records are stored in slot order.
+ *
+ * A lookup reads the pilot of the key's bucket, then the one record in the
+ * key's slot, and compares keys once to reject keys that were never in the
+ * dict.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "dict_frozen.h"
+#include "dict_private.h"
+#include "hash.h"
+
+// Average number of keys per bucket. Fewer means more pilots to store,
+// and more means longer searches for them.
+#define FREEZE_BUCKET_LOAD 4
+
+// Buckets larger than this, and keys with equal 64-bit hashes, make the
+// build start over with another seed.
+#define FREEZE_MAX_BUCKET 64
+#define FREEZE_MAX_ATTEMPTS 16
+
+#define GOLDEN UINT64_C(0x9e3779b97f4a7c15)
+
+// An entry of a frozen dict. Records are packed back to back, each padded
+// to 8 bytes, so the value and the key share a cache line.
+struct dict_frozen_record {
+    void *value;
+    uint32_t key_len;
+    char key[];
+};
+
+#define TEST_BIT(bits, i) (((bits)[(i) / 64] >> ((i) % 64)) & 1)
+
+#define RECORD_UNITS(len) ((offsetof(struct dict_frozen_record, key) + (size_t)(len) + 1 + 7) / 8)
+
+struct freeze_job {
+    uint32_t n;
+    uint32_t nbuckets;
+    const uint64_t *hashes;
+    uint32_t *pilots;
+    
+    // Keys grouped by bucket; those of bucket b are members[start[b]]
+    // up to members[start[b + 1]].
+    uint32_t *start;
+    uint32_t *members;
+    uint32_t *order;
+    uint64_t *taken;
+};
+
+static uint64_t _mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= UINT64_C(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    x *= UINT64_C(0xc4ceb9fe1a85ec53);
+    x ^= x >> 33;
+    
+    return x;
+}
+
+// Maps the high bits of x onto [0, n) with a multiply instead of a modulo.
+static inline uint32_t _reduce(uint64_t x, uint32_t n)
+{
+    return (uint32_t)(((x >> 32) * n) >> 32);
+}
+
+static inline uint32_t _slot(uint64_t hash, uint32_t pilot, uint32_t n)
+{
+    return _reduce(_mix(hash ^ (pilot * GOLDEN)), n);
+}
+
+/**
+ * Searches a pilot for every bucket, filling job->pilots.
+ *
+ * Returns 1 on success, and 0 if the hashes can't be placed, in which case
+ * another seed should be tried.
+ **/
+static int _place(struct freeze_job *job)
+{
+    uint32_t sizes[FREEZE_MAX_BUCKET + 2];
+    uint32_t slots[FREEZE_MAX_BUCKET];
+    uint64_t hashes[FREEZE_MAX_BUCKET];
+    uint64_t pilot, max_pilot;
+    uint32_t i, j, b, k, size;
+    
+    // Group keys by bucket. start[b] counts up to the end of bucket b, and
+    // placing each key in turn moves it back to the start.
+    memset(job->start, 0, ((size_t)job->nbuckets + 1) * sizeof(*job->start));
+    
+    for (i = 0; i < job->n; i++) {
+        b = _reduce(job->hashes[i], job->nbuckets);
+        if (++job->start[b] > FREEZE_MAX_BUCKET) {
+            return 0;
+        }
+    }
+    
+    for (b = 0; b < job->nbuckets; b++) {
+        job->start[b + 1] += job->start[b];
+    }
+    
+    for (i = 0; i < job->n; i++) {
+        job->members[--job->start[_reduce(job->hashes[i], job->nbuckets)]] = i;
+    }
+    
+    // Order buckets largest first, while the table is still empty enough
+    // to place them.
+    memset(sizes, 0, sizeof(sizes));
+    
+    for (b = 0; b < job->nbuckets; b++) {
+        sizes[FREEZE_MAX_BUCKET - (job->start[b + 1] - job->start[b]) + 1]++;
+    }
+    
+    for (k = 0; k <= FREEZE_MAX_BUCKET; k++) {
+        sizes[k + 1] += sizes[k];
+    }
+    
+    for (b = 0; b < job->nbuckets; b++) {
+        job->order[sizes[FREEZE_MAX_BUCKET - (job->start[b + 1] - job->start[b])]++] = b;
+    }
+    
+    memset(job->taken, 0, ((size_t)job->n / 64 + 1) * sizeof(*job->taken));
+    memset(job->pilots, 0, (size_t)job->nbuckets * sizeof(*job->pilots));
+    
+    // A bucket placed when f of the n slots are free needs about n / f
+    // tries per key; the last ones need about n.
+    max_pilot = (uint64_t)job->n * 64 + 65536;
+    if (max_pilot > UINT32_MAX) {
+        max_pilot = UINT32_MAX;
+    }
+    
+    for (k = 0; k < job->nbuckets; k++) {
+        b = job->order[k];
+        size = job->start[b + 1] - job->start[b];
+        
+        if (size == 0) {
+            break;
+        }
+        
+        for (i = 0; i < size; i++) {
+            hashes[i] = job->hashes[job->members[job->start[b] + i]];
+            
+            // No pilot separates two equal hashes.
+            for (j = 0; j < i; j++) {
+                if (hashes[i] == hashes[j]) {
+                    return 0;
+                }
+            }
+        }
+        
+        for (pilot = 0; pilot < max_pilot; pilot++) {
+            for (i = 0; i < size; i++) {
+                slots[i] = _slot(hashes[i], (uint32_t)pilot, job->n);
+                if (TEST_BIT(job->taken, slots[i])) {
+                    break;
+                }
+                
+                job->taken[slots[i] / 64] |= UINT64_C(1) << (slots[i] % 64);
+            }
+            
+            if (i == size) {
+                break;
+            }
+            
+            while (i-- > 0) {
+                job->taken[slots[i] / 64] &= ~(UINT64_C(1) << (slots[i] % 64));
+            }
+        }
+        
+        if (pilot == max_pilot) {
+            return 0;
+        }
+        
+        job->pilots[b] = (uint32_t)pilot;
+    }
+    
+    return 1;
+}
+
+/**
+ * Builds the records of frozen in slot order, from the entries in nodes.
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+static int _pack(struct dict_frozen *frozen, struct dict_node **nodes, const uint64_t *hashes, uint32_t *by_slot)
+{
+    struct dict_frozen_record *record;
+    struct dict_node *node;
+    uint64_t units = 0;
+    uint32_t i, s, n = (uint32_t)frozen->size;
+    
+    for (i = 0; i < n; i++) {
+        s = _slot(hashes[i], frozen->pilots[_reduce(hashes[i], frozen->nbuckets)], n);
+        by_slot[s] = i;
+    }
+    
+    for (s = 0; s < n; s++) {
+        frozen->offsets[s] = (uint32_t)units;
+        units += RECORD_UNITS(nodes[by_slot[s]]->key_len);
+        
+        // Offsets are 32 bits, counting 8 byte units.
+        if (units > UINT32_MAX) {
+            return 0;
+        }
+    }
+    
+    frozen->offsets[n] = (uint32_t)units;
+    frozen->records_size = (size_t)units * 8;
+    frozen->records = calloc(units > 0 ? (size_t)units : 1, 8);
+    if (frozen->records == NULL) {
+        return 0;
+    }
+    
+    for (s = 0; s < n; s++) {
+        node = nodes[by_slot[s]];
+        record = (struct dict_frozen_record *)(frozen->records + (size_t)frozen->offsets[s] * 8);
+        record->value = node->value;
+        record->key_len = node->key_len;
+        memcpy(record->key, node->key, node->key_len);
+    }
+    
+    return 1;
+}
+
+/**
+ * Turns dict into a frozen dict, which can't be modified but answers every
+ * lookup with a single probe. Keys are copied into the frozen dict, and
+ * its values are moved there: on success, dict is deleted, freeing its
+ * keys but not its values, which the frozen dict frees with the dict's
+ * value_free_fn.
+ *
+ * @param   struct dict *dict
+ * @return  struct dict_frozen *
+ *
+ * Returns NULL on error, leaving dict untouched. Dicts with inline values
+ * can't be frozen, as frozen dicts only store value pointers.
+ **/
+struct dict_frozen *dict_freeze(struct dict *dict)
+{
+    struct dict_frozen *frozen;
+    struct dict_iterator it;
+    struct dict_node **nodes = NULL, *node;
+    struct freeze_job job;
+    uint64_t *hashes = NULL;
+    uint32_t i, n, attempt;
+    int ok = 0;
+    
+    if (dict->used > UINT32_MAX - 1 || dict->value_size > 0) {
+        return NULL;
+    }
+    
+    n = (uint32_t)dict->used;
+    
+    frozen = calloc(1, sizeof(*frozen));
+    if (frozen == NULL) {
+        return NULL;
+    }
+    
+    frozen->size = n;
+    frozen->nbuckets = n / FREEZE_BUCKET_LOAD + 1;
+    frozen->value_free_fn = dict_value_free_fn(dict);
+    
+    memset(&job, 0, sizeof(job));
+    job.n = n;
+    job.nbuckets = frozen->nbuckets;
+    
+    frozen->pilots = malloc((size_t)frozen->nbuckets * sizeof(*frozen->pilots));
+    frozen->offsets = malloc(((size_t)n + 1) * sizeof(*frozen->offsets));
+    nodes = malloc(((size_t)n + 1) * sizeof(*nodes));
+    hashes = malloc(((size_t)n + 1) * sizeof(*hashes));
+    job.start = malloc(((size_t)frozen->nbuckets + 1) * sizeof(*job.start));
+    job.members = malloc(((size_t)n + 1) * sizeof(*job.members));
+    job.order = malloc((size_t)frozen->nbuckets * sizeof(*job.order));
+    job.taken = malloc(((size_t)n / 64 + 1) * sizeof(*job.taken));
+    
+    if (frozen->pilots == NULL || frozen->offsets == NULL || nodes == NULL || hashes == NULL ||
+        job.start == NULL || job.members == NULL || job.order == NULL || job.taken == NULL) {
+        goto out;
+    }
+    
+    job.hashes = hashes;
+    job.pilots = frozen->pilots;
+    
+    i = 0;
+    dict_iterate_start(dict, &it);
+    while ((node = dict_iterate_next(&it)) != NULL) {
+        nodes[i++] = node;
+    }
+    
+    for (attempt = 0; attempt < FREEZE_MAX_ATTEMPTS && !ok; attempt++) {
+        frozen->seed = (dict->hash_key[0] ^ dict->hash_key[1]) + attempt * GOLDEN;
+        
+        for (i = 0; i < n; i++) {
+            hashes[i] = fast64(frozen->seed, nodes[i]->key, nodes[i]->key_len);
+        }
+        
+        ok = _place(&job);
+    }
+    
+    // The members array is free again, and maps slots to entries.
+    ok = ok && _pack(frozen, nodes, hashes, job.members);
+    
+out:
+    free(nodes);
+    free(hashes);
+    free(job.start);
+    free(job.members);
+    free(job.order);
+    free(job.taken);
+    
+    if (!ok) {
+        frozen->value_free_fn = NULL;
+        dict_frozen_delete(frozen);
+        return NULL;
+    }
+    
+    dict_keep_values(dict);
+    dict_delete(dict);
+    
+    return frozen;
+}
+
+/**
+ * Delete a frozen dict, freeing its values with the value_free_fn of the
+ * dict it was made from.
+ *
+ * @param   struct dict_frozen *dict
+ * @return  void
+ **/
+void dict_frozen_delete(struct dict_frozen *dict)
+{
+    struct dict_frozen_record *record;
+    size_t s;
+    
+    if (dict->value_free_fn != NULL) {
+        for (s = 0; s < dict->size; s++) {
+            record = (struct dict_frozen_record *)(dict->records + (size_t)dict->offsets[s] * 8);
+            dict->value_free_fn(record->value);
+        }
+    }
+    
+    free(dict->pilots);
+    free(dict->offsets);
+    free(dict->records);
+    free(dict);
+}
+
+/**
+ * Returns the number of entries in a frozen dict.
+ *
+ * @param   struct dict_frozen *dict
+ * @return  size_t
+ **/
+size_t dict_frozen_size(struct dict_frozen *dict)
+{
+    return dict->size;
+}
+
+/**
+ * Get the value of key, which is len bytes long. Frozen dicts are never
+ * modified, so any number of threads can look up at once.
+ *
+ * @param   struct dict_frozen *dict
+ * @param   const char *key
+ * @param   size_t len
+ * @param   void **value
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise. value may be NULL.
+ **/
+int dict_frozen_get_n(struct dict_frozen *dict, const char *key, size_t len, void **value)
+{
+    struct dict_frozen_record *record;
+    uint64_t hash;
+    uint32_t n = (uint32_t)dict->size;
+    uint32_t s;
+    
+    if (n == 0) {
+        return 0;
+    }
+    
+    hash = fast64(dict->seed, key, len);
+    s = _slot(hash, dict->pilots[_reduce(hash, dict->nbuckets)], n);
+    record = (struct dict_frozen_record *)(dict->records + (size_t)dict->offsets[s] * 8);
+    
+    if (record->key_len != len || !dict_key_equal(record->key, key, len)) {
+        return 0;
+    }
+    
+    if (value != NULL) {
+        *value = record->value;
+    }
+    
+    return 1;
+}
+
+/**
+ * Get the value of key.
+ *
+ * @param   struct dict_frozen *dict
+ * @param   const char *key
+ * @param   void **value
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise. value may be NULL.
+ **/
+int dict_frozen_get(struct dict_frozen *dict, const char *key, void **value)
+{
+    return dict_frozen_get_n(dict, key, strlen(key), value);
+}
+
+/**
+ * Check if a frozen dict contains key.
+ *
+ * @param   struct dict_frozen *dict
+ * @param   const char *key
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise.
+ **/
+int dict_frozen_contains(struct dict_frozen *dict, const char *key)
+{
+    return dict_frozen_get_n(dict, key, strlen(key), NULL);
+}
+
+/**
+ * Start iterating over a frozen dict.
+ *
+ * @param   struct dict_frozen *dict
+ * @param   struct dict_frozen_iterator *it
+ * @return  void
+ **/
+void dict_frozen_iterate_start(struct dict_frozen *dict, struct dict_frozen_iterator *it)
+{
+    it->dict = dict;
+    it->idx = 0;
+}
+
+/**
+ * Fetches the next entry, in the order records are stored. Keys are NUL
+ * terminated.
+ *
+ * @param   struct dict_frozen_iterator *it
+ * @param   const char **key
+ * @param   size_t *key_len
+ * @param   void **value
+ * @return  int
+ *
+ * Returns 1 if an entry was fetched, and 0 once iteration has completed.
+ **/
+int dict_frozen_iterate_next(struct dict_frozen_iterator *it, const char **key, size_t *key_len, void **value)
+{
+    struct dict_frozen_record *record;
+    
+    if (it->idx >= it->dict->size) {
+        return 0;
+    }
+    
+    record = (struct dict_frozen_record *)(it->dict->records + (size_t)it->dict->offsets[it->idx++] * 8);
+    *key = record->key;
+    *key_len = record->key_len;
+    *value = record->value;
+    
+    return 1;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dict.h"
+
+struct dict_frozen {
+    size_t size;
+    uint32_t nbuckets;
+    uint64_t seed;
+    
+    // One pilot per bucket of keys, choosing where the bucket's keys land.
+    uint32_t *pilots;
+    
+    // Start of the record in each slot, in units of 8 bytes.
+    uint32_t *offsets;
+    char *records;
+    size_t records_size;
+    
+    void (*value_free_fn)(void *);
+};
+
+struct dict_frozen_iterator {
+    struct dict_frozen *dict;
+    size_t idx;
+};
+
+struct dict_frozen *dict_freeze(struct dict *dict);
+void dict_frozen_delete(struct dict_frozen *dict);
+size_t dict_frozen_size(struct dict_frozen *dict);
+
+int dict_frozen_get(struct dict_frozen *dict, const char *key, void **value);
+int dict_frozen_get_n(struct dict_frozen *dict, const char *key, size_t len, void **value);
+int dict_frozen_contains(struct dict_frozen *dict, const char *key);
+
+void dict_frozen_iterate_start(struct dict_frozen *dict, struct dict_frozen_iterator *it);
+int dict_frozen_iterate_next(struct dict_frozen_iterator *it, const char **key, size_t *key_len, void **value);
+
+#ifdef __cplusplus
+}
+#endif
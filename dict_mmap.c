@@ -0,0 +1,456 @@
+/*
+ * On-disk dict snapshots, served straight from a read-only mapping.
+ *
+ * dict_save() writes the entries of a dict grouped by bucket, with each
+ * bucket's extent given by a table of offsets, so the file holds no
+ * pointers and can be mapped anywhere. dict_open_mmap() only checks the
+ * header; lookups hash the key with the saved hash policy, and walk the
+ * entries of one bucket in place. Mappings are shared, so processes opening
+ * the same file share its pages.
+ *
+ * Files are trusted: the header and the bucket table are validated, but not
+ * every entry.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "dict_mmap.h"
+#include "dict_private.h"
+#include "hash.h"
+
+#define BYTE_ORDER_MARK 0x01020304U
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+// CRC32 hashes depend on the polynomial the library was built with.
+#ifdef DICT_CRC32C
+#define HASH_VARIANT 1
+#else
+#define HASH_VARIANT 0
+#endif
+
+static uint64_t _entry_size(uint64_t key_len, uint64_t value_len)
+{
+    return sizeof(struct dict_mmap_entry) + ALIGN8(key_len + 1) + ALIGN8(value_len);
+}
+
+static int _write_padded(FILE *fp, const void *buf, size_t len, size_t padded)
+{
+    static const char zeros[8];
+    
+    if (len > 0 && fwrite(buf, 1, len, fp) != len) {
+        return 0;
+    }
+    
+    return padded == len || fwrite(zeros, 1, padded - len, fp) == padded - len;
+}
+
+/**
+ * Writes the entries of nodes, in the given order. Values are sizes[i]
+ * bytes long, or saved as words.
+ **/
+static int _write_entries(FILE *fp, struct dict_node **nodes, const size_t *order, const size_t *sizes,
+                          size_t n, int value_bytes)
+{
+    struct dict_mmap_entry entry;
+    struct dict_node *node;
+    uint64_t word;
+    size_t i;
+    
+    for (i = 0; i < n; i++) {
+        node = nodes[order[i]];
+        entry.hash = node->hash;
+        entry.key_len = node->key_len;
+        entry.value_len = value_bytes ? sizes[order[i]] : 0;
+        
+        if (fwrite(&entry, sizeof(entry), 1, fp) != 1 ||
+            !_write_padded(fp, node->key, node->key_len, node->key_len) ||
+            !_write_padded(fp, "", 1, ALIGN8((uint64_t)node->key_len + 1) - node->key_len)) {
+            return 0;
+        }
+        
+        if (value_bytes) {
+            if (!_write_padded(fp, node->value, entry.value_len, ALIGN8(entry.value_len))) {
+                return 0;
+            }
+        } else {
+            word = (uint64_t)(uintptr_t)node->value;
+            if (fwrite(&word, sizeof(word), 1, fp) != 1) {
+                return 0;
+            }
+        }
+    }
+    
+    return 1;
+}
+
+/**
+ * Writes a snapshot of dict to path, which dict_open_mmap() can map. The
+ * file is written next to path and renamed over it when complete, so
+ * processes that still map an older snapshot keep a consistent view.
+ *
+ * Values are written as value_size_fn(value) bytes starting at value. If
+ * value_size_fn is NULL, inline values are saved whole, and other values
+ * are saved as the pointers themselves, as integers; use this for dicts
+ * that store integers rather than pointers.
+ *
+ * @param   struct dict *dict
+ * @param   const char *path
+ * @param   size_t (*value_size_fn)(void *value)
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_save(struct dict *dict, const char *path, size_t (*value_size_fn)(void *value))
+{
+    struct dict_mmap_header header;
+    struct dict_iterator it;
+    struct dict_node **nodes = NULL, *node;
+    uint64_t *buckets = NULL;
+    size_t *order = NULL, *counts = NULL, *sizes = NULL;
+    char *tmp = NULL;
+    FILE *fp = NULL;
+    size_t i, n = 0;
+    uint32_t b, capacity;
+    int bytes = value_size_fn != NULL || dict->value_size > 0;
+    int ok = 0;
+    
+    capacity = dict_next_capacity(dict->used > UINT32_MAX ? UINT32_MAX : (uint32_t)dict->used);
+    
+    nodes = malloc((dict->used + 1) * sizeof(*nodes));
+    order = malloc((dict->used + 1) * sizeof(*order));
+    sizes = malloc((dict->used + 1) * sizeof(*sizes));
+    buckets = calloc((size_t)capacity + 1, sizeof(*buckets));
+    counts = calloc((size_t)capacity + 1, sizeof(*counts));
+    tmp = malloc(strlen(path) + 5);
+    if (nodes == NULL || order == NULL || sizes == NULL || buckets == NULL || counts == NULL || tmp == NULL) {
+        goto out;
+    }
+    
+    dict_iterate_start(dict, &it);
+    while ((node = dict_iterate_next(&it)) != NULL) {
+        nodes[n++] = node;
+    }
+    
+    // Count the bytes of each bucket, and turn the counts into offsets.
+    for (i = 0; i < n; i++) {
+        b = nodes[i]->hash & (capacity - 1);
+        sizes[i] = value_size_fn != NULL ? value_size_fn(nodes[i]->value) : dict->value_size;
+        buckets[b + 1] += _entry_size(nodes[i]->key_len, bytes ? sizes[i] : 8);
+        counts[b + 1]++;
+    }
+    
+    for (b = 0; b < capacity; b++) {
+        buckets[b + 1] += buckets[b];
+        counts[b + 1] += counts[b];
+    }
+    
+    // Order the entries to match.
+    for (i = 0; i < n; i++) {
+        order[counts[nodes[i]->hash & (capacity - 1)]++] = i;
+    }
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DICT_MMAP_MAGIC, sizeof(header.magic));
+    header.version = DICT_MMAP_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.hash = dict->hash;
+    header.hash_variant = HASH_VARIANT;
+    header.hash_key[0] = dict->hash_key[0];
+    header.hash_key[1] = dict->hash_key[1];
+    header.capacity = capacity;
+    header.flags = bytes ? 0 : DICT_MMAP_F_WORD_VALUES;
+    header.count = n;
+    header.buckets_off = sizeof(header);
+    header.entries_off = header.buckets_off + ((uint64_t)capacity + 1) * sizeof(*buckets);
+    header.entries_size = buckets[capacity];
+    
+    sprintf(tmp, "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        goto out;
+    }
+    
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(buckets, sizeof(*buckets), (size_t)capacity + 1, fp) != (size_t)capacity + 1 ||
+        !_write_entries(fp, nodes, order, sizes, n, bytes)) {
+        goto out;
+    }
+    
+    ok = fclose(fp) == 0;
+    fp = NULL;
+    ok = ok && rename(tmp, path) == 0;
+    
+out:
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    
+    if (!ok && tmp != NULL) {
+        remove(tmp);
+    }
+    
+    free(nodes);
+    free(order);
+    free(sizes);
+    free(buckets);
+    free(counts);
+    free(tmp);
+    
+    return ok;
+}
+
+/**
+ * Maps a snapshot written by dict_save(). Only the header is read, so this
+ * takes the same time for any file size.
+ *
+ * @param   const char *path
+ * @return  struct dict_mmap *
+ *
+ * Returns the mapping, or NULL if the file can't be mapped or was not
+ * written by a compatible build.
+ **/
+struct dict_mmap *dict_open_mmap(const char *path)
+{
+    const struct dict_mmap_header *header;
+    struct dict_mmap *map;
+    struct stat st;
+    void *base;
+    int fd;
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(*header)) {
+        close(fd);
+        return NULL;
+    }
+    
+    base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    
+    header = base;
+    map = malloc(sizeof(*map));
+    
+    if (map == NULL ||
+        memcmp(header->magic, DICT_MMAP_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DICT_MMAP_VERSION ||
+        header->byte_order != BYTE_ORDER_MARK ||
+        header->hash_variant != HASH_VARIANT ||
+        hash_policy_fn(header->hash) == NULL ||
+        header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+        header->buckets_off != sizeof(*header) ||
+        header->entries_off != header->buckets_off + ((uint64_t)header->capacity + 1) * sizeof(uint64_t) ||
+        header->entries_off > (uint64_t)st.st_size ||
+        header->entries_size != (uint64_t)st.st_size - header->entries_off) {
+        free(map);
+        munmap(base, (size_t)st.st_size);
+        return NULL;
+    }
+    
+    map->base = base;
+    map->size = (size_t)st.st_size;
+    map->header = header;
+    map->buckets = (const uint64_t *)((const char *)base + header->buckets_off);
+    map->entries = (const char *)base + header->entries_off;
+    map->hash_fn = hash_policy_fn(header->hash);
+    
+    if (map->buckets[header->capacity] != header->entries_size) {
+        dict_mmap_close(map);
+        return NULL;
+    }
+    
+    return map;
+}
+
+/**
+ * Unmaps a snapshot.
+ *
+ * @param   struct dict_mmap *map
+ * @return  void
+ **/
+void dict_mmap_close(struct dict_mmap *map)
+{
+    munmap((void *)map->base, map->size);
+    free(map);
+}
+
+/**
+ * Returns the key, value and length of value of the entry at offset, and
+ * the offset of the next entry.
+ **/
+static uint64_t _entry_at(struct dict_mmap *map, uint64_t offset, const struct dict_mmap_entry **entry,
+                          const void **value, size_t *value_len)
+{
+    const struct dict_mmap_entry *e = (const struct dict_mmap_entry *)(map->entries + offset);
+    const char *data = (const char *)(e + 1) + ALIGN8((uint64_t)e->key_len + 1);
+    
+    *entry = e;
+    
+    if (map->header->flags & DICT_MMAP_F_WORD_VALUES) {
+        *value = (const void *)(uintptr_t)*(const uint64_t *)data;
+        *value_len = 0;
+        return offset + _entry_size(e->key_len, 8);
+    }
+    
+    *value = data;
+    *value_len = e->value_len;
+    return offset + _entry_size(e->key_len, e->value_len);
+}
+
+/**
+ * Get the value of key. For snapshots saved with a value_size_fn, value
+ * points into the mapping and value_len is its size. Otherwise value is the
+ * saved pointer value, and value_len is 0. Either may be NULL.
+ *
+ * @param   struct dict_mmap *map
+ * @param   const char *key
+ * @param   const void **value
+ * @param   size_t *value_len
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise.
+ **/
+int dict_mmap_get(struct dict_mmap *map, const char *key, const void **value, size_t *value_len)
+{
+    return dict_mmap_get_n(map, key, strlen(key), value, value_len);
+}
+
+/**
+ * Same as dict_mmap_get(), for a key of len bytes, such as the binary keys
+ * of dict_set_n(), or the 8-byte keys of DICT_F_U64_KEYS dicts.
+ *
+ * @param   struct dict_mmap *map
+ * @param   const char *key
+ * @param   size_t len
+ * @param   const void **value
+ * @param   size_t *value_len
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise.
+ **/
+int dict_mmap_get_n(struct dict_mmap *map, const char *key, size_t len, const void **value, size_t *value_len)
+{
+    const struct dict_mmap_entry *entry;
+    const void *v;
+    size_t vlen;
+    uint64_t offset, end, next;
+    uint32_t hash, b;
+    
+    hash = map->hash_fn(map->header->hash_key, key, len);
+    b = hash & (map->header->capacity - 1);
+    
+    for (offset = map->buckets[b], end = map->buckets[b + 1]; offset < end; offset = next) {
+        next = _entry_at(map, offset, &entry, &v, &vlen);
+        
+        if (entry->hash == hash && entry->key_len == len && memcmp(entry + 1, key, len) == 0) {
+            if (value != NULL) {
+                *value = v;
+            }
+            
+            if (value_len != NULL) {
+                *value_len = vlen;
+            }
+            
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Check if the snapshot contains key.
+ *
+ * @param   struct dict_mmap *map
+ * @param   const char *key
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise.
+ **/
+int dict_mmap_contains(struct dict_mmap *map, const char *key)
+{
+    return dict_mmap_get(map, key, NULL, NULL);
+}
+
+/**
+ * Same as dict_mmap_contains(), for a key of len bytes.
+ *
+ * @param   struct dict_mmap *map
+ * @param   const char *key
+ * @param   size_t len
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise.
+ **/
+int dict_mmap_contains_n(struct dict_mmap *map, const char *key, size_t len)
+{
+    return dict_mmap_get_n(map, key, len, NULL, NULL);
+}
+
+/**
+ * Returns the number of entries in the snapshot.
+ *
+ * @param   struct dict_mmap *map
+ * @return  uint64_t
+ **/
+uint64_t dict_mmap_size(struct dict_mmap *map)
+{
+    return map->header->count;
+}
+
+/**
+ * Start iterating over a snapshot.
+ *
+ * @param   struct dict_mmap *map
+ * @param   struct dict_mmap_iterator *it
+ * @return  void
+ **/
+void dict_mmap_iterate_start(struct dict_mmap *map, struct dict_mmap_iterator *it)
+{
+    it->map = map;
+    it->offset = 0;
+}
+
+/**
+ * Fetches the next entry. Keys are NUL terminated, and like values point
+ * into the mapping.
+ *
+ * @param   struct dict_mmap_iterator *it
+ * @param   const char **key
+ * @param   size_t *key_len
+ * @param   const void **value
+ * @param   size_t *value_len
+ * @return  int
+ *
+ * Returns 1 if an entry was fetched, and 0 once iteration has completed.
+ **/
+int dict_mmap_iterate_next(struct dict_mmap_iterator *it, const char **key, size_t *key_len, const void **value, size_t *value_len)
+{
+    const struct dict_mmap_entry *entry;
+    
+    if (it->offset >= it->map->header->entries_size) {
+        return 0;
+    }
+    
+    it->offset = _entry_at(it->map, it->offset, &entry, value, value_len);
+    *key = (const char *)(entry + 1);
+    *key_len = entry->key_len;
+    
+    return 1;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dict.h"
+
+#define DICT_MMAP_MAGIC "DICTMMAP"
+#define DICT_MMAP_VERSION 1
+
+// Values were saved as the pointer-sized integers stored in the dict,
+// rather than as the bytes they point to.
+#define DICT_MMAP_F_WORD_VALUES 0x01
+
+/*
+ * File layout, in native byte order:
+ *
+ *  - struct dict_mmap_header
+ *  - capacity + 1 bucket offsets (uint64_t). The entries of bucket b lie
+ *    between offsets b and b + 1, counted from the start of the entries.
+ *  - The entries, each a struct dict_mmap_entry followed by the key, a NUL
+ *    byte and the value, with the key and the value each padded to 8 bytes.
+ */
+struct dict_mmap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t hash;
+    uint32_t hash_variant;
+    uint64_t hash_key[2];
+    uint32_t capacity;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t buckets_off;
+    uint64_t entries_off;
+    uint64_t entries_size;
+};
+
+struct dict_mmap_entry {
+    uint32_t hash;
+    uint32_t key_len;
+    uint64_t value_len;
+};
+
+struct dict_mmap {
+    const char *base;
+    size_t size;
+    const struct dict_mmap_header *header;
+    const uint64_t *buckets;
+    const char *entries;
+    uint32_t (*hash_fn)(const uint64_t key[2], const void *buf, size_t size);
+};
+
+struct dict_mmap_iterator {
+    struct dict_mmap *map;
+    uint64_t offset;
+};
+
+int dict_save(struct dict *dict, const char *path, size_t (*value_size_fn)(void *value));
+
+struct dict_mmap *dict_open_mmap(const char *path);
+void dict_mmap_close(struct dict_mmap *map);
+
+int dict_mmap_get(struct dict_mmap *map, const char *key, const void **value, size_t *value_len);
+int dict_mmap_get_n(struct dict_mmap *map, const char *key, size_t len, const void **value, size_t *value_len);
+int dict_mmap_contains(struct dict_mmap *map, const char *key);
+int dict_mmap_contains_n(struct dict_mmap *map, const char *key, size_t len);
+uint64_t dict_mmap_size(struct dict_mmap *map);
+
+void dict_mmap_iterate_start(struct dict_mmap *map, struct dict_mmap_iterator *it);
+int dict_mmap_iterate_next(struct dict_mmap_iterator *it, const char **key, size_t *key_len, const void **value, size_t *value_len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Parallel clone and resize for chained dicts.
+ *
+ * Both build a new bucket array from the entries of a dict, placing each by
+ * its cached hash, so no key is hashed again. With m the smallest of the
+ * source and destination capacities, the entries of every source bucket s
+ * land in destination buckets d with d & (m - 1) == s & (m - 1). Splitting
+ * the residues below m between tasks therefore gives every task its own
+ * source and destination buckets, and the tasks need no locks. Each task
+ * allocates chain nodes from a private pool, and the pools are merged once
+ * all tasks are done.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict.h"
+#include "dict_private.h"
+#include "threadpool.h"
+
+// Upper bound on the number of tasks a rebuild is split into.
+#define REBUILD_MAX_TASKS 256
+
+struct rebuild_job {
+    struct dict *src;
+    struct dict_node *table;
+    uint32_t capacity;
+    uint32_t residues;
+    size_t ntasks;
+    struct pool *pools;
+    void *(*key_clone_fn)(void *);
+    void *(*value_clone_fn)(void *);
+    int failed;
+};
+
+/**
+ * Copies src into its bucket of the new table, cloning its key and value if
+ * the job has clone functions.
+ **/
+static int _place(struct rebuild_job *job, struct pool *pool, struct dict_node *src)
+{
+    struct dict *dict = job->src;
+    struct dict_node *head, *node;
+    
+    head = DICT_NODE_AT(job->table, dict->node_size, src->hash & (job->capacity - 1));
+    
+    if (head->key == NULL) {
+        node = head;
+        dict_node_copy(dict, node, src);
+        node->next = NULL;
+    } else {
+        node = pool_alloc(pool);
+        if (node == NULL) {
+            return 0;
+        }
+        
+        dict_node_copy(dict, node, src);
+        node->next = head->next;
+        head->next = node;
+    }
+    
+    if (job->key_clone_fn != NULL) {
+        node->key = job->key_clone_fn(src->key);
+    }
+    
+    if (job->value_clone_fn != NULL && dict->value_size == 0) {
+        node->value = job->value_clone_fn(src->value);
+    }
+    
+    return 1;
+}
+
+static void _rebuild_task(void *arg, size_t i)
+{
+    struct rebuild_job *job = arg;
+    struct dict *dict = job->src;
+    struct dict_node *tables[2];
+    struct dict_node *cur;
+    uint32_t capacities[2];
+    uint32_t r, start, end, s;
+    int t;
+    
+    tables[0] = dict->table;
+    capacities[0] = dict->capacity;
+    tables[1] = dict->rehash_table;
+    capacities[1] = dict->rehash_table != NULL ? dict->rehash_capacity : 0;
+    
+    start = (uint32_t)((uint64_t)job->residues * i / job->ntasks);
+    end = (uint32_t)((uint64_t)job->residues * (i + 1) / job->ntasks);
+    
+    for (r = start; r < end; r++) {
+        for (t = 0; t < 2; t++) {
+            for (s = r; s < capacities[t]; s += job->residues) {
+                cur = t == 0 ? dict_table_bucket(dict, s) : DICT_NODE_AT(tables[t], dict->node_size, s);
+                if (cur->key == NULL) {
+                    continue;
+                }
+                
+                for (; cur != NULL; cur = cur->next) {
+                    if (!_place(job, &job->pools[i], cur)) {
+                        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+                        return;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Fills table (of capacity buckets, zeroed) with the entries of src, and
+ * merges the chain nodes it needed into pool. src is not modified.
+ *
+ * Returns 1 on success, and 0 on error. On error, table holds the entries
+ * placed so far, and their chain nodes are in pool.
+ **/
+static int _rebuild(struct dict *src, struct dict_node *table, uint32_t capacity, struct pool *pool,
+                    void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *), struct threadpool *threads)
+{
+    struct rebuild_job job;
+    size_t i;
+    
+    job.src = src;
+    job.table = table;
+    job.capacity = capacity;
+    job.residues = capacity < src->capacity ? capacity : src->capacity;
+    job.key_clone_fn = key_clone_fn;
+    job.value_clone_fn = value_clone_fn;
+    job.failed = 0;
+    
+    if (src->rehash_table != NULL && src->rehash_capacity < job.residues) {
+        job.residues = src->rehash_capacity;
+    }
+    
+    job.ntasks = job.residues < REBUILD_MAX_TASKS ? job.residues : REBUILD_MAX_TASKS;
+    job.pools = malloc(job.ntasks * sizeof(*job.pools));
+    if (job.pools == NULL) {
+        return 0;
+    }
+    
+    for (i = 0; i < job.ntasks; i++) {
+        pool_init(&job.pools[i], src->node_size);
+    }
+    
+    threadpool_run(threads, _rebuild_task, &job, job.ntasks);
+    
+    for (i = 0; i < job.ntasks; i++) {
+        pool_merge(pool, &job.pools[i]);
+    }
+    
+    free(job.pools);
+    
+    return !job.failed;
+}
+
+/**
+ * Same as dict_clone(), with the work spread over the threads of pool. The
+ * clone functions are called from several threads at once. Entries are
+ * placed by their cached hash rather than set one by one.
+ *
+ * DICT_ENGINE_PROBED dicts, and dicts that own their keys, are cloned by
+ * dict_clone() on the calling thread.
+ *
+ * @param   struct dict *to_clone
+ * @param   void *(*key_clone_fn)(void *)
+ * @param   void *(*value_clone_fn)(void *)
+ * @param   struct threadpool *pool
+ * @return  struct dict *
+ *
+ * Returns NULL on error.
+ **/
+struct dict *dict_clone_parallel(struct dict *to_clone, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *), struct threadpool *pool)
+{
+    struct dict_opts opts;
+    struct dict *clone;
+    
+    if (to_clone->engine != DICT_ENGINE_CHAINED || (to_clone->flags & DICT_F_OWN_KEYS)) {
+        return dict_clone(to_clone, key_clone_fn, value_clone_fn);
+    }
+    
+    dict_opts_of(to_clone, &opts);
+    
+    clone = dict_new_opts(&opts);
+    if (clone == NULL) {
+        return NULL;
+    }
+    
+    clone->max_load = to_clone->max_load;
+    
+    if (!_rebuild(to_clone, clone->table, clone->capacity, &clone->pool, key_clone_fn, value_clone_fn, pool)) {
+        // Frees the entries cloned so far.
+        dict_delete(clone);
+        return NULL;
+    }
+    
+    clone->used = to_clone->used;
+    clone->bytes = to_clone->bytes;
+    clone->ttls = to_clone->ttls;
+    
+    return clone;
+}
+
+/**
+ * Same as dict_resize(), with the work spread over the threads of pool. An
+ * in-progress incremental rehash is folded into the resize. Entries are
+ * copied into the new bucket array rather than relinked, so the old nodes
+ * and the new ones are briefly both allocated; a failed resize leaves the
+ * dict untouched.
+ *
+ * DICT_ENGINE_PROBED dicts are resized by dict_resize().
+ *
+ * @param   struct dict *dict
+ * @param   uint32_t capacity
+ * @param   struct threadpool *pool
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_resize_parallel(struct dict *dict, uint32_t capacity, struct threadpool *pool)
+{
+    struct dict_node *table;
+    struct pool nodes;
+    
+    capacity = dict_next_capacity(capacity);
+    
+    if (dict->engine != DICT_ENGINE_CHAINED) {
+        return dict_resize(dict, capacity);
+    }
+    
+    if (dict->rehash_table == NULL && capacity == dict->capacity) {
+        return 1;
+    }
+    
+    // Owned keys of entries shared with a snapshot live in the snapshot's
+    // arena, so take copies before the snapshot can be dropped.
+    if (dict->cow_base != NULL && !dict_cow_fault_all(dict)) {
+        return 0;
+    }
+    
+    table = calloc(capacity, dict->node_size);
+    if (table == NULL) {
+        return 0;
+    }
+    
+    pool_init(&nodes, dict->node_size);
+    
+    if (!_rebuild(dict, table, capacity, &nodes, NULL, NULL, pool)) {
+        pool_release(&nodes);
+        free(table);
+        return 0;
+    }
+    
+    pool_release(&dict->pool);
+    dict->pool = nodes;
+    
+    free(dict->table);
+    free(dict->rehash_table);
+    dict->table = table;
+    dict->capacity = capacity;
+    dict->rehash_table = NULL;
+    dict->rehash_capacity = 0;
+    dict->rehash_idx = 0;
+    DICT_COUNT(dict, resizes, 1);
+    
+    return 1;
+}
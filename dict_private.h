@@ -0,0 +1,201 @@
+#pragma once
+
+/*
+ * Helpers shared by the dict engines. Not part of the public API.
+ */
+
+#include <string.h>
+
+#include "config.h"
+#include "dict.h"
+
+// Inline data (such as a short owned key) follows the node itself.
+#define DICT_NODE_DATA(node) ((char *)(node) + sizeof(struct dict_node))
+
+// Compares a node against a key, rejecting on hash and length before
+// touching the key bytes.
+#define NODE_MATCHES(node, h, k, len) \
+    ((node)->hash == (h) && (node)->key_len == (len) && dict_key_equal((node)->key, (k), (len)))
+
+/**
+ * Compares len bytes of two keys. 8 byte keys, such as those of
+ * DICT_F_U64_KEYS dicts, are compared as one word.
+ **/
+static inline int dict_key_equal(const char *a, const char *b, size_t len)
+{
+    uint64_t x;
+    uint64_t y;
+
+    if (len == sizeof(uint64_t)) {
+        memcpy(&x, a, sizeof(x));
+        memcpy(&y, b, sizeof(y));
+        return x == y;
+    }
+
+    return memcmp(a, b, len) == 0;
+}
+
+// Number of keys the batched lookups hash and prefetch ahead.
+#define DICT_BATCH 16
+
+// Bumps an operation counter of dict, when built with DICT_STATS.
+#ifdef DICT_STATS
+#define DICT_COUNT(dict, counter, n) ((dict)->counters.counter += (n))
+#else
+#define DICT_COUNT(dict, counter, n) ((void)0)
+#endif
+
+#if defined(__GNUC__)
+#define DICT_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define DICT_PREFETCH(p) ((void)(p))
+#endif
+
+/**
+ * Round capacity up to the next power of two, so bucket indexes can be taken
+ * with a mask instead of a modulo.
+ **/
+static inline uint32_t dict_next_capacity(uint32_t capacity)
+{
+    uint32_t n = 1;
+
+    while (n < capacity && n < (UINT32_C(1) << 31)) {
+        n <<= 1;
+    }
+
+    return n;
+}
+
+/**
+ * Fills opts with the settings of dict, sized for its current (or, while
+ * rehashing, its new) capacity, so dict_new_opts() creates a compatible
+ * dict that hashes every key the same.
+ **/
+static inline void dict_opts_of(struct dict *dict, struct dict_opts *opts)
+{
+    dict_opts_init(opts);
+    opts->seed = dict->seed;
+    opts->capacity = dict->rehash_table != NULL ? dict->rehash_capacity : dict->capacity;
+    opts->key_free_fn = dict->key_free_fn;
+    opts->value_free_fn = dict->value_free_fn;
+    opts->engine = dict->engine;
+    opts->min_load = dict->min_load > 0.0f ? dict->min_load : -1.0f;
+    opts->hash = dict->hash;
+    opts->hash_key[0] = dict->hash_key[0];
+    opts->hash_key[1] = dict->hash_key[1];
+    opts->flags = dict->flags;
+    opts->key_inline = dict->key_inline;
+    opts->value_size = dict->value_size;
+    opts->max_entries = dict->max_entries;
+    opts->max_bytes = dict->max_bytes;
+    opts->value_bytes_fn = dict->value_bytes_fn;
+    opts->clock_fn = dict->clock_fn;
+}
+
+/**
+ * Copies the entry in src to dst, including its inline data. A key or value
+ * stored inline in src is pointed at its copy in dst.
+ **/
+static inline void dict_node_copy(struct dict *dict, struct dict_node *dst, struct dict_node *src)
+{
+    memcpy(dst, src, dict->node_size);
+
+    if (src->key == DICT_NODE_DATA(src)) {
+        dst->key = DICT_NODE_DATA(dst);
+    }
+
+    if (dict->value_size > 0) {
+        dst->value = (char *)dst + dict->value_offset;
+    }
+}
+
+/**
+ * Stores value in node. With inline values, value points at the bytes to
+ * copy into the node's slot (or is NULL to zero it), and node->value is
+ * pointed at the slot.
+ **/
+static inline void dict_store_value(struct dict *dict, struct dict_node *node, void *value)
+{
+    if (dict->value_size == 0) {
+        node->value = value;
+        return;
+    }
+
+    node->value = (char *)node + dict->value_offset;
+
+    if (value == NULL) {
+        memset(node->value, 0, dict->value_size);
+    } else if (value != node->value) {
+        memmove(node->value, value, dict->value_size);
+    }
+}
+
+// Per-entry state of a cache mode dict, at cache_offset in every node.
+struct dict_cache_entry {
+    uint64_t expires;
+    uint32_t bytes;
+    uint32_t referenced;
+};
+
+#define DICT_CACHE_ENTRY(dict, node) \
+    ((struct dict_cache_entry *)((char *)(node) + (dict)->cache_offset))
+
+// A key or value freed while snapshots may still see it.
+struct dict_garbage {
+    void (*free_fn)(void *);
+    void *ptr;
+};
+
+int dict_rehash_all(struct dict *dict);
+void dict_rehash_step(struct dict *dict, uint32_t n);
+struct dict_node *dict_cow_bucket(struct dict_snapshot *base, uint32_t idx);
+int dict_cow_fault(struct dict *dict, uint32_t idx);
+int dict_cow_fault_all(struct dict *dict);
+void dict_cow_drop(struct dict *dict);
+void dict_defer_free(struct dict *dict, void (*free_fn)(void *), void *ptr);
+void dict_collect_garbage(struct dict *dict);
+void dict_free_entry(struct dict *dict, char *key, void *value);
+void (*dict_value_free_fn(struct dict *dict))(void *);
+void dict_keep_values(struct dict *dict);
+void dict_shrink_if_needed(struct dict *dict);
+
+uint64_t dict_cache_clock(void);
+void dict_cache_store(struct dict *dict, struct dict_node *node, uint64_t expires, int replaced);
+void dict_cache_maintain(struct dict *dict);
+
+/**
+ * Marks a cache entry that was just looked up as recently used. The bit is
+ * only written when it is clear, and never while dict shares memory with a
+ * snapshot, which must not be written.
+ *
+ * Returns 0 if the entry has expired, and 1 otherwise.
+ **/
+static inline int dict_cache_touch(struct dict *dict, struct dict_node *node)
+{
+    struct dict_cache_entry *entry = DICT_CACHE_ENTRY(dict, node);
+
+    if (entry->expires != 0 && dict->clock_fn() >= entry->expires) {
+        return 0;
+    }
+
+    if (!entry->referenced && dict->cow_base == NULL) {
+        entry->referenced = 1;
+    }
+
+    return 1;
+}
+
+/**
+ * Returns bucket idx of dict->table for reading. Segments a copy-on-write
+ * dict hasn't copied from its snapshot yet are read from the snapshot.
+ **/
+static inline struct dict_node *dict_table_bucket(struct dict *dict, uint32_t idx)
+{
+    uint32_t seg = idx / DICT_COW_SEGMENT;
+
+    if (dict->cow_base != NULL && !((dict->cow_present[seg / 64] >> (seg % 64)) & 1)) {
+        return dict_cow_bucket(dict->cow_base, idx);
+    }
+
+    return DICT_NODE_AT(dict->table, dict->node_size, idx);
+}
@@ -0,0 +1,491 @@
+/*
+ * Sharded dict.
+ *
+ * Keys are spread over independent struct dict shards by the high bits of
+ * their hash, leaving the low bits to pick buckets within the shard. Each
+ * shard has its own lock and grows on its own, so a resize stalls only the
+ * keys of one shard. Every shard uses the same hash policy and seed, so a key
+ * is hashed once and handed to the shard with the _hashed functions.
+ *
+ * Whole-dict operations (clear, clone, iteration and set operations) process
+ * the shards in parallel on a thread pool.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict_sharded.h"
+#include "hash.h"
+
+static struct dict_shard *_shard(struct dict_sharded *dict, uint32_t hash)
+{
+    return &dict->shards[dict->nshards > 1 ? hash >> dict->shard_shift : 0];
+}
+
+/**
+ * Allocates the shards and the thread pool, but not the shard dicts.
+ **/
+static struct dict_sharded *_sharded_alloc(uint32_t nshards, unsigned nthreads)
+{
+    struct dict_sharded *dict;
+    uint32_t i;
+    
+    dict = calloc(1, sizeof(*dict));
+    if (dict == NULL) {
+        return NULL;
+    }
+    
+    dict->shards = calloc(nshards, sizeof(*dict->shards));
+    dict->pool = threadpool_new(nthreads);
+    
+    if (dict->shards == NULL || dict->pool == NULL) {
+        if (dict->pool != NULL) {
+            threadpool_delete(dict->pool);
+        }
+        
+        free(dict->shards);
+        free(dict);
+        return NULL;
+    }
+    
+    dict->nshards = nshards;
+    dict->nthreads = nthreads;
+    dict->shard_shift = 32;
+    
+    for (i = nshards; i > 1; i >>= 1) {
+        dict->shard_shift--;
+    }
+    
+    for (i = 0; i < nshards; i++) {
+        pthread_mutex_init(&dict->shards[i].lock, NULL);
+    }
+    
+    return dict;
+}
+
+/**
+ * Create new sharded dict. The shards are created from opts, each with
+ * capacity opts->capacity / nshards.
+ *
+ * @param   const struct dict_opts *opts
+ * @param   uint32_t nshards     Power of two
+ * @param   unsigned nthreads    Workers for whole-dict operations, which
+ *                               also run on the calling thread
+ * @return  struct dict_sharded *
+ *
+ * Returns the new dict, or NULL on error.
+ **/
+struct dict_sharded *dict_sharded_new(const struct dict_opts *opts, uint32_t nshards, unsigned nthreads)
+{
+    struct dict_sharded *dict;
+    struct dict_opts shard_opts;
+    uint32_t i;
+    
+    if (nshards == 0 || (nshards & (nshards - 1)) != 0) {
+        return NULL;
+    }
+    
+    dict = _sharded_alloc(nshards, nthreads);
+    if (dict == NULL) {
+        return NULL;
+    }
+    
+    shard_opts = *opts;
+    shard_opts.capacity = opts->capacity / nshards;
+    
+    for (i = 0; i < nshards; i++) {
+        dict->shards[i].dict = dict_new_opts(&shard_opts);
+        if (dict->shards[i].dict == NULL) {
+            dict_sharded_delete(dict);
+            return NULL;
+        }
+    }
+    
+    dict->hash = dict->shards[0].dict->hash;
+    dict->hash_key[0] = dict->shards[0].dict->hash_key[0];
+    dict->hash_key[1] = dict->shards[0].dict->hash_key[1];
+    dict->hash_fn = dict->shards[0].dict->hash_fn;
+    
+    return dict;
+}
+
+struct clone_job {
+    struct dict_sharded *from;
+    struct dict_sharded *to;
+    void *(*key_clone_fn)(void *);
+    void *(*value_clone_fn)(void *);
+};
+
+static void _clone_shard(void *arg, size_t i)
+{
+    struct clone_job *job = arg;
+    struct dict_shard *shard = &job->from->shards[i];
+    
+    pthread_mutex_lock(&shard->lock);
+    job->to->shards[i].dict = dict_clone(shard->dict, job->key_clone_fn, job->value_clone_fn);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Clone dict, one shard per task. Same as dict_clone(), for each shard.
+ *
+ * @param   struct dict_sharded *to_clone
+ * @param   void *(*key_clone_fn)(void *)
+ * @param   void *(*value_clone_fn)(void *)
+ * @return  struct dict_sharded *
+ *
+ * Returns the new dict, or NULL on error.
+ **/
+struct dict_sharded *dict_sharded_clone(struct dict_sharded *to_clone, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *))
+{
+    struct dict_sharded *dict;
+    struct clone_job job;
+    uint32_t i;
+    
+    dict = _sharded_alloc(to_clone->nshards, to_clone->nthreads);
+    if (dict == NULL) {
+        return NULL;
+    }
+    
+    job.from = to_clone;
+    job.to = dict;
+    job.key_clone_fn = key_clone_fn;
+    job.value_clone_fn = value_clone_fn;
+    threadpool_run(to_clone->pool, _clone_shard, &job, to_clone->nshards);
+    
+    for (i = 0; i < dict->nshards; i++) {
+        if (dict->shards[i].dict == NULL) {
+            dict_sharded_delete(dict);
+            return NULL;
+        }
+    }
+    
+    dict->hash = to_clone->hash;
+    dict->hash_key[0] = to_clone->hash_key[0];
+    dict->hash_key[1] = to_clone->hash_key[1];
+    dict->hash_fn = to_clone->hash_fn;
+    
+    return dict;
+}
+
+static void _clear_shard(void *arg, size_t i)
+{
+    struct dict_shard *shard = &((struct dict_sharded *)arg)->shards[i];
+    
+    pthread_mutex_lock(&shard->lock);
+    dict_clear(shard->dict);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Clear dict, one shard per task.
+ *
+ * @param   struct dict_sharded *dict
+ * @return  void
+ **/
+void dict_sharded_clear(struct dict_sharded *dict)
+{
+    threadpool_run(dict->pool, _clear_shard, dict, dict->nshards);
+}
+
+static void _delete_shard(void *arg, size_t i)
+{
+    struct dict_shard *shard = &((struct dict_sharded *)arg)->shards[i];
+    
+    if (shard->dict != NULL) {
+        dict_delete(shard->dict);
+    }
+    
+    pthread_mutex_destroy(&shard->lock);
+}
+
+/**
+ * Delete dict, one shard per task. No other thread may be using it.
+ *
+ * @param   struct dict_sharded *dict
+ * @return  void
+ **/
+void dict_sharded_delete(struct dict_sharded *dict)
+{
+    threadpool_run(dict->pool, _delete_shard, dict, dict->nshards);
+    threadpool_delete(dict->pool);
+    free(dict->shards);
+    free(dict);
+}
+
+/**
+ * Returns the number of entries, summed over the shards one at a time.
+ *
+ * @param   struct dict_sharded *dict
+ * @return  size_t
+ **/
+size_t dict_sharded_size(struct dict_sharded *dict)
+{
+    size_t used = 0;
+    uint32_t i;
+    
+    for (i = 0; i < dict->nshards; i++) {
+        pthread_mutex_lock(&dict->shards[i].lock);
+        used += dict->shards[i].dict->used;
+        pthread_mutex_unlock(&dict->shards[i].lock);
+    }
+    
+    return used;
+}
+
+/**
+ * Set key to value in its shard. Same as dict_set().
+ *
+ * @param   struct dict_sharded *dict
+ * @param   char *key
+ * @param   void *value
+ * @return  int
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_sharded_set(struct dict_sharded *dict, char *key, void *value)
+{
+    struct dict_shard *shard;
+    size_t len = strlen(key);
+    uint32_t hash;
+    int ret;
+    
+    hash = dict->hash_fn(dict->hash_key, key, len);
+    shard = _shard(dict, hash);
+    
+    pthread_mutex_lock(&shard->lock);
+    ret = dict_set_hashed(shard->dict, key, len, hash, value);
+    pthread_mutex_unlock(&shard->lock);
+    
+    return ret;
+}
+
+/**
+ * Get the value of key. Nodes aren't returned, since another thread may
+ * free them as soon as the shard is unlocked.
+ *
+ * @param   struct dict_sharded *dict
+ * @param   char *key
+ * @param   void **value    Set to the value if key is found
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise.
+ **/
+int dict_sharded_get(struct dict_sharded *dict, char *key, void **value)
+{
+    struct dict_shard *shard;
+    struct dict_node *node;
+    size_t len = strlen(key);
+    uint32_t hash;
+    
+    hash = dict->hash_fn(dict->hash_key, key, len);
+    shard = _shard(dict, hash);
+    
+    pthread_mutex_lock(&shard->lock);
+    node = dict_get_hashed(shard->dict, key, len, hash);
+    if (node != NULL) {
+        *value = node->value;
+    }
+    
+    pthread_mutex_unlock(&shard->lock);
+    
+    return node != NULL;
+}
+
+/**
+ * Delete key from its shard. Same as dict_del().
+ *
+ * @param   struct dict_sharded *dict
+ * @param   char *key
+ * @return  int
+ *
+ * Returns 1 if the key was deleted, and 0 if it was not found.
+ **/
+int dict_sharded_del(struct dict_sharded *dict, char *key)
+{
+    struct dict_shard *shard;
+    size_t len = strlen(key);
+    uint32_t hash;
+    int ret;
+    
+    hash = dict->hash_fn(dict->hash_key, key, len);
+    shard = _shard(dict, hash);
+    
+    pthread_mutex_lock(&shard->lock);
+    ret = dict_del_hashed(shard->dict, key, len, hash);
+    pthread_mutex_unlock(&shard->lock);
+    
+    return ret;
+}
+
+/**
+ * Check if dict contains key.
+ *
+ * @param   struct dict_sharded *dict
+ * @param   char *key
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise.
+ **/
+int dict_sharded_contains(struct dict_sharded *dict, char *key)
+{
+    struct dict_shard *shard;
+    size_t len = strlen(key);
+    uint32_t hash;
+    int ret;
+    
+    hash = dict->hash_fn(dict->hash_key, key, len);
+    shard = _shard(dict, hash);
+    
+    pthread_mutex_lock(&shard->lock);
+    ret = dict_contains_hashed(shard->dict, key, len, hash);
+    pthread_mutex_unlock(&shard->lock);
+    
+    return ret;
+}
+
+struct foreach_job {
+    struct dict_sharded *a;
+    struct dict_sharded *b;
+    struct dict_node *(*next)(struct dict *b, struct dict_iterator *it);
+    void (*fn)(struct dict_node *node, void *arg);
+    void *arg;
+};
+
+static struct dict_node *_iterate_next(struct dict *b, struct dict_iterator *it)
+{
+    return dict_iterate_next(it);
+}
+
+/**
+ * Runs the iterator of job over shard i of a, and the same shard of b, with
+ * both locked. The shards are locked in address order, so two jobs over the
+ * same pair of dicts in opposite roles can't deadlock.
+ **/
+static void _foreach_shard(void *arg, size_t i)
+{
+    struct foreach_job *job = arg;
+    struct dict_shard *first = &job->a->shards[i];
+    struct dict_shard *second = job->b != NULL ? &job->b->shards[i] : first;
+    struct dict_shard *tmp;
+    struct dict_iterator it;
+    struct dict_node *node;
+    
+    if (second < first) {
+        tmp = first;
+        first = second;
+        second = tmp;
+    }
+    
+    pthread_mutex_lock(&first->lock);
+    if (second != first) {
+        pthread_mutex_lock(&second->lock);
+    }
+    
+    dict_iterate_start(job->a->shards[i].dict, &it);
+    while ((node = job->next(job->b != NULL ? job->b->shards[i].dict : NULL, &it)) != NULL) {
+        job->fn(node, job->arg);
+    }
+    
+    if (second != first) {
+        pthread_mutex_unlock(&second->lock);
+    }
+    
+    pthread_mutex_unlock(&first->lock);
+}
+
+/**
+ * Calls fn for every entry, with shards processed in parallel. fn may run on
+ * several threads at once, and must not modify the dict.
+ *
+ * @param   struct dict_sharded *dict
+ * @param   void (*fn)(struct dict_node *node, void *arg)
+ * @param   void *arg
+ * @return  void
+ **/
+void dict_sharded_foreach(struct dict_sharded *dict, void (*fn)(struct dict_node *node, void *arg), void *arg)
+{
+    struct foreach_job job;
+    
+    job.a = dict;
+    job.b = NULL;
+    job.next = _iterate_next;
+    job.fn = fn;
+    job.arg = arg;
+    
+    threadpool_run(dict->pool, _foreach_shard, &job, dict->nshards);
+}
+
+/**
+ * Both dicts must put every key in the same shard, so that shard i of a is
+ * only ever compared against shard i of b.
+ **/
+static int _compatible(struct dict_sharded *a, struct dict_sharded *b)
+{
+    return a->nshards == b->nshards && a->hash == b->hash &&
+        a->hash_key[0] == b->hash_key[0] && a->hash_key[1] == b->hash_key[1];
+}
+
+/**
+ * Calls fn for every entry of a whose key is not in b, with shards processed
+ * in parallel. fn may run on several threads at once.
+ *
+ * @param   struct dict_sharded *a
+ * @param   struct dict_sharded *b
+ * @param   void (*fn)(struct dict_node *node, void *arg)
+ * @param   void *arg
+ * @return  int
+ *
+ * Returns 1 on success, and 0 if a and b differ in shard count or hash
+ * policy.
+ **/
+int dict_sharded_difference(struct dict_sharded *a, struct dict_sharded *b, void (*fn)(struct dict_node *node, void *arg), void *arg)
+{
+    struct foreach_job job;
+    
+    if (!_compatible(a, b)) {
+        return 0;
+    }
+    
+    job.a = a;
+    job.b = b;
+    job.next = dict_iterate_difference;
+    job.fn = fn;
+    job.arg = arg;
+    
+    threadpool_run(a->pool, _foreach_shard, &job, a->nshards);
+    
+    return 1;
+}
+
+/**
+ * Calls fn for every entry of a whose key is also in b, with shards
+ * processed in parallel. fn may run on several threads at once.
+ *
+ * @param   struct dict_sharded *a
+ * @param   struct dict_sharded *b
+ * @param   void (*fn)(struct dict_node *node, void *arg)
+ * @param   void *arg
+ * @return  int
+ *
+ * Returns 1 on success, and 0 if a and b differ in shard count or hash
+ * policy.
+ **/
+int dict_sharded_intersection(struct dict_sharded *a, struct dict_sharded *b, void (*fn)(struct dict_node *node, void *arg), void *arg)
+{
+    struct foreach_job job;
+    
+    if (!_compatible(a, b)) {
+        return 0;
+    }
+    
+    job.a = a;
+    job.b = b;
+    job.next = dict_iterate_intersection;
+    job.fn = fn;
+    job.arg = arg;
+    
+    threadpool_run(a->pool, _foreach_shard, &job, a->nshards);
+    
+    return 1;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "dict.h"
+#include "threadpool.h"
+
+// Each shard gets its own cache line, so threads working on different
+// shards don't contend for their locks.
+struct dict_shard {
+    pthread_mutex_t lock;
+    struct dict *dict;
+    char pad[64 - (sizeof(pthread_mutex_t) + sizeof(struct dict *)) % 64];
+};
+
+struct dict_sharded {
+    struct dict_shard *shards;
+    uint32_t nshards;
+    uint32_t shard_shift;
+    unsigned nthreads;
+    struct threadpool *pool;
+    
+    int hash;
+    uint64_t hash_key[2];
+    uint32_t (*hash_fn)(const uint64_t key[2], const void *buf, size_t size);
+};
+
+struct dict_sharded *dict_sharded_new(const struct dict_opts *opts, uint32_t nshards, unsigned nthreads);
+struct dict_sharded *dict_sharded_clone(struct dict_sharded *to_clone, void *(*key_clone_fn)(void *), void *(*value_clone_fn)(void *));
+void dict_sharded_clear(struct dict_sharded *dict);
+void dict_sharded_delete(struct dict_sharded *dict);
+size_t dict_sharded_size(struct dict_sharded *dict);
+
+int dict_sharded_set(struct dict_sharded *dict, char *key, void *value);
+int dict_sharded_get(struct dict_sharded *dict, char *key, void **value);
+int dict_sharded_del(struct dict_sharded *dict, char *key);
+int dict_sharded_contains(struct dict_sharded *dict, char *key);
+
+void dict_sharded_foreach(struct dict_sharded *dict, void (*fn)(struct dict_node *node, void *arg), void *arg);
+int dict_sharded_difference(struct dict_sharded *a, struct dict_sharded *b, void (*fn)(struct dict_node *node, void *arg), void *arg);
+int dict_sharded_intersection(struct dict_sharded *a, struct dict_sharded *b, void (*fn)(struct dict_node *node, void *arg), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
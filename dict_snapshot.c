@@ -0,0 +1,434 @@
+/*
+ * Copy-on-write snapshots of chained dicts.
+ *
+ * dict_snapshot() hands the dict's bucket array, together with the pool and
+ * arena holding its chain nodes and owned keys, to the snapshot, and gives
+ * the dict an empty bucket array of the same size. Both are split into
+ * segments of DICT_COW_SEGMENT buckets. The dict reads segments it doesn't
+ * have from the snapshot, and copies one in the first time it modifies it,
+ * so the snapshot's memory is never written again and can be read from any
+ * thread.
+ *
+ * Snapshots taken before the dict copied in every segment inherit its
+ * missing segments, and read them from the older snapshot in turn. Keys and
+ * values are shared between the dict and its snapshots, so the dict holds
+ * back freeing them until every snapshot has been released.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict_snapshot.h"
+#include "dict_private.h"
+
+static inline int _has_segment(const uint64_t *present, uint32_t seg)
+{
+    return (present[seg / 64] >> (seg % 64)) & 1;
+}
+
+/**
+ * Returns the snapshot, of snapshot and the ones it inherits from, that
+ * holds segment seg.
+ **/
+static struct dict_snapshot *_layer(struct dict_snapshot *snapshot, uint32_t seg)
+{
+    while (snapshot->present != NULL && !_has_segment(snapshot->present, seg)) {
+        snapshot = snapshot->base;
+    }
+    
+    return snapshot;
+}
+
+static void _unref(struct dict_snapshot *snapshot)
+{
+    struct dict_snapshot *base;
+    
+    while (snapshot != NULL && __atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        base = snapshot->base;
+        
+        free(snapshot->table);
+        free(snapshot->present);
+        pool_release(&snapshot->pool);
+        arena_release(&snapshot->arena);
+        free(snapshot);
+        
+        snapshot = base;
+    }
+}
+
+/**
+ * Returns bucket idx of a snapshot.
+ **/
+struct dict_node *dict_cow_bucket(struct dict_snapshot *base, uint32_t idx)
+{
+    base = _layer(base, idx / DICT_COW_SEGMENT);
+    
+    return DICT_NODE_AT(base->table, base->node_size, idx);
+}
+
+/**
+ * Copies the entry in src to dst, which belongs to dict. Owned keys that
+ * aren't inline live in the snapshot's arena, and are copied as well.
+ **/
+static int _copy_node(struct dict *dict, struct dict_node *dst, struct dict_node *src)
+{
+    dict_node_copy(dict, dst, src);
+    dst->next = NULL;
+    
+    if ((dict->flags & DICT_F_OWN_KEYS) && src->key != DICT_NODE_DATA(src)) {
+        dst->key = arena_alloc(&dict->arena, (size_t)src->key_len + 1);
+        if (dst->key == NULL) {
+            return 0;
+        }
+        
+        memcpy(dst->key, src->key, (size_t)src->key_len + 1);
+    }
+    
+    return 1;
+}
+
+/**
+ * Empties buckets start up to end of dict->table, after a failed copy.
+ **/
+static void _unfault(struct dict *dict, uint32_t start, uint32_t end)
+{
+    struct dict_node *head, *cur, *next;
+    uint32_t b;
+    
+    for (b = start; b < end; b++) {
+        head = DICT_NODE_AT(dict->table, dict->node_size, b);
+        
+        for (cur = head->next; cur != NULL; cur = next) {
+            next = cur->next;
+            pool_free(&dict->pool, cur);
+        }
+        
+        memset(head, 0, dict->node_size);
+    }
+}
+
+/**
+ * Makes the segment of dict->table holding bucket idx the dict's own,
+ * copying it from the snapshot it is shared with. Once every segment has
+ * been copied, the dict lets go of the snapshot.
+ *
+ * Returns 1 on success, and 0 on error (with the segment still shared).
+ **/
+int dict_cow_fault(struct dict *dict, uint32_t idx)
+{
+    struct dict_snapshot *layer;
+    struct dict_node *src, *cur, *dst, *tail, *node;
+    uint32_t seg = idx / DICT_COW_SEGMENT;
+    uint32_t b, start, end;
+    
+    if (_has_segment(dict->cow_present, seg)) {
+        return 1;
+    }
+    
+    layer = _layer(dict->cow_base, seg);
+    start = seg * DICT_COW_SEGMENT;
+    end = dict->capacity - start < DICT_COW_SEGMENT ? dict->capacity : start + DICT_COW_SEGMENT;
+    
+    for (b = start; b < end; b++) {
+        src = DICT_NODE_AT(layer->table, dict->node_size, b);
+        if (src->key == NULL) {
+            continue;
+        }
+        
+        dst = DICT_NODE_AT(dict->table, dict->node_size, b);
+        if (!_copy_node(dict, dst, src)) {
+            _unfault(dict, start, b + 1);
+            return 0;
+        }
+        
+        tail = dst;
+        for (cur = src->next; cur != NULL; cur = cur->next) {
+            node = pool_alloc(&dict->pool);
+            if (node == NULL || !_copy_node(dict, node, cur)) {
+                if (node != NULL) {
+                    pool_free(&dict->pool, node);
+                }
+                
+                _unfault(dict, start, b + 1);
+                return 0;
+            }
+            
+            tail->next = node;
+            tail = node;
+        }
+    }
+    
+    dict->cow_present[seg / 64] |= UINT64_C(1) << (seg % 64);
+    
+    if (--dict->cow_missing == 0) {
+        dict_cow_drop(dict);
+    }
+    
+    return 1;
+}
+
+/**
+ * Copies every segment dict still shares with a snapshot.
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int dict_cow_fault_all(struct dict *dict)
+{
+    uint32_t idx;
+    
+    for (idx = 0; dict->cow_base != NULL && idx < dict->capacity; idx += DICT_COW_SEGMENT) {
+        if (!dict_cow_fault(dict, idx)) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/**
+ * Lets go of the snapshot dict shares segments with, for when the shared
+ * segments are no longer needed.
+ **/
+void dict_cow_drop(struct dict *dict)
+{
+    _unref(dict->cow_base);
+    free(dict->cow_present);
+    dict->cow_base = NULL;
+    dict->cow_present = NULL;
+    dict->cow_missing = 0;
+}
+
+/**
+ * Queues ptr to be freed with free_fn once no snapshot is left. If the
+ * queue can't grow, ptr is leaked rather than freed under a snapshot.
+ **/
+void dict_defer_free(struct dict *dict, void (*free_fn)(void *), void *ptr)
+{
+    struct dict_garbage *garbage;
+    size_t cap;
+    
+    if (dict->garbage_len == dict->garbage_cap) {
+        cap = dict->garbage_cap > 0 ? dict->garbage_cap * 2 : 64;
+        garbage = realloc(dict->garbage, cap * sizeof(*garbage));
+        if (garbage == NULL) {
+            return;
+        }
+        
+        dict->garbage = garbage;
+        dict->garbage_cap = cap;
+    }
+    
+    dict->garbage[dict->garbage_len].free_fn = free_fn;
+    dict->garbage[dict->garbage_len].ptr = ptr;
+    dict->garbage_len++;
+}
+
+/**
+ * Frees the keys and values queued by dict_defer_free().
+ **/
+void dict_collect_garbage(struct dict *dict)
+{
+    size_t i;
+    
+    for (i = 0; i < dict->garbage_len; i++) {
+        dict->garbage[i].free_fn(dict->garbage[i].ptr);
+    }
+    
+    dict->garbage_len = 0;
+}
+
+/**
+ * Takes a read-only snapshot of dict, in constant time. dict keeps working
+ * as usual, and copies each segment of DICT_COW_SEGMENT buckets the first
+ * time it modifies it, so a snapshot costs memory in proportion to what
+ * changes while it is held. An in-progress incremental rehash is completed
+ * first, and growing the dict later copies every segment as it goes.
+ *
+ * Snapshots can be read and released from any thread, while dict is being
+ * modified. Keys and values replaced or deleted from dict are freed once
+ * every snapshot has been released, on a later modification of dict.
+ * Nodes returned by dict_get() and the iterators may be shared with a
+ * snapshot, so change values with dict_set() rather than through them.
+ *
+ * DICT_ENGINE_PROBED dicts can't be snapshotted.
+ *
+ * @param   struct dict *dict
+ * @return  struct dict_snapshot *
+ *
+ * Returns NULL on error.
+ **/
+struct dict_snapshot *dict_snapshot(struct dict *dict)
+{
+    struct dict_snapshot *snapshot;
+    struct dict_node *table;
+    uint64_t *present;
+    uint32_t nsegs;
+    
+    if (dict->engine != DICT_ENGINE_CHAINED || !dict_rehash_all(dict)) {
+        return NULL;
+    }
+    
+    nsegs = (dict->capacity + DICT_COW_SEGMENT - 1) / DICT_COW_SEGMENT;
+    
+    snapshot = malloc(sizeof(*snapshot));
+    table = calloc(dict->capacity, dict->node_size);
+    present = calloc(nsegs / 64 + 1, sizeof(*present));
+    if (snapshot == NULL || table == NULL || present == NULL) {
+        free(snapshot);
+        free(table);
+        free(present);
+        return NULL;
+    }
+    
+    // One reference for the caller, and one for dict.
+    snapshot->dict = dict;
+    snapshot->refs = 2;
+    snapshot->table = dict->table;
+    snapshot->capacity = dict->capacity;
+    snapshot->node_size = dict->node_size;
+    snapshot->present = dict->cow_present;
+    snapshot->base = dict->cow_base;
+    snapshot->pool = dict->pool;
+    snapshot->arena = dict->arena;
+    snapshot->used = dict->used;
+    snapshot->hash_key[0] = dict->hash_key[0];
+    snapshot->hash_key[1] = dict->hash_key[1];
+    snapshot->hash_fn = dict->hash_fn;
+    
+    dict->table = table;
+    pool_init(&dict->pool, dict->node_size);
+    arena_init(&dict->arena);
+    dict->cow_base = snapshot;
+    dict->cow_present = present;
+    dict->cow_missing = nsegs;
+    
+    __atomic_add_fetch(&dict->snapshots, 1, __ATOMIC_RELAXED);
+    
+    return snapshot;
+}
+
+/**
+ * Releases a snapshot. Must be called before the dict is deleted.
+ *
+ * @param   struct dict_snapshot *snapshot
+ * @return  void
+ **/
+void dict_snapshot_release(struct dict_snapshot *snapshot)
+{
+    __atomic_sub_fetch(&snapshot->dict->snapshots, 1, __ATOMIC_RELEASE);
+    _unref(snapshot);
+}
+
+/**
+ * Returns the number of entries in a snapshot.
+ *
+ * @param   struct dict_snapshot *snapshot
+ * @return  size_t
+ **/
+size_t dict_snapshot_size(struct dict_snapshot *snapshot)
+{
+    return snapshot->used;
+}
+
+/**
+ * Get an item from a snapshot. The node must not be modified.
+ *
+ * @param   struct dict_snapshot *snapshot
+ * @param   char *key
+ * @param   size_t len
+ * @return  struct dict_node *
+ *
+ * Returns a pointer to struct dict_node *, or NULL if key wasn't found.
+ **/
+struct dict_node *dict_snapshot_get_n(struct dict_snapshot *snapshot, char *key, size_t len)
+{
+    struct dict_node *cur;
+    uint32_t hash;
+    
+    hash = snapshot->hash_fn(snapshot->hash_key, key, len);
+    cur = dict_cow_bucket(snapshot, hash & (snapshot->capacity - 1));
+    
+    if (cur->key == NULL) {
+        return NULL;
+    }
+    
+    for (; cur != NULL; cur = cur->next) {
+        if (NODE_MATCHES(cur, hash, key, len)) {
+            return cur;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * Get an item from a snapshot. The node must not be modified.
+ *
+ * @param   struct dict_snapshot *snapshot
+ * @param   char *key
+ * @return  struct dict_node *
+ *
+ * Returns a pointer to struct dict_node *, or NULL if key wasn't found.
+ **/
+struct dict_node *dict_snapshot_get(struct dict_snapshot *snapshot, char *key)
+{
+    return dict_snapshot_get_n(snapshot, key, strlen(key));
+}
+
+/**
+ * Check if a snapshot contains key.
+ *
+ * @param   struct dict_snapshot *snapshot
+ * @param   char *key
+ * @return  int
+ *
+ * Returns 1 if key was found, and 0 otherwise.
+ **/
+int dict_snapshot_contains(struct dict_snapshot *snapshot, char *key)
+{
+    return dict_snapshot_get_n(snapshot, key, strlen(key)) != NULL;
+}
+
+/**
+ * Start iterating over a snapshot.
+ *
+ * @param   struct dict_snapshot *snapshot
+ * @param   struct dict_snapshot_iterator *it
+ * @return  void
+ **/
+void dict_snapshot_iterate_start(struct dict_snapshot *snapshot, struct dict_snapshot_iterator *it)
+{
+    it->snapshot = snapshot;
+    it->cur = NULL;
+    it->idx = 0;
+}
+
+/**
+ * Iterate to next item in a snapshot.
+ *
+ * @param   struct dict_snapshot_iterator *it
+ * @return  struct dict_node *
+ *
+ * Returns a pointer to struct dict_node *, or NULL if iteration has
+ * completed.
+ **/
+struct dict_node *dict_snapshot_iterate_next(struct dict_snapshot_iterator *it)
+{
+    struct dict_node *prev;
+    
+    if (it->cur != NULL) {
+        prev = it->cur;
+        it->cur = prev->next;
+        return prev;
+    }
+    
+    while (it->idx < it->snapshot->capacity) {
+        prev = dict_cow_bucket(it->snapshot, it->idx++);
+        if (prev->key != NULL) {
+            it->cur = prev->next;
+            return prev;
+        }
+    }
+    
+    return NULL;
+}
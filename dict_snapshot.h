@@ -0,0 +1,53 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dict.h"
+
+// A read-only view of a dict, as it was when the snapshot was taken.
+//
+// Segments of table whose bit in present is clear were never filled in,
+// and are found in base instead. present is NULL once table is complete.
+struct dict_snapshot {
+    struct dict *dict;
+    unsigned refs;
+    
+    struct dict_node *table;
+    uint32_t capacity;
+    uint32_t node_size;
+    uint64_t *present;
+    struct dict_snapshot *base;
+    
+    // The chain nodes and owned keys of table.
+    struct pool pool;
+    struct arena arena;
+    
+    size_t used;
+    uint64_t hash_key[2];
+    uint32_t (*hash_fn)(const uint64_t key[2], const void *buf, size_t size);
+};
+
+struct dict_snapshot_iterator {
+    struct dict_snapshot *snapshot;
+    struct dict_node *cur;
+    uint32_t idx;
+};
+
+struct dict_snapshot *dict_snapshot(struct dict *dict);
+void dict_snapshot_release(struct dict_snapshot *snapshot);
+size_t dict_snapshot_size(struct dict_snapshot *snapshot);
+
+struct dict_node *dict_snapshot_get(struct dict_snapshot *snapshot, char *key);
+struct dict_node *dict_snapshot_get_n(struct dict_snapshot *snapshot, char *key, size_t len);
+int dict_snapshot_contains(struct dict_snapshot *snapshot, char *key);
+
+void dict_snapshot_iterate_start(struct dict_snapshot *snapshot, struct dict_snapshot_iterator *it);
+struct dict_node *dict_snapshot_iterate_next(struct dict_snapshot_iterator *it);
+
+#ifdef __cplusplus
+}
+#endif
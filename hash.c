@@ -0,0 +1,186 @@
+/*
+ * Hash policies for struct dict.
+ *
+ * Every policy hashes with a 128-bit key, and reduces its result to the
+ * 32-bit hash stored in struct dict_node.
+ *
+ *  - DICT_HASH_CRC32: crc32() seeded with key[0]. Fast, but linear, so keys
+ *    that collide can be crafted for any seed.
+ *  - DICT_HASH_FAST64: a 64-bit multiply/rotate hash seeded with key[0], with
+ *    a MurmurHash3 finalizer. Fast, for trusted data.
+ *  - DICT_HASH_SIPHASH: SipHash-2-4 keyed with key[0..1]. Collisions can't be
+ *    crafted without knowing the key, so use it for untrusted input.
+ *  - DICT_HASH_U64: for 8 byte integer keys, the key xored with key[0] and
+ *    run through the MurmurHash3 finalizer. Other sizes fall back to
+ *    DICT_HASH_FAST64.
+ */
+
+#include <string.h>
+
+#include "crc32.h"
+#include "dict.h"
+#include "hash.h"
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+static uint64_t _load64(const uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+        (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+/**
+ * Loads the last size (< 8) bytes of the input into a word.
+ **/
+static uint64_t _load_tail(const uint8_t *p, size_t size)
+{
+    uint64_t v = 0;
+    
+    while (size--) {
+        v |= (uint64_t)p[size] << (size * 8);
+    }
+    
+    return v;
+}
+
+/**
+ * Fast non-cryptographic 64-bit hash.
+ **/
+uint64_t fast64(uint64_t seed, const void *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    uint64_t h = seed ^ ((uint64_t)size * UINT64_C(0x9e3779b97f4a7c15));
+    uint64_t k;
+    
+    while (size >= 8) {
+        k = _load64(p);
+        k *= UINT64_C(0x87c37b91114253d5);
+        k = ROTL64(k, 31);
+        k *= UINT64_C(0x4cf5ad432745937f);
+        
+        h ^= k;
+        h = ROTL64(h, 27) * 5 + 0x52dce729;
+        
+        p += 8;
+        size -= 8;
+    }
+    
+    if (size > 0) {
+        k = _load_tail(p, size);
+        k *= UINT64_C(0x87c37b91114253d5);
+        k = ROTL64(k, 31);
+        k *= UINT64_C(0x4cf5ad432745937f);
+        h ^= k;
+    }
+    
+    return hash_fmix64(h);
+}
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while (0)
+
+/**
+ * SipHash-2-4, keyed with key[0] (first 8 key bytes) and key[1].
+ **/
+uint64_t siphash24(const uint64_t key[2], const void *buf, size_t size)
+{
+    const uint8_t *p = buf;
+    uint64_t v0 = key[0] ^ UINT64_C(0x736f6d6570736575);
+    uint64_t v1 = key[1] ^ UINT64_C(0x646f72616e646f6d);
+    uint64_t v2 = key[0] ^ UINT64_C(0x6c7967656e657261);
+    uint64_t v3 = key[1] ^ UINT64_C(0x7465646279746573);
+    uint64_t m;
+    uint64_t b = (uint64_t)size << 56;
+    
+    while (size >= 8) {
+        m = _load64(p);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+        
+        p += 8;
+        size -= 8;
+    }
+    
+    m = b | _load_tail(p, size);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+    
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint32_t hash_crc32(const uint64_t key[2], const void *buf, size_t size)
+{
+    return crc32((uint32_t)key[0], buf, size);
+}
+
+uint32_t hash_fast64(const uint64_t key[2], const void *buf, size_t size)
+{
+    uint64_t h = fast64(key[0], buf, size);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+uint32_t hash_siphash(const uint64_t key[2], const void *buf, size_t size)
+{
+    uint64_t h = siphash24(key, buf, size);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+uint32_t hash_u64(const uint64_t key[2], const void *buf, size_t size)
+{
+    uint64_t k;
+    
+    if (size != sizeof(k)) {
+        return hash_fast64(key, buf, size);
+    }
+    
+    memcpy(&k, buf, sizeof(k));
+    return hash_u64_word(key[0], k);
+}
+
+/**
+ * Returns the hash function for a DICT_HASH_* policy, or NULL.
+ **/
+dict_hash_fn hash_policy_fn(int policy)
+{
+    switch (policy) {
+        case DICT_HASH_CRC32:
+            return hash_crc32;
+        case DICT_HASH_FAST64:
+            return hash_fast64;
+        case DICT_HASH_SIPHASH:
+            return hash_siphash;
+        case DICT_HASH_U64:
+            return hash_u64;
+    }
+    
+    return NULL;
+}
+
+/**
+ * Expands a 32-bit seed into a 128-bit hash key, with splitmix64.
+ **/
+void hash_derive_key(uint32_t seed, uint64_t key[2])
+{
+    uint64_t x = seed;
+    int i;
+    
+    for (i = 0; i < 2; i++) {
+        x += UINT64_C(0x9e3779b97f4a7c15);
+        key[i] = hash_fmix64(x);
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t (*dict_hash_fn)(const uint64_t key[2], const void *buf, size_t size);
+
+uint64_t fast64(uint64_t seed, const void *buf, size_t size);
+uint64_t siphash24(const uint64_t key[2], const void *buf, size_t size);
+
+uint32_t hash_crc32(const uint64_t key[2], const void *buf, size_t size);
+uint32_t hash_fast64(const uint64_t key[2], const void *buf, size_t size);
+uint32_t hash_siphash(const uint64_t key[2], const void *buf, size_t size);
+uint32_t hash_u64(const uint64_t key[2], const void *buf, size_t size);
+
+dict_hash_fn hash_policy_fn(int policy);
+void hash_derive_key(uint32_t seed, uint64_t key[2]);
+
+/**
+ * The MurmurHash3 64-bit finalizer.
+ **/
+static inline uint64_t hash_fmix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    
+    return h;
+}
+
+/**
+ * DICT_HASH_U64 of the integer key k, as hash_u64() gives for its 8 bytes in
+ * native byte order.
+ **/
+static inline uint32_t hash_u64_word(uint64_t seed, uint64_t k)
+{
+    uint64_t h = hash_fmix64(k ^ seed);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,179 @@
+/*
+ * Fixed-size object pool.
+ *
+ * Items are carved out of large slabs, and freed items are kept on a free
+ * list for reuse, so allocating and freeing is a few pointer operations and
+ * never reaches malloc() in steady state. Slabs start small and double in
+ * size up to POOL_MAX_SLAB_ITEMS, so small pools stay small. Items can't be
+ * returned to the system individually; pool_release() frees every slab at
+ * once.
+ */
+
+#include <stdlib.h>
+
+#include "pool.h"
+
+#define POOL_MIN_SLAB_ITEMS 16
+#define POOL_MAX_SLAB_ITEMS 4096
+
+// Slab headers are padded so items stay aligned for any type.
+#define POOL_ALIGN(n) (((n) + sizeof(void *) * 2 - 1) & ~(sizeof(void *) * 2 - 1))
+
+/**
+ * Initializes an empty pool of item_size byte items.
+ **/
+void pool_init(struct pool *pool, size_t item_size)
+{
+    if (item_size < sizeof(void *)) {
+        item_size = sizeof(void *);
+    }
+    
+    pool->item_size = (item_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    pool->slab_items = POOL_MIN_SLAB_ITEMS;
+    pool->slabs = NULL;
+    pool->bump = NULL;
+    pool->bump_end = NULL;
+    pool->free_list = NULL;
+    pool->bytes = 0;
+}
+
+/**
+ * Allocates one item.
+ *
+ * Returns a pointer to the item, or NULL on error.
+ **/
+void *pool_alloc(struct pool *pool)
+{
+    struct pool_slab *slab;
+    void *item;
+    
+    if (pool->free_list != NULL) {
+        item = pool->free_list;
+        pool->free_list = *(void **)item;
+        return item;
+    }
+    
+    if (pool->bump == pool->bump_end) {
+        slab = malloc(POOL_ALIGN(sizeof(*slab)) + pool->item_size * pool->slab_items);
+        if (slab == NULL) {
+            return NULL;
+        }
+        
+        pool->bytes += POOL_ALIGN(sizeof(*slab)) + pool->item_size * pool->slab_items;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->bump = (char *)slab + POOL_ALIGN(sizeof(*slab));
+        pool->bump_end = pool->bump + pool->item_size * pool->slab_items;
+        
+        if (pool->slab_items < POOL_MAX_SLAB_ITEMS) {
+            pool->slab_items <<= 1;
+        }
+    }
+    
+    item = pool->bump;
+    pool->bump += pool->item_size;
+    return item;
+}
+
+/**
+ * Makes sure the next items allocations come from one contiguous slab, sized
+ * exactly, instead of several slabs of growing size. Any items left over in
+ * the current slab go on the free list.
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int pool_reserve(struct pool *pool, size_t items)
+{
+    struct pool_slab *slab;
+    
+    if ((size_t)(pool->bump_end - pool->bump) >= pool->item_size * items) {
+        return 1;
+    }
+    
+    slab = malloc(POOL_ALIGN(sizeof(*slab)) + pool->item_size * items);
+    if (slab == NULL) {
+        return 0;
+    }
+    
+    pool->bytes += POOL_ALIGN(sizeof(*slab)) + pool->item_size * items;
+    
+    for (; pool->bump != pool->bump_end; pool->bump += pool->item_size) {
+        pool_free(pool, pool->bump);
+    }
+    
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->bump = (char *)slab + POOL_ALIGN(sizeof(*slab));
+    pool->bump_end = pool->bump + pool->item_size * items;
+    
+    return 1;
+}
+
+/**
+ * Returns an item to the pool, for reuse by a later pool_alloc().
+ **/
+void pool_free(struct pool *pool, void *item)
+{
+    if (item == NULL) {
+        return;
+    }
+    
+    *(void **)item = pool->free_list;
+    pool->free_list = item;
+}
+
+/**
+ * Moves every slab of src into dst, and makes the items src hadn't handed
+ * out yet available to dst. Both pools must have the same item size. src is
+ * left empty. Lets threads fill private pools that are combined afterwards.
+ **/
+void pool_merge(struct pool *dst, struct pool *src)
+{
+    struct pool_slab *slab;
+    void *item;
+    
+    if (src->slabs != NULL) {
+        for (slab = src->slabs; slab->next != NULL; slab = slab->next) {
+        }
+        
+        slab->next = dst->slabs;
+        dst->slabs = src->slabs;
+        dst->bytes += src->bytes;
+    }
+    
+    while (src->free_list != NULL) {
+        item = src->free_list;
+        src->free_list = *(void **)item;
+        pool_free(dst, item);
+    }
+    
+    for (; src->bump != src->bump_end; src->bump += src->item_size) {
+        pool_free(dst, src->bump);
+    }
+    
+    pool_init(src, src->item_size);
+}
+
+/**
+ * Frees every slab, and every item with them. The pool stays usable.
+ **/
+void pool_release(struct pool *pool)
+{
+    struct pool_slab *slab, *next;
+    
+    for (slab = pool->slabs; slab != NULL; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    
+    pool_init(pool, pool->item_size);
+}
+
+/**
+ * Returns the number of bytes allocated for slabs, whether their items are
+ * in use or not.
+ **/
+size_t pool_bytes(const struct pool *pool)
+{
+    return pool->bytes;
+}
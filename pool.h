@@ -0,0 +1,32 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+struct pool_slab {
+    struct pool_slab *next;
+};
+
+struct pool {
+    size_t item_size;
+    size_t slab_items;
+    struct pool_slab *slabs;
+    char *bump;
+    char *bump_end;
+    void *free_list;
+    size_t bytes;
+};
+
+void pool_init(struct pool *pool, size_t item_size);
+void *pool_alloc(struct pool *pool);
+int pool_reserve(struct pool *pool, size_t items);
+void pool_free(struct pool *pool, void *item);
+void pool_merge(struct pool *dst, struct pool *src);
+void pool_release(struct pool *pool);
+size_t pool_bytes(const struct pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,371 @@
+/*
+ * Open addressing engine for struct dict.
+ *
+ * Entries are stored directly in dict->table (one slot of dict->node_size
+ * bytes per entry, next is always NULL), and a separate array of control
+ * bytes in dict->ctrl holds one byte per slot: PROBE_EMPTY, or the top 7
+ * bits of the entry's hash. Lookups compare a whole group of control bytes
+ * against the hash tag at once, and only touch the slots whose tag matches.
+ *
+ * Probing is linear, a group at a time, starting at the home slot
+ * (hash & mask). The control array is PROBE_GROUP bytes longer than the
+ * table, and the tail mirrors the first PROBE_GROUP bytes, so a group load
+ * starting at any slot never has to wrap around.
+ *
+ * Deletion uses backward shifting instead of tombstones: later entries of the
+ * same probe run are moved up into the hole, so a lookup can always stop at
+ * the first empty slot.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PROBE_GROUP 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PROBE_GROUP 16
+#else
+#define PROBE_GROUP 16
+#endif
+
+#include "dict_private.h"
+#include "probe.h"
+
+#define PROBE_EMPTY 0x80
+#define PROBE_TAG(hash) ((uint8_t)((hash) >> 25))
+
+#if defined(__AVX2__)
+
+static uint32_t _group_match(const uint8_t *ctrl, uint8_t tag)
+{
+    __m256i group = _mm256_loadu_si256((const __m256i *)ctrl);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(group, _mm256_set1_epi8((char)tag)));
+}
+
+static uint32_t _group_empty(const uint8_t *ctrl)
+{
+    // Only PROBE_EMPTY has its high bit set.
+    return (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)ctrl));
+}
+
+#elif defined(__SSE2__)
+
+static uint32_t _group_match(const uint8_t *ctrl, uint8_t tag)
+{
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+}
+
+static uint32_t _group_empty(const uint8_t *ctrl)
+{
+    // Only PROBE_EMPTY has its high bit set.
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+
+#else
+
+static uint32_t _group_match(const uint8_t *ctrl, uint8_t tag)
+{
+    uint32_t mask = 0;
+    int i;
+    
+    for (i = 0; i < PROBE_GROUP; i++) {
+        mask |= (uint32_t)(ctrl[i] == tag) << i;
+    }
+    
+    return mask;
+}
+
+static uint32_t _group_empty(const uint8_t *ctrl)
+{
+    uint32_t mask = 0;
+    int i;
+    
+    for (i = 0; i < PROBE_GROUP; i++) {
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    
+    return mask;
+}
+
+#endif
+
+static int _lowest_bit(uint32_t mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        i++;
+    }
+    
+    return i;
+#endif
+}
+
+static void _set_ctrl(uint8_t *ctrl, uint32_t capacity, uint32_t idx, uint8_t value)
+{
+    ctrl[idx] = value;
+    if (idx < PROBE_GROUP) {
+        ctrl[capacity + idx] = value;
+    }
+}
+
+/**
+ * Claims the first empty slot in the probe run starting at hash's home slot.
+ **/
+static uint32_t _claim(uint8_t *ctrl, uint32_t capacity, uint32_t hash)
+{
+    uint32_t mask = capacity - 1;
+    uint32_t pos = hash & mask;
+    uint32_t empty;
+    
+    for (;;) {
+        empty = _group_empty(ctrl + pos);
+        if (empty) {
+            pos = (pos + _lowest_bit(empty)) & mask;
+            _set_ctrl(ctrl, capacity, pos, PROBE_TAG(hash));
+            return pos;
+        }
+        
+        pos = (pos + PROBE_GROUP) & mask;
+    }
+}
+
+/**
+ * Allocates an empty table of capacity slots, replacing dict->table and
+ * dict->ctrl without freeing them. Capacity must be a power of two.
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int probe_alloc(struct dict *dict, uint32_t capacity)
+{
+    struct dict_node *table;
+    uint8_t *ctrl;
+    
+    if (capacity < PROBE_GROUP) {
+        capacity = PROBE_GROUP;
+    }
+    
+    table = calloc(capacity, dict->node_size);
+    if (table == NULL) {
+        return 0;
+    }
+    
+    ctrl = malloc(capacity + PROBE_GROUP);
+    if (ctrl == NULL) {
+        free(table);
+        return 0;
+    }
+    
+    memset(ctrl, PROBE_EMPTY, capacity + PROBE_GROUP);
+    
+    dict->table = table;
+    dict->ctrl = ctrl;
+    dict->capacity = capacity;
+    return 1;
+}
+
+/**
+ * Moves every entry into a new table of capacity slots, placing them by their
+ * cached hash. Capacity must be a power of two larger than dict->used.
+ *
+ * Returns 1 on success, and 0 on error.
+ **/
+int probe_resize(struct dict *dict, uint32_t capacity)
+{
+    struct dict_node *old_table = dict->table;
+    struct dict_node *src, *dst;
+    uint8_t *old_ctrl = dict->ctrl;
+    uint32_t old_capacity = dict->capacity;
+    uint32_t i;
+    
+    if (capacity < PROBE_GROUP) {
+        capacity = PROBE_GROUP;
+    }
+    
+    if (capacity <= dict->used) {
+        return 0;
+    }
+    
+    if (!probe_alloc(dict, capacity)) {
+        return 0;
+    }
+    
+    for (i = 0; i < old_capacity; i++) {
+        if (old_ctrl[i] != PROBE_EMPTY) {
+            src = DICT_NODE_AT(old_table, dict->node_size, i);
+            dst = DICT_NODE_AT(dict->table, dict->node_size, _claim(dict->ctrl, dict->capacity, src->hash));
+            dict_node_copy(dict, dst, src);
+        }
+    }
+    
+    free(old_table);
+    free(old_ctrl);
+    DICT_COUNT(dict, resizes, 1);
+    return 1;
+}
+
+/**
+ * Marks every slot empty. Slots must already have been cleared.
+ **/
+void probe_reset(struct dict *dict)
+{
+    memset(dict->ctrl, PROBE_EMPTY, dict->capacity + PROBE_GROUP);
+}
+
+/**
+ * Prefetches the control bytes and the home slot for hash.
+ **/
+void probe_prefetch(struct dict *dict, uint32_t hash)
+{
+    uint32_t pos = hash & (dict->capacity - 1);
+    
+    DICT_PREFETCH(dict->ctrl + pos);
+    DICT_PREFETCH(DICT_NODE_AT(dict->table, dict->node_size, pos));
+}
+
+/**
+ * Finds the slot holding key, or returns NULL.
+ **/
+struct dict_node *probe_find(struct dict *dict, uint32_t hash, const char *key, uint32_t len)
+{
+    struct dict_node *node;
+    uint32_t mask = dict->capacity - 1;
+    uint32_t pos = hash & mask;
+    uint32_t match, empty;
+    uint8_t tag = PROBE_TAG(hash);
+    
+    DICT_COUNT(dict, lookups, 1);
+    
+    for (;;) {
+        DICT_COUNT(dict, probes, 1);
+        match = _group_match(dict->ctrl + pos, tag);
+        empty = _group_empty(dict->ctrl + pos);
+        
+        // Slots past the first empty one belong to other probe runs.
+        if (empty) {
+            match &= (empty & -empty) - 1;
+        }
+        
+        while (match) {
+            node = DICT_NODE_AT(dict->table, dict->node_size, (pos + _lowest_bit(match)) & mask);
+            if (node->hash == hash && node->key_len == len) {
+                DICT_COUNT(dict, compares, 1);
+                
+                if (dict_key_equal(node->key, key, len)) {
+                    return node;
+                }
+            }
+            
+            DICT_COUNT(dict, tag_misses, 1);
+            match &= match - 1;
+        }
+        
+        if (empty) {
+            return NULL;
+        }
+        
+        pos = (pos + PROBE_GROUP) & mask;
+    }
+}
+
+/**
+ * Claims an empty slot for a key that is known not to be present, and
+ * returns it with only the hash filled in. The caller must make sure there
+ * is at least one free slot left after this insert.
+ **/
+struct dict_node *probe_insert(struct dict *dict, uint32_t hash)
+{
+    struct dict_node *node = DICT_NODE_AT(dict->table, dict->node_size, _claim(dict->ctrl, dict->capacity, hash));
+    
+    node->hash = hash;
+    return node;
+}
+
+/**
+ * Removes the entry in slot node, shifting later entries of the same probe
+ * run back so no tombstone is needed. The key/value must already be freed.
+ **/
+void probe_erase(struct dict *dict, struct dict_node *node)
+{
+    uint32_t mask = dict->capacity - 1;
+    uint32_t i = (uint32_t)(((char *)node - (char *)dict->table) / dict->node_size);
+    uint32_t j = i;
+    uint32_t home;
+    struct dict_node *slot;
+    
+    for (;;) {
+        j = (j + 1) & mask;
+        if (dict->ctrl[j] == PROBE_EMPTY) {
+            break;
+        }
+        
+        // The entry at j may fill the hole at i only if i lies between its
+        // home slot and j, otherwise lookups would no longer reach it.
+        slot = DICT_NODE_AT(dict->table, dict->node_size, j);
+        home = slot->hash & mask;
+        if (((i - home) & mask) < ((j - home) & mask)) {
+            dict_node_copy(dict, DICT_NODE_AT(dict->table, dict->node_size, i), slot);
+            _set_ctrl(dict->ctrl, dict->capacity, i, dict->ctrl[j]);
+            i = j;
+        }
+    }
+    
+    _set_ctrl(dict->ctrl, dict->capacity, i, PROBE_EMPTY);
+    memset(DICT_NODE_AT(dict->table, dict->node_size, i), 0, dict->node_size);
+}
+
+/**
+ * Calls fn for every entry whose home slot is home. They all lie in the
+ * probe run starting there, up to the first empty slot.
+ **/
+void probe_scan(struct dict *dict, uint32_t home, void (*fn)(struct dict_node *node, void *arg), void *arg)
+{
+    struct dict_node *slot;
+    uint32_t mask = dict->capacity - 1;
+    uint32_t i;
+    
+    for (i = home; dict->ctrl[i] != PROBE_EMPTY; i = (i + 1) & mask) {
+        slot = DICT_NODE_AT(dict->table, dict->node_size, i);
+        if ((slot->hash & mask) == home) {
+            fn(slot, arg);
+        }
+    }
+}
+
+/**
+ * Fills in the histogram of stats with how far each entry sits from its home
+ * slot, and the share of empty slots. Returns the bytes held by the table
+ * and its control bytes.
+ **/
+size_t probe_stats(struct dict *dict, struct dict_stats *stats)
+{
+    struct dict_node *slot;
+    uint32_t mask = dict->capacity - 1;
+    uint32_t i, dist;
+    size_t empty = 0;
+    
+    for (i = 0; i < dict->capacity; i++) {
+        if (dict->ctrl[i] == PROBE_EMPTY) {
+            empty++;
+            continue;
+        }
+        
+        slot = DICT_NODE_AT(dict->table, dict->node_size, i);
+        dist = (i - (slot->hash & mask)) & mask;
+        stats->chains[dist < DICT_STATS_CHAINS ? dist : DICT_STATS_CHAINS - 1]++;
+        
+        if (dist > stats->max_chain) {
+            stats->max_chain = dist;
+        }
+    }
+    
+    stats->empty = (float)empty / (float)dict->capacity;
+    return (size_t)dict->capacity * dict->node_size + dict->capacity + PROBE_GROUP;
+}
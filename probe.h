@@ -0,0 +1,22 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "dict.h"
+
+int probe_alloc(struct dict *dict, uint32_t capacity);
+int probe_resize(struct dict *dict, uint32_t capacity);
+void probe_reset(struct dict *dict);
+
+void probe_prefetch(struct dict *dict, uint32_t hash);
+struct dict_node *probe_find(struct dict *dict, uint32_t hash, const char *key, uint32_t len);
+struct dict_node *probe_insert(struct dict *dict, uint32_t hash);
+void probe_erase(struct dict *dict, struct dict_node *node);
+size_t probe_stats(struct dict *dict, struct dict_stats *stats);
+void probe_scan(struct dict *dict, uint32_t home, void (*fn)(struct dict_node *node, void *arg), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
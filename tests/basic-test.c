@@ -1,9 +1,14 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include "config.h"
 #include "dict.h"
+#include "hash.h"
+#include "threadpool.h"
 
 #define SEED 0xdeadbeef
 
@@ -160,6 +165,882 @@ void test_values_correct(struct dict *d)
     }
 }
 
+void test_stable_lookups(void)
+{
+    struct dict_node *nodes[1025];
+    struct dict *d;
+    char buf[32];
+    size_t i;
+    
+    d = dict_new(SEED, 1024, free, NULL);
+    
+    for (i = 0; i < 1025; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_set(d, strdup(buf), (void *)(uintptr_t)(i + 1)) == 1);
+    }
+    
+    assert(d->rehash_table != NULL);
+    
+    // Lookups leave the rehash where it is, so nodes found earlier hold on
+    for (i = 0; i < 1025; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        nodes[i] = dict_get(d, buf);
+        assert(nodes[i] != NULL && dict_contains(d, buf));
+    }
+    
+    for (i = 0; i < 1025; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(strcmp(nodes[i]->key, buf) == 0 && (uintptr_t)nodes[i]->value == i + 1);
+    }
+    
+    assert(d->rehash_table != NULL);
+    dict_delete(d);
+}
+
+void test_growth(int engine, int hash)
+{
+    size_t i, count;
+    char buf[32];
+    struct dict *d;
+    struct dict_node *n;
+    struct dict_iterator it;
+    struct dict_opts opts;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.capacity = 4;
+    opts.key_free_fn = free;
+    opts.engine = engine;
+    opts.hash = hash;
+    
+    d = dict_new_opts(&opts);
+    for (i = 0; i < 10000; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_set(d, strdup(buf), (void *)(uintptr_t)(i + 1)) == 1);
+        
+        // Lookups of earlier keys may land on either side of a rehash
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)(i / 2));
+        assert((n = dict_get(d, buf)) != NULL);
+        assert((uintptr_t)n->value == i / 2 + 1);
+    }
+    
+    assert(d->used == 10000);
+    assert(d->capacity >= 8192 || d->rehash_capacity >= 8192);
+    
+    // Iteration visits every entry exactly once, across both tables
+    count = 0;
+    dict_iterate_start(d, &it);
+    while (dict_iterate_next(&it) != NULL) {
+        count++;
+    }
+    
+    assert(count == 10000);
+    
+    for (i = 0; i < 10000; i += 2) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_del(d, buf) == 1);
+    }
+    
+    assert(d->used == 5000);
+    for (i = 0; i < 10000; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_contains(d, buf) == (int)(i % 2));
+    }
+    
+    // Shrinking folds buckets together, growing splits them apart again.
+    // Open addressing can't hold more entries than it has slots.
+    if (engine == DICT_ENGINE_PROBED) {
+        assert(dict_resize(d, 16) == 0);
+        assert(dict_resize(d, 8192) == 1);
+        assert(d->capacity == 8192 && d->used == 5000);
+    } else {
+        assert(dict_resize(d, 16) == 1);
+        assert(d->capacity == 16 && d->used == 5000);
+    }
+    
+    assert(dict_resize(d, 20000) == 1);
+    assert(d->capacity == 32768 && d->used == 5000);
+    
+    for (i = 1; i < 10000; i += 2) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert((n = dict_get(d, buf)) != NULL);
+        assert((uintptr_t)n->value == i + 1);
+    }
+    
+    dict_delete(d);
+}
+
+void test_get_many(int engine)
+{
+    size_t i;
+    char *keys[100];
+    int found[100];
+    struct dict *d;
+    struct dict_node *nodes[100];
+    struct dict_opts opts;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.capacity = 4;
+    opts.key_free_fn = free;
+    opts.engine = engine;
+    
+    // Odd keys are inserted, even ones are misses. Stopping at 50 entries
+    // leaves a rehash in progress for the chained engine.
+    d = dict_new_opts(&opts);
+    for (i = 0; i < 100; i++) {
+        keys[i] = malloc(16);
+        snprintf(keys[i], 16, "key-%lu", (unsigned long)i);
+        if (i % 2) {
+            assert(dict_set(d, strdup(keys[i]), (void *)(uintptr_t)i) == 1);
+        }
+    }
+    
+    dict_get_many(d, keys, 100, nodes);
+    for (i = 0; i < 100; i++) {
+        if (i % 2) {
+            assert(nodes[i] != NULL && (uintptr_t)nodes[i]->value == i);
+        } else {
+            assert(nodes[i] == NULL);
+        }
+    }
+    
+    assert(dict_contains_many(d, keys, 100, found) == 50);
+    for (i = 0; i < 100; i++) {
+        assert(found[i] == (int)(i % 2));
+    }
+    
+    // Batches shorter than the prefetch window
+    assert(dict_contains_many(d, keys + 1, 3, found) == 2);
+    assert(dict_contains_many(d, keys, 0, found) == 0);
+    
+    for (i = 0; i < 100; i++) {
+        free(keys[i]);
+    }
+    
+    dict_delete(d);
+}
+
+void *clone_key(void *key)
+{
+    return strdup(key);
+}
+
+void test_parallel(int flags)
+{
+    size_t i;
+    char buf[64];
+    struct dict *d, *c;
+    struct dict_node *n;
+    struct dict_opts opts;
+    struct threadpool *pool;
+    
+    pool = threadpool_new(3);
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.capacity = 4;
+    opts.flags = flags;
+    if (!(flags & DICT_F_OWN_KEYS)) {
+        opts.key_free_fn = free;
+    }
+    
+    // 3000 entries leave a rehash from 2048 to 4096 buckets in progress
+    d = dict_new_opts(&opts);
+    for (i = 0; i < 3000; i++) {
+        snprintf(buf, sizeof(buf), i % 3 ? "k%lu" : "a-rather-long-key-%lu", (unsigned long)i);
+        assert(dict_set(d, (flags & DICT_F_OWN_KEYS) ? buf : strdup(buf), (void *)(uintptr_t)(i + 1)) == 1);
+    }
+    
+    assert(d->rehash_table != NULL);
+    
+    c = dict_clone_parallel(d, (flags & DICT_F_OWN_KEYS) ? NULL : clone_key, NULL, pool);
+    assert(c != NULL && c->used == 3000 && c->capacity == 4096 && c->rehash_table == NULL);
+    
+    // Grow, shrink below the entry count, then fold in the rehash
+    assert(dict_resize_parallel(c, 10000, pool) == 1);
+    assert(c->capacity == 16384);
+    assert(dict_resize_parallel(c, 100, pool) == 1);
+    assert(c->capacity == 128 && c->used == 3000);
+    assert(dict_resize_parallel(d, 2048, pool) == 1);
+    assert(d->capacity == 2048 && d->rehash_table == NULL);
+    
+    for (i = 0; i < 3000; i++) {
+        snprintf(buf, sizeof(buf), i % 3 ? "k%lu" : "a-rather-long-key-%lu", (unsigned long)i);
+        assert((n = dict_get(c, buf)) != NULL && (uintptr_t)n->value == i + 1);
+        assert((n = dict_get(d, buf)) != NULL && (uintptr_t)n->value == i + 1);
+    }
+    
+    // Both stay fully usable
+    for (i = 0; i < 3000; i += 2) {
+        snprintf(buf, sizeof(buf), i % 3 ? "k%lu" : "a-rather-long-key-%lu", (unsigned long)i);
+        assert(dict_del(c, buf) == 1);
+    }
+    
+    assert(c->used == 1500 && d->used == 3000);
+    
+    dict_delete(c);
+    dict_delete(d);
+    threadpool_delete(pool);
+}
+
+struct dict *range_dict(int engine, int hash, size_t from, size_t to, size_t step)
+{
+    size_t i;
+    char buf[32];
+    struct dict *d;
+    struct dict_opts opts;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.key_free_fn = free;
+    opts.engine = engine;
+    opts.hash = hash;
+    
+    d = dict_new_opts(&opts);
+    for (i = from; i < to; i += step) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_set(d, strdup(buf), (void *)(uintptr_t)(i + 1)) == 1);
+    }
+    
+    return d;
+}
+
+// Checks that d holds exactly the keys in [from, to) for which in() is
+// true, with values i + 1 (so taken from the dict listing key i first).
+void check_range(struct dict *d, size_t from, size_t to, int (*in)(size_t))
+{
+    size_t i, count = 0;
+    char buf[32];
+    struct dict_node *n;
+    
+    for (i = from; i < to; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        n = dict_get(d, buf);
+        if (in(i)) {
+            assert(n != NULL && (uintptr_t)n->value == i + 1);
+            count++;
+        } else {
+            assert(n == NULL);
+        }
+    }
+    
+    assert(d->used == count);
+}
+
+int in_a_only(size_t i) { return i < 1000 && !(i >= 500 && i < 1500); }
+int in_a_and_b(size_t i) { return i >= 500 && i < 1000; }
+int in_a_or_b(size_t i) { return i < 1500; }
+int in_one(size_t i) { return i < 500 || (i >= 1000 && i < 1500); }
+int in_all(size_t i) { return i >= 500 && i < 1000 && i % 3 == 0; }
+
+void test_set_ops(int engine, int hash)
+{
+    struct dict *a, *b, *c, *r;
+    struct dict *dicts[3];
+    
+    // a and b overlap in 500..999. b may hash differently, which forces
+    // keys to be hashed again.
+    a = range_dict(DICT_ENGINE_CHAINED, DICT_HASH_CRC32, 0, 1000, 1);
+    b = range_dict(engine, hash, 500, 1500, 1);
+    c = range_dict(engine, DICT_HASH_CRC32, 0, 3000, 3);
+    
+    r = dict_difference(a, b, clone_key, NULL);
+    check_range(r, 0, 1500, in_a_only);
+    dict_delete(r);
+    
+    // b is iterated when it is the smaller side, but values come from a
+    r = dict_intersection(a, b, clone_key, NULL);
+    check_range(r, 0, 1500, in_a_and_b);
+    dict_delete(r);
+    
+    r = dict_union(a, b, clone_key, NULL);
+    check_range(r, 0, 1500, in_a_or_b);
+    dict_delete(r);
+    
+    r = dict_symmetric_difference(a, b, clone_key, NULL);
+    check_range(r, 0, 1500, in_one);
+    dict_delete(r);
+    
+    dicts[0] = b;
+    dicts[1] = c;
+    dicts[2] = a;
+    r = dict_intersection_many(dicts, 3, clone_key, NULL);
+    assert(r->hash == b->hash && r->engine == b->engine);
+    check_range(r, 0, 3000, in_all);
+    dict_delete(r);
+    
+    r = dict_intersection_many(dicts, 1, clone_key, NULL);
+    assert(r->used == b->used);
+    dict_delete(r);
+    
+    dict_delete(a);
+    dict_delete(b);
+    dict_delete(c);
+}
+
+void test_from_arrays(int engine)
+{
+    size_t i;
+    char buf[32];
+    char *ks[6000];
+    void *vs[6000];
+    struct dict *d;
+    struct dict_node *n;
+    struct dict_opts opts;
+    
+    // The last 1000 pairs repeat earlier keys with new values
+    for (i = 0; i < 6000; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)(i < 5000 ? i : (i - 5000) * 5));
+        ks[i] = strdup(buf);
+        vs[i] = (void *)(uintptr_t)(i + 1);
+    }
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.capacity = 4;
+    opts.engine = engine;
+    
+    // Owned keys are copied into room reserved up front, in one chunk
+    opts.flags = DICT_F_OWN_KEYS;
+    opts.key_inline = 4;
+    d = dict_from_arrays(ks, vs, 6000, &opts);
+    assert(d != NULL && d->used == 5000);
+    assert(d->arena.chunks != NULL && d->arena.chunks->next == NULL);
+    
+    for (i = 0; i < 5000; i += 7) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert((n = dict_get(d, buf)) != NULL && n->key != ks[i]);
+        assert((uintptr_t)n->value == (i % 5 == 0 ? i / 5 + 5001 : i + 1));
+    }
+    
+    dict_delete(d);
+    
+    opts.flags = 0;
+    opts.key_inline = 0;
+    opts.key_free_fn = free;
+    d = dict_from_arrays(ks, vs, 6000, &opts);
+    assert(d != NULL && d->used == 5000);
+    
+    // Sized once: no growth, and no rehash pending
+    assert(d->rehash_table == NULL && d->capacity >= 5000);
+    
+    for (i = 0; i < 5000; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert((n = dict_get(d, buf)) != NULL);
+        assert((uintptr_t)n->value == (i % 5 == 0 ? i / 5 + 5001 : i + 1));
+    }
+    
+    assert(dict_set(d, strdup("new"), NULL) == 1 && dict_del(d, "key-0") == 1);
+    dict_delete(d);
+    
+    d = dict_from_arrays(NULL, NULL, 0, NULL);
+    assert(d != NULL && d->used == 0);
+    dict_delete(d);
+}
+
+void count_seen(struct dict_node *node, void *arg)
+{
+    ((unsigned *)arg)[(uintptr_t)node->value - 1]++;
+}
+
+void test_scan(int engine)
+{
+    unsigned seen[4000];
+    uint32_t cursor = 0;
+    struct dict *d;
+    char buf[32];
+    size_t i, next = 2000;
+    int calls = 0;
+    
+    d = range_dict(engine, DICT_HASH_CRC32, 0, 2000, 1);
+    
+    // Left alone, every key is seen exactly once
+    memset(seen, 0, sizeof(seen));
+    do {
+        cursor = dict_scan(d, cursor, count_seen, seen, 16);
+        calls++;
+    } while (cursor != 0);
+    
+    assert(calls > 1);
+    for (i = 0; i < 2000; i++) {
+        assert(seen[i] == 1);
+    }
+    
+    // Keys 0..999 stay put while others come and go, and the table grows
+    // and shrinks under the scan
+    memset(seen, 0, sizeof(seen));
+    do {
+        cursor = dict_scan(d, cursor, count_seen, seen, 8);
+        
+        for (i = 0; i < 20 && next < 4000; i++, next++) {
+            snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)next);
+            assert(dict_set(d, strdup(buf), (void *)(uintptr_t)(next + 1)) == 1);
+            
+            snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)(next / 2));
+            dict_del(d, buf);
+        }
+        
+        if (next == 3000) {
+            assert(dict_resize(d, (uint32_t)d->used * 4) == 1);
+        } else if (next == 3500) {
+            assert(dict_resize(d, (uint32_t)d->used * 2) == 1);
+        }
+    } while (cursor != 0);
+    
+    for (i = 0; i < 1000; i++) {
+        assert(seen[i] >= 1);
+    }
+    
+    dict_delete(d);
+}
+
+void test_stats(int engine)
+{
+    struct dict_stats stats;
+    struct dict *d;
+    size_t i, n = 0;
+    char buf[32];
+    
+    d = range_dict(engine, DICT_HASH_CRC32, 0, 5000, 1);
+    assert(dict_resize(d, 8192) == 1);
+    
+    dict_stats(d, &stats);
+    assert(stats.used == 5000 && stats.capacity == d->capacity);
+    assert(stats.load == (float)5000 / (float)d->capacity);
+    assert(stats.empty > 0.0f && stats.empty < 1.0f);
+    assert(stats.max_chain > 0 && stats.max_chain < 64);
+    assert(stats.bytes > (size_t)d->capacity * d->node_size);
+    
+    for (i = 0; i < DICT_STATS_CHAINS; i++) {
+        n += i > 0 && engine == DICT_ENGINE_CHAINED ? stats.chains[i] : 0;
+        n += engine == DICT_ENGINE_PROBED ? stats.chains[i] : 0;
+    }
+    
+    // Every entry is either a bucket head or an overflow node
+    assert(n + stats.overflow == 5000);
+    
+    dict_stats_reset(d);
+    for (i = 0; i < 200; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)(i * 50));
+        assert((dict_get(d, buf) != NULL) == (i < 100));
+    }
+    
+    assert(dict_resize(d, 16384) == 1);
+    dict_stats(d, &stats);
+    
+#ifdef DICT_STATS
+    assert(stats.counters.lookups == 200 && stats.counters.probes >= 200);
+    assert(stats.counters.compares >= 100 && stats.counters.resizes == 1);
+#else
+    assert(stats.counters.lookups == 0 && stats.counters.resizes == 0);
+#endif
+    
+    dict_delete(d);
+}
+
+struct record {
+    uint64_t id;
+    uint32_t count;
+    char tag[16];
+};
+
+// Checks that the record of key-i holds i, and count.
+void check_record(struct dict *d, size_t i, uint32_t count)
+{
+    struct record *r;
+    char buf[32];
+    
+    snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+    r = dict_get_ptr(d, buf);
+    assert(r != NULL && r->id == i && r->count == count && strcmp(r->tag, buf) == 0);
+    assert((void *)r == dict_get(d, buf)->value);
+}
+
+void test_inline_values(int engine, int flags)
+{
+    struct dict_opts opts;
+    struct record rec;
+    struct dict *d, *c;
+    char buf[32];
+    size_t i;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.engine = engine;
+    opts.flags = flags;
+    opts.key_free_fn = free;
+    opts.value_size = sizeof(struct record);
+    
+    // Never called on the value slots
+    opts.value_free_fn = free;
+    d = dict_new_opts(&opts);
+    
+    memset(&rec, 0, sizeof(rec));
+    for (i = 0; i < 5000; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        rec.id = i;
+        memcpy(rec.tag, buf, strlen(buf) + 1);
+        assert(dict_set_copy(d, flags & DICT_F_OWN_KEYS ? buf : strdup(buf), &rec) == 1);
+    }
+    
+    assert(d->used == 5000);
+    for (i = 0; i < 5000; i++) {
+        check_record(d, i, 0);
+    }
+    
+    // Slots can be updated in place, and move along with their entries
+    for (i = 0; i < 5000; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        ((struct record *)dict_get_ptr(d, buf))->count = 7;
+    }
+    
+    assert(dict_resize(d, 16384) == 1);
+    assert(dict_resize(d, 8192) == 1);
+    
+    c = dict_clone(d, flags & DICT_F_OWN_KEYS ? NULL : clone_key, NULL);
+    assert(c != NULL && c->used == 5000);
+    
+    for (i = 0; i < 5000; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        ((struct record *)dict_get_ptr(c, buf))->count = 8;
+    }
+    
+    // Deleting chain heads moves the next entry up
+    for (i = 0; i < 5000; i += 2) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_del(d, buf) == 1);
+    }
+    
+    for (i = 1; i < 5000; i += 2) {
+        check_record(d, i, 7);
+        check_record(c, i, 8);
+    }
+    
+    // Replacing copies over the old bytes, and NULL zeroes them
+    rec.id = 1;
+    rec.count = 9;
+    snprintf(rec.tag, sizeof(rec.tag), "key-1");
+    assert(dict_set_copy(d, flags & DICT_F_OWN_KEYS ? "key-1" : strdup("key-1"), &rec) == 1);
+    check_record(d, 1, 9);
+    
+    assert(dict_set(d, flags & DICT_F_OWN_KEYS ? "key-3" : strdup("key-3"), NULL) == 1);
+    memset(&rec, 0, sizeof(rec));
+    assert(memcmp(dict_get_ptr(d, "key-3"), &rec, sizeof(rec)) == 0);
+    
+    assert(dict_get_ptr(d, "key-0") == NULL);
+    
+    dict_delete(c);
+    dict_delete(d);
+    
+    // Only dicts with inline values take copies
+    d = dict_new(SEED, 16, NULL, NULL);
+    assert(dict_set_copy(d, "a", &rec) == 0 && d->used == 0);
+    assert(dict_set(d, "a", &rec) == 1 && dict_get_ptr(d, "a") == &rec);
+    dict_delete(d);
+}
+
+struct dict *u64_dict(int engine, size_t from, size_t to)
+{
+    struct dict_opts opts;
+    struct dict *d;
+    size_t i;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.engine = engine;
+    opts.flags = DICT_F_U64_KEYS;
+    d = dict_new_opts(&opts);
+    assert(d != NULL && d->hash == DICT_HASH_U64);
+    
+    // Spread over the whole range, top bits included
+    for (i = from; i < to; i++) {
+        assert(dict_u64_set(d, i * UINT64_C(0x9e3779b97f4a7c15), (void *)(uintptr_t)(i + 1)) == 1);
+    }
+    
+    return d;
+}
+
+void test_u64(int engine)
+{
+    struct dict_iterator it;
+    struct dict_node *node;
+    struct dict *a, *b, *c;
+    uint64_t key;
+    size_t i, n;
+    
+    a = u64_dict(engine, 0, 20000);
+    assert(a->used == 20000);
+    
+    // Keys live in the node, without a terminator
+    assert(a->node_size == sizeof(struct dict_node) + sizeof(uint64_t));
+    
+    for (i = 0; i < 20000; i++) {
+        key = i * UINT64_C(0x9e3779b97f4a7c15);
+        node = dict_u64_get(a, key);
+        assert(node != NULL && dict_u64_key(node) == key && node->value == (void *)(uintptr_t)(i + 1));
+        assert(node->key_len == sizeof(key) && node->key == (char *)node + sizeof(struct dict_node));
+    }
+    
+    assert(dict_u64_contains(a, 0) && !dict_u64_contains(a, 1) && !dict_u64_contains(a, UINT64_MAX));
+    assert(dict_u64_set(a, UINT64_MAX, NULL) == 1 && dict_u64_contains(a, UINT64_MAX));
+    assert(dict_u64_set(a, UINT64_MAX, a) == 1 && dict_u64_get(a, UINT64_MAX)->value == a);
+    assert(dict_u64_del(a, UINT64_MAX) == 1 && dict_u64_del(a, UINT64_MAX) == 0);
+    
+    assert(dict_resize(a, 65536) == 1);
+    assert(dict_u64_get(a, 19999 * UINT64_C(0x9e3779b97f4a7c15)) != NULL);
+    
+    // Iteration and the set operations see the integer keys
+    n = 0;
+    dict_iterate_start(a, &it);
+    while ((node = dict_iterate_next(&it)) != NULL) {
+        assert(dict_u64_key(node) == ((uintptr_t)node->value - 1) * UINT64_C(0x9e3779b97f4a7c15));
+        n++;
+    }
+    
+    assert(n == 20000);
+    
+    b = u64_dict(engine, 10000, 30000);
+    c = dict_difference(a, b, NULL, NULL);
+    assert(c != NULL && c->used == 10000 && (c->flags & DICT_F_U64_KEYS));
+    assert(dict_u64_contains(c, 9999 * UINT64_C(0x9e3779b97f4a7c15)));
+    assert(!dict_u64_contains(c, 10000 * UINT64_C(0x9e3779b97f4a7c15)));
+    dict_delete(c);
+    
+    n = 0;
+    dict_iterate_start(a, &it);
+    while ((node = dict_iterate_intersection(b, &it)) != NULL) {
+        assert((uintptr_t)node->value > 10000);
+        n++;
+    }
+    
+    assert(n == 10000);
+    
+    c = dict_clone(b, NULL, NULL);
+    for (i = 10000; i < 30000; i += 2) {
+        assert(dict_u64_del(b, i * UINT64_C(0x9e3779b97f4a7c15)) == 1);
+    }
+    
+    assert(b->used == 10000 && c->used == 20000);
+    assert(dict_u64_contains(c, 10000 * UINT64_C(0x9e3779b97f4a7c15)));
+    
+    // String dicts don't take integer keys
+    dict_delete(c);
+    c = dict_new(SEED, 16, NULL, NULL);
+    assert(dict_u64_set(c, 1, NULL) == 0 && c->used == 0);
+    
+    dict_delete(c);
+    dict_delete(b);
+    dict_delete(a);
+}
+
+void test_shrink(int engine)
+{
+    struct dict_iterator it;
+    struct dict_opts opts;
+    struct dict *d;
+    size_t i, n, pool, arena, stepped = 0;
+    uint32_t capacity;
+    char buf[64];
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.engine = engine;
+    opts.flags = DICT_F_OWN_KEYS;
+    opts.key_inline = 8;
+    d = dict_new_opts(&opts);
+    
+    // Keys too long to be inline, so they take arena space
+    for (i = 0; i < 100000; i++) {
+        snprintf(buf, sizeof(buf), "shrink-key-%lu", (unsigned long)i);
+        assert(dict_set(d, buf, NULL) == 1);
+    }
+    
+    assert(d->capacity >= 65536);
+    pool = pool_bytes(&d->pool);
+    arena = arena_bytes(&d->arena);
+    
+    // The table follows the entries down, a step per call for chained dicts
+    for (i = 100; i < 100000; i++) {
+        snprintf(buf, sizeof(buf), "shrink-key-%lu", (unsigned long)i);
+        assert(dict_del(d, buf) == 1);
+        stepped += d->rehash_table != NULL && d->rehash_capacity < d->capacity;
+    }
+    
+    assert((stepped > 0) == (engine == DICT_ENGINE_CHAINED));
+    
+    // A shrink sized for the entries left when it started is followed by
+    // another on a later delete
+    for (i = 0; i < 100000 && (d->capacity > 512 || d->rehash_table != NULL); i++) {
+        assert(dict_set(d, "extra", NULL) == 1 && dict_del(d, "extra") == 1);
+    }
+    
+    assert(d->capacity <= 512 && d->used == 100);
+    
+    n = 0;
+    dict_iterate_start(d, &it);
+    while (dict_iterate_next(&it) != NULL) {
+        n++;
+    }
+    
+    assert(n == 100);
+    
+    for (i = 0; i < 100; i++) {
+        snprintf(buf, sizeof(buf), "shrink-key-%lu", (unsigned long)i);
+        assert(dict_contains(d, buf) == 1);
+    }
+    
+    // Hovering around a threshold doesn't resize every time
+    capacity = d->capacity;
+    for (i = 0; i < 1000; i++) {
+        assert(dict_set(d, "extra", NULL) == 1 && dict_del(d, "extra") == 1);
+    }
+    
+    assert(d->capacity == capacity);
+    
+    // Compacting fits the entries at max_load, and gives back the memory
+    // deleted entries left behind
+    assert(dict_compact(d) == 1);
+    assert(d->capacity == 128);
+    assert(dict_contains(d, "shrink-key-99") == 1 && d->used == 100);
+    assert(pool_bytes(&d->pool) < pool / 10 || pool == 0);
+    assert(arena_bytes(&d->arena) < arena / 10);
+    
+    dict_delete(d);
+    
+    // Never below the capacity asked for, or at all without a min_load
+    opts.capacity = 4096;
+    d = dict_new_opts(&opts);
+    dict_set_min_load(d, -1.0f);
+    
+    for (i = 0; i < 10000; i++) {
+        snprintf(buf, sizeof(buf), "shrink-key-%lu", (unsigned long)i);
+        assert(dict_set(d, buf, NULL) == 1);
+    }
+    
+    assert(dict_resize(d, 16384) == 1);
+    
+    for (i = 10; i < 10000; i++) {
+        snprintf(buf, sizeof(buf), "shrink-key-%lu", (unsigned long)i);
+        assert(dict_del(d, buf) == 1);
+    }
+    
+    assert(d->capacity == 16384);
+    
+    dict_set_min_load(d, DICT_DEFAULT_MIN_LOAD);
+    assert(dict_del(d, "shrink-key-9") == 1);
+    assert((d->rehash_table != NULL ? d->rehash_capacity : d->capacity) == 4096);
+    
+    assert(dict_compact(d) == 1 && d->capacity == 16);
+    assert(dict_contains(d, "shrink-key-8") == 1 && d->used == 9);
+    
+    dict_delete(d);
+}
+
+void test_siphash(void)
+{
+    // Reference vectors: key 00..0f, messages 00..(n - 1)
+    uint64_t key[2] = { UINT64_C(0x0706050403020100), UINT64_C(0x0f0e0d0c0b0a0908) };
+    uint8_t msg[15];
+    size_t i;
+    
+    for (i = 0; i < sizeof(msg); i++) {
+        msg[i] = (uint8_t)i;
+    }
+    
+    assert(siphash24(key, msg, 0) == UINT64_C(0x726fdb47dd0e0e31));
+    assert(siphash24(key, msg, 15) == UINT64_C(0xa129ca6149be45e5));
+}
+
+void test_binary_keys(void)
+{
+    char a[] = { 'k', '\0', 'x' };
+    char b[] = { 'k', '\0', 'y' };
+    uint32_t hash;
+    struct dict *d, *e;
+    struct dict_node *n;
+    
+    d = dict_new(SEED, 16, NULL, NULL);
+    e = dict_new(SEED, 64, NULL, NULL);
+    
+    // Keys only differ after an embedded NUL
+    assert(dict_set_n(d, a, sizeof(a), "a") == 1);
+    assert(dict_set_n(d, b, sizeof(b), "b") == 1);
+    assert(dict_set_n(d, a, 1, "prefix") == 1);
+    assert(d->used == 3);
+    
+    assert((n = dict_get_n(d, b, sizeof(b))) != NULL);
+    assert(strcmp(n->value, "b") == 0 && n->key_len == sizeof(b));
+    assert(strcmp(dict_get(d, "k")->value, "prefix") == 0);
+    
+    // One hash serves every dict with the same policy and seed
+    hash = dict_hash(d, a, sizeof(a));
+    assert(dict_set_hashed(e, a, sizeof(a), hash, "e") == 1);
+    assert(strcmp(dict_get_hashed(d, a, sizeof(a), hash)->value, "a") == 0);
+    assert(strcmp(dict_get_hashed(e, a, sizeof(a), hash)->value, "e") == 0);
+    assert(dict_contains_hashed(e, b, sizeof(b), dict_hash(d, b, sizeof(b))) == 0);
+    
+    assert(dict_del_n(d, a, sizeof(a)) == 1);
+    assert(dict_contains_n(d, a, sizeof(a)) == 0);
+    assert(dict_contains_n(d, a, 1) == 1);
+    assert(dict_del_hashed(e, a, sizeof(a), hash) == 1 && e->used == 0);
+    
+    dict_delete(d);
+    dict_delete(e);
+}
+
+void test_owned_keys(int engine)
+{
+    size_t i;
+    char buf[64];
+    struct dict *d, *c;
+    struct dict_node *n;
+    struct dict_opts opts;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.engine = engine;
+    opts.flags = DICT_F_OWN_KEYS;
+    
+    d = dict_new_opts(&opts);
+    
+    // Mix of keys stored inline and in the arena, all from one buffer
+    for (i = 0; i < 2000; i++) {
+        snprintf(buf, sizeof(buf), i % 3 ? "k%lu" : "a-rather-long-key-%lu", (unsigned long)i);
+        assert(dict_set(d, buf, (void *)(uintptr_t)(i + 1)) == 1);
+    }
+    
+    // Overwriting keeps the dict's copy of the key
+    assert(dict_set(d, "k1", (void *)(uintptr_t)42) == 1);
+    assert((n = dict_get(d, "k1")) != NULL && (uintptr_t)n->value == 42);
+    assert(n->key != buf && strcmp(n->key, "k1") == 0);
+    
+    // Moves during resize and delete must carry inline keys along
+    if (engine == DICT_ENGINE_CHAINED) {
+        assert(dict_resize(d, 64) == 1);
+    }
+    
+    assert(dict_resize(d, 8192) == 1);
+    for (i = 0; i < 2000; i += 2) {
+        snprintf(buf, sizeof(buf), i % 3 ? "k%lu" : "a-rather-long-key-%lu", (unsigned long)i);
+        assert(dict_del(d, buf) == 1);
+    }
+    
+    c = dict_clone(d, NULL, NULL);
+    dict_delete(d);
+    
+    assert(c->used == 1000);
+    for (i = 1; i < 2000; i += 2) {
+        snprintf(buf, sizeof(buf), i % 3 ? "k%lu" : "a-rather-long-key-%lu", (unsigned long)i);
+        assert((n = dict_get(c, buf)) != NULL);
+        assert(strcmp(n->key, buf) == 0 && n->key_len == strlen(buf));
+    }
+    
+    dict_clear(c);
+    assert(c->used == 0 && dict_get(c, "k1") == NULL);
+    dict_delete(c);
+}
+
 int main(void)
 {
     size_t i;
@@ -215,6 +1096,49 @@ int main(void)
         assert(d->table[i].next == NULL);
     }
     
+    // Chain nodes went back with their slabs
+    assert(d->pool.slabs == NULL && d->pool.free_list == NULL);
+    
     dict_delete(d);
+    
+    test_siphash();
+    test_binary_keys();
+    test_owned_keys(DICT_ENGINE_CHAINED);
+    test_owned_keys(DICT_ENGINE_PROBED);
+    
+    test_stable_lookups();
+    
+    test_growth(DICT_ENGINE_CHAINED, DICT_HASH_CRC32);
+    test_growth(DICT_ENGINE_PROBED, DICT_HASH_CRC32);
+    test_growth(DICT_ENGINE_CHAINED, DICT_HASH_FAST64);
+    test_growth(DICT_ENGINE_PROBED, DICT_HASH_SIPHASH);
+    
+    test_get_many(DICT_ENGINE_CHAINED);
+    test_get_many(DICT_ENGINE_PROBED);
+    
+    test_parallel(0);
+    test_parallel(DICT_F_OWN_KEYS);
+    
+    test_set_ops(DICT_ENGINE_CHAINED, DICT_HASH_CRC32);
+    test_set_ops(DICT_ENGINE_PROBED, DICT_HASH_SIPHASH);
+    
+    test_from_arrays(DICT_ENGINE_CHAINED);
+    test_from_arrays(DICT_ENGINE_PROBED);
+    
+    test_scan(DICT_ENGINE_CHAINED);
+    test_scan(DICT_ENGINE_PROBED);
+    
+    test_stats(DICT_ENGINE_CHAINED);
+    test_stats(DICT_ENGINE_PROBED);
+    
+    test_inline_values(DICT_ENGINE_CHAINED, 0);
+    test_inline_values(DICT_ENGINE_PROBED, 0);
+    test_inline_values(DICT_ENGINE_CHAINED, DICT_F_OWN_KEYS);
+    
+    test_u64(DICT_ENGINE_CHAINED);
+    test_u64(DICT_ENGINE_PROBED);
+    
+    test_shrink(DICT_ENGINE_CHAINED);
+    test_shrink(DICT_ENGINE_PROBED);
     exit(0);
 }
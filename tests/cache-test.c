@@ -0,0 +1,383 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "dict.h"
+#include "dict_snapshot.h"
+
+#define SEED 1234
+
+static size_t freed;
+static uint64_t now;
+
+static void count_free(void *ptr)
+{
+    freed++;
+}
+
+static uint64_t fake_clock(void)
+{
+    return now;
+}
+
+static size_t value_bytes(void *value)
+{
+    return strlen(value);
+}
+
+static char *key_of(char *buf, size_t i)
+{
+    snprintf(buf, 32, "key-%lu", (unsigned long)i);
+    return buf;
+}
+
+static struct dict *cache_new(int engine, size_t max_entries, size_t max_bytes)
+{
+    struct dict_opts opts;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.engine = engine;
+    opts.flags = DICT_F_OWN_KEYS | DICT_F_CACHE;
+    opts.value_free_fn = count_free;
+    opts.max_entries = max_entries;
+    opts.max_bytes = max_bytes;
+    opts.clock_fn = fake_clock;
+    
+    return dict_new_opts(&opts);
+}
+
+static void *value_of(size_t i)
+{
+    return (void *)(uintptr_t)(i + 1);
+}
+
+static void test_clock(int engine)
+{
+    struct dict_iterator it;
+    struct dict_node *node;
+    struct dict *d;
+    size_t i, kept = 0;
+    char buf[32];
+    
+    freed = 0;
+    d = cache_new(engine, 1000, 0);
+    
+    for (i = 0; i < 1000; i++) {
+        assert(dict_set(d, key_of(buf, i), value_of(i)) == 1);
+    }
+    
+    assert(d->used == 1000 && freed == 0);
+    
+    // One past the bound: the hand clears every bit, then evicts one
+    assert(dict_set(d, key_of(buf, 1000), value_of(1000)) == 1);
+    assert(d->used == 1000 && freed == 1);
+    
+    // Entries looked up since are kept, the others make room
+    for (i = 0; i < 500; i++) {
+        kept += dict_get(d, key_of(buf, i)) != NULL;
+    }
+    
+    assert(kept >= 499);
+    
+    for (i = 1001; i < 1250; i++) {
+        assert(dict_set(d, key_of(buf, i), value_of(i)) == 1);
+        assert(d->used == 1000);
+    }
+    
+    assert(freed == 250);
+    
+    for (i = 0; i < 500; i++) {
+        node = dict_get(d, key_of(buf, i));
+        assert(node == NULL || node->value == value_of(i));
+        kept -= node != NULL;
+    }
+    
+    assert(kept == 0);
+    
+    // Iteration only sees what is left
+    i = 0;
+    dict_iterate_start(d, &it);
+    while (dict_iterate_next(&it) != NULL) {
+        i++;
+    }
+    
+    assert(i == 1000);
+    
+    dict_delete(d);
+    assert(freed == 1250);
+}
+
+static void test_bytes(int engine)
+{
+    struct dict_iterator it;
+    struct dict_node *node;
+    struct dict_opts opts;
+    struct dict *d;
+    char buf[32], *values[4];
+    size_t i, bytes;
+    
+    values[0] = "a";
+    values[1] = "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb";
+    values[2] = "cccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccccc";
+    values[3] = "";
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.engine = engine;
+    opts.flags = DICT_F_OWN_KEYS | DICT_F_CACHE;
+    opts.max_bytes = 10000;
+    opts.value_bytes_fn = value_bytes;
+    d = dict_new_opts(&opts);
+    
+    for (i = 0; i < 5000; i++) {
+        assert(dict_set(d, key_of(buf, i % 700), values[i % 4]) == 1);
+        assert(d->bytes <= 10000);
+        
+        if (i % 500 == 0) {
+            assert(dict_del(d, key_of(buf, i % 350)) <= 1);
+        }
+    }
+    
+    // The byte count follows replacements, deletes and evictions
+    bytes = 0;
+    dict_iterate_start(d, &it);
+    while ((node = dict_iterate_next(&it)) != NULL) {
+        bytes += node->key_len + strlen(node->value);
+    }
+    
+    assert(bytes == d->bytes && d->used < 700);
+    
+    dict_clear(d);
+    assert(d->bytes == 0);
+    dict_delete(d);
+}
+
+static void test_ttl(int engine)
+{
+    struct dict_node *nodes[200];
+    struct dict *d, *c;
+    char *keys[200];
+    char buf[32];
+    size_t i;
+    
+    freed = 0;
+    now = 1000;
+    d = cache_new(engine, 0, 0);
+    
+    for (i = 0; i < 200; i++) {
+        key_of(buf, i);
+        assert(dict_set_ttl(d, buf, value_of(i), i < 100 ? 10 : 0) == 1);
+        keys[i] = strdup(buf);
+    }
+    
+    c = dict_clone(d, NULL, NULL);
+    assert(c != NULL && c->used == 200);
+    
+    now = 1009;
+    for (i = 0; i < 200; i++) {
+        assert(dict_contains(d, keys[i]));
+    }
+    
+    // Expired entries are gone on lookup
+    now = 1010;
+    for (i = 0; i < 50; i++) {
+        assert(dict_get(d, keys[i]) == NULL);
+    }
+    
+    assert(d->used == 150 && freed == 50);
+    
+    // Batched lookups don't find them either
+    dict_get_many(d, keys, 200, nodes);
+    for (i = 0; i < 200; i++) {
+        assert((nodes[i] != NULL) == (i >= 100));
+    }
+    
+    // The sweep reclaims the rest, and keeps entries without a TTL
+    assert(dict_expire(d, d->capacity) == 50);
+    assert(d->used == 100 && freed == 100);
+    assert(dict_expire(d, d->capacity) == 0);
+    
+    // dict_set drops a TTL, dict_set_ttl sets a new one
+    assert(dict_set_ttl(d, keys[150], value_of(150), 5) == 1);
+    assert(dict_set_ttl(d, keys[160], value_of(160), 5) == 1);
+    assert(dict_set(d, keys[160], value_of(160)) == 1);
+    
+    now = 2000;
+    assert(!dict_contains(d, keys[150]) && dict_contains(d, keys[160]));
+    
+    // Clones keep the TTLs of their entries
+    for (i = 0; i < 200; i++) {
+        assert(dict_contains(c, keys[i]) == (i >= 100));
+    }
+    
+    // Sets swept by dict_set itself
+    for (i = 0; i < 100; i++) {
+        assert(dict_set_ttl(c, keys[i], value_of(i), 1) == 1);
+    }
+    
+    now = 3000;
+    for (i = 0; i < 100 * c->capacity; i++) {
+        assert(dict_set(c, "other", NULL) == 1);
+    }
+    
+    assert(c->used == 101);
+    
+    dict_delete(c);
+    dict_delete(d);
+    
+    for (i = 0; i < 200; i++) {
+        free(keys[i]);
+    }
+    
+    // Plain dicts don't take TTLs
+    d = dict_new(SEED, 16, NULL, NULL);
+    assert(dict_set_ttl(d, "a", NULL, 10) == 0 && d->used == 0);
+    assert(dict_expire(d, 16) == 0);
+    dict_delete(d);
+}
+
+static void test_expiring_get(void)
+{
+    struct dict_node *kept;
+    struct dict *d;
+    uint32_t capacity, rehash_capacity;
+    char buf[32];
+    size_t i, n;
+    
+    freed = 0;
+    now = 1000;
+    d = cache_new(DICT_ENGINE_CHAINED, 0, 0);
+    
+    // Stored first, so it stays at the head of its bucket
+    assert(dict_set(d, "kept", value_of(1010)) == 1);
+    for (n = 0; n < 1000 || d->rehash_table == NULL; n++) {
+        assert(dict_set_ttl(d, key_of(buf, n), value_of(n), 10) == 1);
+    }
+    
+    capacity = d->capacity;
+    rehash_capacity = d->rehash_capacity;
+    kept = dict_get(d, "kept");
+    
+    // Lookups that delete expired entries leave the table, and the rehash
+    // in progress, as they are, so the node found before is still there
+    now = 2000;
+    for (i = 0; i < n; i++) {
+        assert(dict_get(d, key_of(buf, i)) == NULL);
+    }
+    
+    assert(d->used == 1 && freed == n);
+    assert(d->rehash_table != NULL);
+    assert(d->capacity == capacity && d->rehash_capacity == rehash_capacity);
+    assert(kept->value == value_of(1010));
+    
+    // Expiring drives the rehash to its end
+    while (d->rehash_table != NULL) {
+        assert(dict_expire(d, 64) == 0);
+    }
+    
+    assert(d->rehash_table == NULL && d->capacity == rehash_capacity);
+    
+    // Deleting starts shrinking it
+    assert(dict_del(d, "kept") == 1);
+    assert(d->rehash_table != NULL && d->rehash_capacity < d->capacity);
+    
+    dict_delete(d);
+}
+
+static void test_growing(void)
+{
+    struct dict_iterator it;
+    struct dict *d;
+    char buf[32];
+    size_t i;
+    
+    freed = 0;
+    d = cache_new(DICT_ENGINE_CHAINED, 513, 0);
+    
+    for (i = 0; i < 513; i++) {
+        assert(dict_set(d, key_of(buf, i), value_of(i)) == 1);
+    }
+    
+    assert(d->rehash_table != NULL);
+    
+    // Evicting walks both tables, and leaves the growth to go on as usual
+    assert(dict_set(d, key_of(buf, 513), value_of(513)) == 1);
+    assert(d->rehash_table != NULL && d->used == 513 && freed == 1);
+    
+    for (i = 514; i < 2000; i++) {
+        assert(dict_set(d, key_of(buf, i), value_of(i)) == 1);
+        assert(d->used == 513);
+    }
+    
+    i = 0;
+    dict_iterate_start(d, &it);
+    while (dict_iterate_next(&it) != NULL) {
+        i++;
+    }
+    
+    assert(i == 513 && freed == 2000 - 513);
+    dict_delete(d);
+}
+
+static void test_snapshot(void)
+{
+    struct dict_snapshot *snapshot;
+    struct dict *d;
+    char buf[32];
+    size_t i;
+    
+    freed = 0;
+    d = cache_new(DICT_ENGINE_CHAINED, 2000, 0);
+    
+    for (i = 0; i < 2000; i++) {
+        assert(dict_set(d, key_of(buf, i), value_of(i)) == 1);
+    }
+    
+    // Lookups leave the shared entries alone, evictions copy them in
+    snapshot = dict_snapshot(d);
+    assert(snapshot != NULL);
+    
+    for (i = 0; i < 2000; i++) {
+        assert(dict_get(d, key_of(buf, i)) != NULL);
+    }
+    
+    // One at a time, not the whole table to clear bits
+    assert(dict_set(d, key_of(buf, 2000), value_of(2000)) == 1);
+    assert(d->cow_missing >= d->capacity / DICT_COW_SEGMENT - 2);
+    
+    for (i = 2001; i < 3000; i++) {
+        assert(dict_set(d, key_of(buf, i), value_of(i)) == 1);
+    }
+    
+    assert(d->used == 2000 && freed == 0);
+    
+    for (i = 0; i < 2000; i++) {
+        assert(dict_snapshot_get(snapshot, key_of(buf, i))->value == value_of(i));
+    }
+    
+    dict_snapshot_release(snapshot);
+    dict_delete(d);
+    assert(freed == 3000);
+}
+
+int main(void)
+{
+    test_clock(DICT_ENGINE_CHAINED);
+    test_clock(DICT_ENGINE_PROBED);
+    
+    test_bytes(DICT_ENGINE_CHAINED);
+    test_bytes(DICT_ENGINE_PROBED);
+    
+    test_ttl(DICT_ENGINE_CHAINED);
+    test_ttl(DICT_ENGINE_PROBED);
+    
+    test_expiring_get();
+    test_growing();
+    test_snapshot();
+    
+    return 0;
+}
@@ -0,0 +1,196 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include "dict_concurrent.h"
+
+#define SEED 1234
+#define STABLE 20000
+#define CHURN 1000
+#define READERS 4
+#define LOOKUPS 1000000
+
+static struct dict_concurrent *d;
+static char *stable[STABLE];
+static char *churn[CHURN];
+static size_t inserted;
+static int done;
+
+static int *int_new(int i)
+{
+    int *p = malloc(sizeof(*p));
+    
+    *p = i;
+    
+    return p;
+}
+
+// Inserts the stable keys, growing the table under the readers, then keeps
+// replacing and deleting the churn keys.
+static void *writer(void *arg)
+{
+    size_t i;
+    int round;
+    
+    for (i = 0; i < STABLE; i++) {
+        assert(dict_concurrent_set(d, strdup(stable[i]), int_new((int)i)) == 1);
+        __atomic_store_n(&inserted, i + 1, __ATOMIC_RELEASE);
+    }
+    
+    for (round = 0; round < 20; round++) {
+        for (i = 0; i < CHURN; i++) {
+            assert(dict_concurrent_set(d, strdup(churn[i]), int_new((int)i)) == 1);
+        }
+        
+        for (i = 0; i < CHURN; i += 2) {
+            assert(dict_concurrent_del(d, churn[i]) == 1);
+        }
+    }
+    
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    
+    return NULL;
+}
+
+// Every stable key inserted so far must be found, and a churn key, if found,
+// must still have a readable value.
+static void *reader(void *arg)
+{
+    struct dict_node *n;
+    unsigned token, seed = (unsigned)(uintptr_t)arg;
+    size_t i, limit;
+    
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        limit = __atomic_load_n(&inserted, __ATOMIC_ACQUIRE);
+        
+        token = dict_concurrent_read_lock(d);
+        
+        if (limit > 0) {
+            seed = seed * 1103515245 + 12345;
+            i = seed % limit;
+            assert((n = dict_concurrent_get(d, stable[i])) != NULL);
+            assert(*(int *)n->value == (int)i);
+        }
+        
+        seed = seed * 1103515245 + 12345;
+        i = seed % CHURN;
+        if ((n = dict_concurrent_get(d, churn[i])) != NULL) {
+            assert(*(int *)n->value == (int)i);
+        }
+        
+        dict_concurrent_read_unlock(d, token);
+    }
+    
+    return NULL;
+}
+
+static void *lookups(void *arg)
+{
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    size_t i, found = 0;
+    
+    for (i = 0; i < LOOKUPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        found += dict_concurrent_contains(d, stable[seed % STABLE]);
+    }
+    
+    assert(found == LOOKUPS);
+    
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+    pthread_t threads[8];
+    struct dict_opts opts;
+    char buf[32];
+    size_t i;
+    int t, nthreads;
+    double start;
+    
+    for (i = 0; i < STABLE; i++) {
+        snprintf(buf, sizeof(buf), "stable-%lu", (unsigned long)i);
+        stable[i] = strdup(buf);
+    }
+    
+    for (i = 0; i < CHURN; i++) {
+        snprintf(buf, sizeof(buf), "churn-%lu", (unsigned long)i);
+        churn[i] = strdup(buf);
+    }
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.key_free_fn = free;
+    opts.value_free_fn = free;
+    
+    // Unsupported configurations
+    opts.engine = DICT_ENGINE_PROBED;
+    assert(dict_concurrent_new(&opts) == NULL);
+    opts.engine = DICT_ENGINE_CHAINED;
+    
+    d = dict_concurrent_new(&opts);
+    assert(d != NULL && d->table->capacity == DICT_CONCURRENT_STRIPES);
+    
+    pthread_create(&threads[0], NULL, writer, NULL);
+    for (t = 1; t <= READERS; t++) {
+        pthread_create(&threads[t], NULL, reader, (void *)(uintptr_t)t);
+    }
+    
+    for (t = 0; t <= READERS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    
+    assert(d->table->capacity >= STABLE);
+    assert(dict_concurrent_size(d) == STABLE + CHURN / 2);
+    for (i = 0; i < CHURN; i++) {
+        assert(dict_concurrent_contains(d, churn[i]) == (int)(i % 2));
+    }
+    
+    assert(dict_concurrent_resize(d, 100000) == 1);
+    assert(d->table->capacity == 131072);
+    assert(dict_concurrent_size(d) == STABLE + CHURN / 2);
+    
+    dict_concurrent_reclaim(d);
+    assert(d->retired_count == 0);
+    
+    // Read-only scaling. Timings are informational; a single global lock
+    // would stay flat as threads are added.
+    for (nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        start = now();
+        for (t = 0; t < nthreads; t++) {
+            pthread_create(&threads[t], NULL, lookups, (void *)(uintptr_t)(t + 1));
+        }
+        
+        for (t = 0; t < nthreads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        
+        printf("%d threads: %.1fM lookups/s\n", nthreads, nthreads * (LOOKUPS / 1e6) / (now() - start));
+    }
+    
+    dict_concurrent_delete(d);
+    
+    for (i = 0; i < STABLE; i++) {
+        free(stable[i]);
+    }
+    
+    for (i = 0; i < CHURN; i++) {
+        free(churn[i]);
+    }
+    
+    exit(0);
+}
@@ -0,0 +1,232 @@
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dict.hpp"
+
+#define SEED 1234
+
+static int live;
+
+// Counts its live instances, to check every entry is destroyed once.
+struct tracked {
+    int v;
+    
+    explicit tracked(int v) : v(v) { live++; }
+    tracked(const tracked &o) : v(o.v) { live++; }
+    tracked &operator=(const tracked &) = default;
+    ~tracked() { live--; }
+};
+
+// Too aligned for the pool, so nodes come from operator new instead.
+struct alignas(32) wide {
+    double v[4];
+};
+
+static std::string key_of(int i)
+{
+    return "key-" + std::to_string(i);
+}
+
+static void test_move_only()
+{
+    cdict::dict<std::string, std::unique_ptr<int>> d;
+    std::vector<int *> refs;
+    size_t n = 0;
+    
+    for (int i = 0; i < 100000; i++) {
+        auto r = d.try_emplace(key_of(i), std::make_unique<int>(i));
+        assert(r.second && *r.first->second == i);
+        refs.push_back(r.first->second.get());
+    }
+    
+    assert(d.size() == 100000);
+    assert(d.load_factor() <= d.max_load_factor());
+    
+    // The key is left alone when it's already present
+    std::string key = key_of(5);
+    auto r = d.try_emplace(std::move(key), nullptr);
+    assert(!r.second && *r.first->second == 5 && key == key_of(5));
+    
+    r = d.emplace(key_of(6), std::make_unique<int>(-1));
+    assert(!r.second && *r.first->second == 6);
+    
+    // Entries never move, even while the table grows
+    for (int i = 0; i < 100000; i++) {
+        auto it = d.find(key_of(i));
+        assert(it != d.end() && it->second.get() == refs[i]);
+    }
+    
+    for (auto &e : d) {
+        assert(std::stoi(e.first.substr(4)) == *e.second);
+        n++;
+    }
+    
+    assert(n == d.size());
+    
+    for (int i = 0; i < 100000; i += 2) {
+        assert(d.erase(key_of(i)) == 1);
+    }
+    
+    assert(d.erase(key_of(0)) == 0);
+    assert(d.size() == 50000 && !d.contains(key_of(2)) && d.contains(key_of(3)));
+}
+
+static void test_lifetimes()
+{
+    {
+        cdict::dict<int, tracked> d(4);
+        
+        for (int i = 0; i < 1000; i++) {
+            d.try_emplace(i, i);
+        }
+        
+        assert(live == 1000);
+        
+        // Erasing while iterating visits every entry once
+        int seen = 0;
+        for (auto it = d.begin(); it != d.end(); ) {
+            assert(it->second.v == it->first);
+            seen++;
+            it = it->first % 3 == 0 ? d.erase(it) : std::next(it);
+        }
+        
+        assert(seen == 1000 && d.size() == 666 && live == 666);
+        
+        d.insert_or_assign(1, tracked(-1));
+        assert(d.at(1).v == -1 && live == 666);
+        
+        cdict::dict<int, tracked> copy(d);
+        assert(copy.size() == 666 && live == 1332);
+        
+        d.clear();
+        assert(d.empty() && d.begin() == d.end() && live == 666);
+        
+        d = std::move(copy);
+        assert(d.size() == 666 && d.at(2).v == 2);
+        
+        d.rehash(4);
+        assert(d.bucket_count() >= 666 && d.at(2).v == 2);
+        
+        const cdict::dict<int, tracked> &cd = d;
+        size_t n = 0;
+        for (auto it = cd.cbegin(); it != cd.cend(); ++it) {
+            n += cd.find(it->first)->second.v == it->second.v;
+        }
+        
+        assert(n == 666 && cd.count(2) == 1 && cd.count(3) == 0);
+        
+        try {
+            d.at(3);
+            assert(0);
+        } catch (const std::out_of_range &) {
+        }
+    }
+    
+    assert(live == 0);
+}
+
+static void test_moved_from()
+{
+    cdict::dict<int, int> a;
+    
+    for (int i = 0; i < 100; i++) {
+        a[i] = i;
+    }
+    
+    // Moved-from dicts are empty, and usable again
+    cdict::dict<int, int> b(std::move(a));
+    assert(b.size() == 100 && a.empty() && a.begin() == a.end());
+    assert(!a.contains(1) && a.find(1) == a.end() && a.erase(1) == 0);
+    assert(a.load_factor() == 0.0f);
+    
+    a[3] = 4;
+    assert(a.size() == 1 && a.at(3) == 4);
+    
+    cdict::dict<int, int> c;
+    c = std::move(a);
+    assert(c.at(3) == 4 && !a.contains(3));
+    assert(a.emplace(5, 6).second && a.at(5) == 6);
+    
+    b = std::move(c);
+    assert(b.size() == 1 && c.empty());
+    c.clear();
+    c.reserve(50);
+    assert(c.try_emplace(7, 8).second && c.bucket_count() >= 50);
+    
+    cdict::dict<int, int> d(std::move(a));
+    cdict::dict<int, int> e(a);
+    assert(d.size() == 1 && e.empty() && e.insert({1, 2}).second);
+}
+
+static void test_hash()
+{
+    struct dict_opts opts;
+    struct dict *c;
+    std::string key;
+    
+    // Strings hash the same as in struct dict, with the same seed
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.hash = DICT_HASH_FAST64;
+    c = dict_new_opts(&opts);
+    
+    cdict::hash<std::string> fast(SEED);
+    for (int i = 0; i < 100; i++) {
+        key = key_of(i);
+        assert(fast(key) == dict_hash(c, key.data(), key.size()));
+    }
+    
+    dict_delete(c);
+    
+    opts.hash = DICT_HASH_SIPHASH;
+    c = dict_new_opts(&opts);
+    
+    cdict::siphash sip(SEED);
+    cdict::dict<std::string, int, cdict::siphash> d(16, sip);
+    for (int i = 0; i < 100; i++) {
+        key = key_of(i);
+        assert(sip(key) == dict_hash(c, key.data(), key.size()));
+        d[key] = i;
+    }
+    
+    assert(d.size() == 100 && d[key_of(42)] == 42);
+    dict_delete(c);
+    
+    // So do integers, with DICT_HASH_U64
+    opts.hash = DICT_HASH_U64;
+    c = dict_new_opts(&opts);
+    
+    cdict::hash<uint64_t> u64(SEED);
+    for (uint64_t k = 0; k < 100; k++) {
+        uint64_t word = k * 7919;
+        assert(u64(word) == dict_hash(c, &word, sizeof(word)));
+    }
+    
+    dict_delete(c);
+    
+    // Any hasher will do, std::hash included
+    cdict::dict<wide *, wide, std::hash<wide *>> w;
+    std::vector<wide> keys(1000);
+    for (auto &k : keys) {
+        w[&k].v[0] = (double)(&k - keys.data());
+    }
+    
+    for (size_t i = 0; i < keys.size(); i++) {
+        assert(w.at(&keys[i]).v[0] == (double)i);
+        assert(((uintptr_t)&w.at(&keys[i]) & 31) == 0);
+    }
+}
+
+int main()
+{
+    test_move_only();
+    test_lifetimes();
+    test_moved_from();
+    test_hash();
+    
+    return 0;
+}
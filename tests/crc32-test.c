@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "config.h"
+#include "crc32.h"
+
+#ifdef DICT_CRC32C
+#define POLY 0x82f63b78U
+#define CHECK 0xe3069283U
+#else
+#define POLY 0xedb88320U
+#define CHECK 0xcbf43926U
+#endif
+
+// Bit-at-a-time reference implementation.
+uint32_t crc32_reference(uint32_t crc, const uint8_t *p, size_t size)
+{
+    int k;
+    
+    crc = ~crc;
+    while (size--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+    }
+    
+    return ~crc;
+}
+
+int main(void)
+{
+    uint8_t buf[300];
+    size_t i, offset, len;
+    
+    assert(crc32(0, "123456789", 9) == CHECK);
+    
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t)(i * 31 + 7);
+    }
+    
+    // Cover every tail length, and unaligned starts
+    for (offset = 0; offset < 8; offset++) {
+        for (len = 0; len + offset <= sizeof(buf); len++) {
+            assert(crc32(0xdeadbeef, buf + offset, len) == crc32_reference(0xdeadbeef, buf + offset, len));
+        }
+    }
+    
+    exit(0);
+}
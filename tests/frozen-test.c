@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "dict_frozen.h"
+
+#define SEED 1234
+
+static size_t freed;
+
+static void count_free(void *value)
+{
+    freed++;
+    free(value);
+}
+
+static void test_freeze(int engine, int flags, size_t count)
+{
+    struct dict_frozen_iterator it;
+    struct dict_frozen *f;
+    struct dict_opts opts;
+    struct dict *d;
+    const char *key;
+    size_t i, key_len;
+    char buf[32], *seen;
+    void *value;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.engine = engine;
+    opts.flags = flags;
+    opts.key_free_fn = flags & DICT_F_OWN_KEYS ? NULL : free;
+    opts.value_free_fn = count_free;
+    
+    d = dict_new_opts(&opts);
+    for (i = 0; i < count; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_set(d, flags & DICT_F_OWN_KEYS ? buf : strdup(buf), strdup(buf + 4)) == 1);
+    }
+    
+    // The dict's keys are freed, and its values moved.
+    freed = 0;
+    f = dict_freeze(d);
+    assert(f != NULL && dict_frozen_size(f) == count && freed == 0);
+    
+    for (i = 0; i < count; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_frozen_get(f, buf, &value) == 1);
+        assert(strcmp(value, buf + 4) == 0);
+    }
+    
+    assert(dict_frozen_contains(f, "key-") == 0);
+    assert(dict_frozen_contains(f, "") == 0);
+    assert(dict_frozen_get_n(f, "key-1", 4, NULL) == 0);
+    
+    for (i = count; i < count * 2; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_frozen_contains(f, buf) == 0);
+    }
+    
+    // Iteration visits every entry once
+    seen = calloc(count + 1, 1);
+    dict_frozen_iterate_start(f, &it);
+    while (dict_frozen_iterate_next(&it, &key, &key_len, &value)) {
+        assert(key_len == strlen(key) && strcmp(key + 4, value) == 0);
+        i = strtoul(key + 4, NULL, 10);
+        assert(i < count && !seen[i]);
+        seen[i] = 1;
+    }
+    
+    for (i = 0; i < count; i++) {
+        assert(seen[i]);
+    }
+    
+    free(seen);
+    dict_frozen_delete(f);
+    assert(freed == count);
+}
+
+int main(void)
+{
+    struct dict_frozen *f;
+    struct dict *d;
+    
+    test_freeze(DICT_ENGINE_CHAINED, 0, 0);
+    test_freeze(DICT_ENGINE_CHAINED, 0, 1);
+    test_freeze(DICT_ENGINE_CHAINED, 0, 100000);
+    test_freeze(DICT_ENGINE_PROBED, 0, 20000);
+    test_freeze(DICT_ENGINE_CHAINED, DICT_F_OWN_KEYS, 20000);
+    
+    // Without a value_free_fn, deleting doesn't visit the values at all
+    d = dict_new(SEED, 16, NULL, NULL);
+    assert(dict_set(d, "a", (void *)(uintptr_t)1) == 1);
+    f = dict_freeze(d);
+    assert(f != NULL && f->value_free_fn == NULL);
+    dict_frozen_delete(f);
+    
+    exit(0);
+}
@@ -0,0 +1,175 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "dict_mmap.h"
+
+#define SEED 1234
+#define COUNT 5000
+#define PATH "mmap-test.dict"
+
+static size_t string_size(void *value)
+{
+    return strlen(value) + 1;
+}
+
+static void test_snapshot(int engine, int hash)
+{
+    struct dict_mmap_iterator it;
+    struct dict_mmap *m;
+    struct dict_opts opts;
+    struct dict *d;
+    const void *value;
+    const char *key;
+    size_t i, key_len, value_len;
+    char buf[32], *seen;
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.engine = engine;
+    opts.hash = hash;
+    opts.key_free_fn = free;
+    opts.value_free_fn = free;
+    
+    d = dict_new_opts(&opts);
+    for (i = 0; i < COUNT; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_set(d, strdup(buf), strdup(buf + 4)) == 1);
+    }
+    
+    assert(dict_save(d, PATH, string_size) == 1);
+    dict_delete(d);
+    
+    m = dict_open_mmap(PATH);
+    assert(m != NULL && dict_mmap_size(m) == COUNT);
+    
+    for (i = 0; i < COUNT; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_mmap_get(m, buf, &value, &value_len) == 1);
+        assert(value_len == strlen(buf + 4) + 1 && strcmp(value, buf + 4) == 0);
+        
+        // Values are aligned for direct use
+        assert((uintptr_t)value % 8 == 0);
+    }
+    
+    assert(dict_mmap_contains(m, "key-5000") == 0);
+    assert(dict_mmap_contains(m, "") == 0);
+    
+    // Iteration visits every entry once
+    seen = calloc(COUNT, 1);
+    dict_mmap_iterate_start(m, &it);
+    while (dict_mmap_iterate_next(&it, &key, &key_len, &value, &value_len)) {
+        assert(key_len == strlen(key) && strncmp(key, "key-", 4) == 0);
+        assert(strcmp(key + 4, value) == 0);
+        i = strtoul(key + 4, NULL, 10);
+        assert(i < COUNT && !seen[i]);
+        seen[i] = 1;
+    }
+    
+    for (i = 0; i < COUNT; i++) {
+        assert(seen[i]);
+    }
+    
+    free(seen);
+    dict_mmap_close(m);
+}
+
+int main(void)
+{
+    struct dict_mmap *m;
+    struct dict_opts opts;
+    struct dict *d;
+    const void *value;
+    size_t value_len;
+    uint64_t word = 42, key;
+    FILE *fp;
+    
+    test_snapshot(DICT_ENGINE_CHAINED, DICT_HASH_CRC32);
+    test_snapshot(DICT_ENGINE_PROBED, DICT_HASH_SIPHASH);
+    
+    // Saving the value pointers themselves, for integer values
+    d = dict_new(SEED, 4, NULL, NULL);
+    assert(dict_set(d, "one", (void *)(uintptr_t)1) == 1);
+    assert(dict_set(d, "zero", NULL) == 1);
+    assert(dict_save(d, PATH, NULL) == 1);
+    dict_delete(d);
+    
+    m = dict_open_mmap(PATH);
+    assert(m != NULL && dict_mmap_size(m) == 2);
+    assert(dict_mmap_get(m, "one", &value, &value_len) == 1);
+    assert((uintptr_t)value == 1 && value_len == 0);
+    assert(dict_mmap_get(m, "zero", &value, NULL) == 1 && value == NULL);
+    dict_mmap_close(m);
+    
+    // Inline values are saved whole
+    dict_opts_init(&opts);
+    opts.value_size = sizeof(word);
+    d = dict_new_opts(&opts);
+    assert(dict_set_copy(d, "answer", &word) == 1);
+    assert(dict_save(d, PATH, NULL) == 1);
+    dict_delete(d);
+    
+    m = dict_open_mmap(PATH);
+    assert(m != NULL && dict_mmap_get(m, "answer", &value, &value_len) == 1);
+    assert(value_len == sizeof(word) && memcmp(value, &word, sizeof(word)) == 0);
+    dict_mmap_close(m);
+    
+    // Binary and integer keys are looked up by length
+    d = dict_new(SEED, 4, NULL, NULL);
+    assert(dict_set_n(d, "a\0b", 3, (void *)(uintptr_t)3) == 1);
+    assert(dict_set_n(d, "a", 1, (void *)(uintptr_t)1) == 1);
+    assert(dict_save(d, PATH, NULL) == 1);
+    dict_delete(d);
+    
+    m = dict_open_mmap(PATH);
+    assert(m != NULL && dict_mmap_get_n(m, "a\0b", 3, &value, NULL) == 1 && (uintptr_t)value == 3);
+    assert(dict_mmap_get(m, "a", &value, NULL) == 1 && (uintptr_t)value == 1);
+    assert(dict_mmap_contains_n(m, "a\0c", 3) == 0 && dict_mmap_contains_n(m, "a\0", 2) == 0);
+    dict_mmap_close(m);
+    
+    dict_opts_init(&opts);
+    opts.flags = DICT_F_U64_KEYS;
+    d = dict_new_opts(&opts);
+    for (word = 0; word < 1000; word++) {
+        assert(dict_u64_set(d, word * 7919, (void *)(uintptr_t)(word + 1)) == 1);
+    }
+    
+    assert(dict_save(d, PATH, NULL) == 1);
+    dict_delete(d);
+    
+    m = dict_open_mmap(PATH);
+    assert(m != NULL && dict_mmap_size(m) == 1000);
+    for (word = 0; word < 1000; word++) {
+        key = word * 7919;
+        assert(dict_mmap_get_n(m, (const char *)&key, sizeof(key), &value, NULL) == 1);
+        assert((uintptr_t)value == word + 1);
+    }
+    
+    key = 1;
+    assert(dict_mmap_contains_n(m, (const char *)&key, sizeof(key)) == 0);
+    dict_mmap_close(m);
+    
+    // An empty dict still makes a valid snapshot
+    d = dict_new(SEED, 4, NULL, NULL);
+    assert(dict_save(d, PATH, NULL) == 1);
+    dict_delete(d);
+    
+    m = dict_open_mmap(PATH);
+    assert(m != NULL && dict_mmap_size(m) == 0 && dict_mmap_contains(m, "one") == 0);
+    dict_mmap_close(m);
+    
+    // Files that aren't snapshots are rejected
+    assert(dict_open_mmap("no-such-file") == NULL);
+    
+    fp = fopen(PATH, "r+b");
+    fputc('X', fp);
+    fclose(fp);
+    assert(dict_open_mmap(PATH) == NULL);
+    
+    remove(PATH);
+    
+    exit(0);
+}
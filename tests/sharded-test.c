@@ -0,0 +1,170 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include "dict_sharded.h"
+#include "threadpool.h"
+
+#define SEED 1234
+#define WRITERS 4
+#define PER_WRITER 5000
+
+static struct dict_sharded *d;
+
+static void square(void *arg, size_t i)
+{
+    ((size_t *)arg)[i] = i * i;
+}
+
+static void count(struct dict_node *node, void *arg)
+{
+    __atomic_fetch_add((size_t *)arg, 1, __ATOMIC_RELAXED);
+}
+
+static void sum(struct dict_node *node, void *arg)
+{
+    __atomic_fetch_add((size_t *)arg, (size_t)(uintptr_t)node->value, __ATOMIC_RELAXED);
+}
+
+// Each writer owns a disjoint range of keys, and reads back its own keys.
+static void *writer(void *arg)
+{
+    size_t i, base = (size_t)(uintptr_t)arg * PER_WRITER;
+    char buf[32];
+    void *value;
+    
+    for (i = base; i < base + PER_WRITER; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_sharded_set(d, strdup(buf), (void *)(uintptr_t)(i + 1)) == 1);
+    }
+    
+    for (i = base; i < base + PER_WRITER; i++) {
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_sharded_get(d, buf, &value) == 1);
+        assert((uintptr_t)value == i + 1);
+        
+        if (i % 4 == 0) {
+            assert(dict_sharded_del(d, buf) == 1);
+        }
+    }
+    
+    return NULL;
+}
+
+static void *clone_key(void *key)
+{
+    return strdup(key);
+}
+
+int main(void)
+{
+    struct threadpool *pool;
+    struct dict_sharded *c;
+    struct dict_opts opts;
+    pthread_t threads[WRITERS];
+    size_t squares[1000];
+    size_t i, n, total;
+    uint32_t shard;
+    void *value;
+    int t;
+    
+    // Thread pool loops cover every index exactly once
+    pool = threadpool_new(3);
+    for (t = 0; t < 10; t++) {
+        memset(squares, 0, sizeof(squares));
+        threadpool_run(pool, square, squares, 1000);
+        for (i = 0; i < 1000; i++) {
+            assert(squares[i] == i * i);
+        }
+    }
+    
+    threadpool_delete(pool);
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.capacity = 64;
+    opts.key_free_fn = free;
+    
+    assert(dict_sharded_new(&opts, 12, 2) == NULL);
+    
+    d = dict_sharded_new(&opts, 16, 3);
+    assert(d != NULL && d->shard_shift == 28);
+    assert(d->shards[0].dict->capacity == 4);
+    
+    for (t = 0; t < WRITERS; t++) {
+        pthread_create(&threads[t], NULL, writer, (void *)(uintptr_t)t);
+    }
+    
+    for (t = 0; t < WRITERS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    
+    n = WRITERS * PER_WRITER - WRITERS * PER_WRITER / 4;
+    assert(dict_sharded_size(d) == n);
+    
+    // Shards grow independently, and hold only keys whose high hash bits
+    // select them
+    for (shard = 0; shard < d->nshards; shard++) {
+        struct dict_iterator it;
+        struct dict_node *node;
+        
+        assert(d->shards[shard].dict->used > 0);
+        
+        dict_iterate_start(d->shards[shard].dict, &it);
+        while ((node = dict_iterate_next(&it)) != NULL) {
+            assert(node->hash >> 28 == shard);
+        }
+    }
+    
+    total = 0;
+    dict_sharded_foreach(d, count, &total);
+    assert(total == n);
+    
+    // Clone holds copies of the same entries
+    c = dict_sharded_clone(d, clone_key, NULL);
+    assert(c != NULL && dict_sharded_size(c) == n);
+    assert(dict_sharded_get(c, "key-1", &value) == 1 && (uintptr_t)value == 2);
+    assert(dict_sharded_contains(c, "key-0") == 0);
+    
+    for (i = 1; i < WRITERS * PER_WRITER; i += 2) {
+        char buf[32];
+        
+        snprintf(buf, sizeof(buf), "key-%lu", (unsigned long)i);
+        assert(dict_sharded_del(c, buf) == 1);
+    }
+    
+    // Intersection is the even, undeleted keys; difference the odd ones
+    total = 0;
+    assert(dict_sharded_intersection(d, c, count, &total) == 1);
+    assert(total == WRITERS * PER_WRITER / 4);
+    
+    total = 0;
+    assert(dict_sharded_difference(d, c, sum, &total) == 1);
+    for (i = 1, n = 0; i < WRITERS * PER_WRITER; i += 2) {
+        n += i + 1;
+    }
+    
+    assert(total == n);
+    
+    dict_sharded_clear(c);
+    assert(dict_sharded_size(c) == 0);
+    assert(dict_sharded_contains(c, "key-2") == 0);
+    
+    total = 0;
+    assert(dict_sharded_intersection(d, c, count, &total) == 1 && total == 0);
+    
+    dict_sharded_delete(c);
+    
+    // Set operations need matching shards
+    c = dict_sharded_new(&opts, 8, 0);
+    assert(dict_sharded_difference(d, c, count, &total) == 0);
+    dict_sharded_delete(c);
+    
+    dict_sharded_delete(d);
+    
+    exit(0);
+}
@@ -0,0 +1,245 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include "dict_snapshot.h"
+
+#define SEED 1234
+#define COUNT 20000
+
+static size_t freed;
+
+static void count_free(void *ptr)
+{
+    freed++;
+}
+
+static char *key_of(char *buf, size_t i)
+{
+    snprintf(buf, 32, "key-%lu", (unsigned long)i);
+    return buf;
+}
+
+// Keys the dict doesn't own are freed by it, so pass it copies.
+static char *key_arg(int flags, char *key)
+{
+    return flags & DICT_F_OWN_KEYS ? key : strdup(key);
+}
+
+// Checks that snapshot holds keys below count, each with value i + offset.
+static void check(struct dict_snapshot *snapshot, size_t count, size_t offset)
+{
+    struct dict_snapshot_iterator it;
+    struct dict_node *node;
+    size_t i, n = 0;
+    char buf[32];
+    
+    assert(dict_snapshot_size(snapshot) == count);
+    
+    for (i = 0; i < count; i++) {
+        node = dict_snapshot_get(snapshot, key_of(buf, i));
+        assert(node != NULL && (uintptr_t)node->value == i + offset);
+    }
+    
+    assert(dict_snapshot_contains(snapshot, key_of(buf, count)) == 0);
+    
+    dict_snapshot_iterate_start(snapshot, &it);
+    while ((node = dict_snapshot_iterate_next(&it)) != NULL) {
+        i = strtoul(node->key + 4, NULL, 10);
+        assert(i < count && (uintptr_t)node->value == i + offset);
+        n++;
+    }
+    
+    assert(n == count);
+}
+
+static void test_versions(int flags)
+{
+    struct dict_snapshot *s1, *s2, *s3;
+    struct dict_opts opts;
+    struct dict *d;
+    size_t i;
+    char buf[32];
+    
+    dict_opts_init(&opts);
+    opts.seed = SEED;
+    opts.flags = flags;
+    opts.key_inline = 8;
+    opts.key_free_fn = free;
+    d = dict_new_opts(&opts);
+    
+    for (i = 0; i < COUNT; i++) {
+        assert(dict_set(d, key_arg(flags, key_of(buf, i)), (void *)(uintptr_t)i) == 1);
+    }
+    
+    // Finish growing, so the snapshot shares the whole table.
+    assert(dict_resize(d, d->rehash_table != NULL ? d->rehash_capacity : d->capacity) == 1);
+    
+    s1 = dict_snapshot(d);
+    assert(s1 != NULL && d->cow_base == s1);
+    check(s1, COUNT, 0);
+    
+    // A single change copies a single segment.
+    assert(dict_set(d, key_arg(flags, "key-0"), (void *)(uintptr_t)1) == 1);
+    assert(d->cow_missing == (d->capacity + DICT_COW_SEGMENT - 1) / DICT_COW_SEGMENT - 1);
+    assert(dict_set(d, key_arg(flags, "key-0"), (void *)(uintptr_t)0) == 1);
+    
+    // Unchanged entries are read through the snapshot.
+    for (i = 0; i < COUNT; i++) {
+        assert((uintptr_t)dict_get(d, key_of(buf, i))->value == i);
+    }
+    
+    for (i = 0; i < 200; i += 2) {
+        assert(dict_set(d, key_arg(flags, key_of(buf, i)), (void *)(uintptr_t)(i + 1)) == 1);
+    }
+    
+    s2 = dict_snapshot(d);
+    assert(s2 != NULL && s2->base == s1);
+    
+    for (i = 0; i < COUNT; i++) {
+        assert(dict_set(d, key_arg(flags, key_of(buf, i)), (void *)(uintptr_t)(i + 7)) == 1);
+    }
+    
+    s3 = dict_snapshot(d);
+    
+    // Growing copies the rest of the table.
+    for (i = COUNT; i < COUNT * 2; i++) {
+        assert(dict_set(d, key_arg(flags, key_of(buf, i)), (void *)(uintptr_t)(i + 7)) == 1);
+    }
+    
+    assert(dict_del(d, "key-3") == 1);
+    
+    check(s1, COUNT, 0);
+    check(s3, COUNT, 7);
+    assert((uintptr_t)dict_snapshot_get(s2, "key-2")->value == 3);
+    assert((uintptr_t)dict_snapshot_get(s2, "key-3")->value == 3);
+    
+    // The oldest snapshot lives on while newer ones read from it.
+    dict_snapshot_release(s1);
+    assert((uintptr_t)dict_snapshot_get(s2, "key-5")->value == 5);
+    dict_snapshot_release(s2);
+    check(s3, COUNT, 7);
+    
+    // Shrinking and compacting leave them alone too.
+    for (i = 100; i < COUNT * 2; i++) {
+        assert(dict_del(d, key_of(buf, i)) == 1);
+    }
+    
+    assert(dict_compact(d) == 1 && d->capacity == 128);
+    check(s3, COUNT, 7);
+    
+    for (i = 0; i < 100; i++) {
+        assert(i == 3 || (uintptr_t)dict_get(d, key_of(buf, i))->value == i + 7);
+    }
+    
+    // Clearing leaves snapshots as they were.
+    dict_clear(d);
+    assert(dict_get(d, "key-5") == NULL);
+    check(s3, COUNT, 7);
+    dict_snapshot_release(s3);
+    
+    assert(dict_set(d, key_arg(flags, "key-1"), NULL) == 1);
+    assert(d->used == 1 && dict_contains(d, "key-1") == 1);
+    dict_delete(d);
+}
+
+// Keys and values are freed once no snapshot can see them.
+static void test_garbage(void)
+{
+    struct dict_snapshot *s;
+    struct dict *d;
+    
+    d = dict_new(SEED, 16, count_free, count_free);
+    assert(dict_set(d, "a", "1") == 1);
+    assert(dict_set(d, "b", "2") == 1);
+    
+    freed = 0;
+    s = dict_snapshot(d);
+    assert(dict_set(d, "a", "3") == 1);
+    assert(dict_del(d, "b") == 1);
+    assert(freed == 0);
+    assert(strcmp(dict_snapshot_get(s, "a")->value, "1") == 0);
+    assert(strcmp(dict_snapshot_get(s, "b")->value, "2") == 0);
+    
+    dict_snapshot_release(s);
+    assert(dict_set(d, "c", "4") == 1);
+    assert(dict_set(d, "c", "5") == 1);
+    assert(freed == 6);
+    
+    dict_delete(d);
+    assert(freed == 10);
+}
+
+static struct dict_snapshot *shared;
+
+// Reads a snapshot while the main thread keeps changing the dict.
+static void *reader(void *arg)
+{
+    int round;
+    
+    for (round = 0; round < 3; round++) {
+        check(shared, COUNT, 0);
+    }
+    
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    pthread_t threads[4];
+    struct dict *d;
+    size_t i;
+    char buf[32];
+    int t;
+    
+    d = dict_new(SEED, 16, free, NULL);
+    for (i = 0; i < COUNT; i++) {
+        assert(dict_set(d, strdup(key_of(buf, i)), (void *)(uintptr_t)i) == 1);
+    }
+    
+    shared = dict_snapshot(d);
+    assert(shared != NULL);
+    
+    for (t = 0; t < 4; t++) {
+        assert(pthread_create(&threads[t], NULL, reader, NULL) == 0);
+    }
+    
+    for (i = 0; i < COUNT * 4; i++) {
+        assert(dict_set(d, strdup(key_of(buf, i)), (void *)(uintptr_t)(i * 3)) == 1);
+        
+        if (i % 3 == 0) {
+            assert(dict_del(d, key_of(buf, i / 2)) == 1);
+        }
+    }
+    
+    for (t = 0; t < 4; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    
+    dict_snapshot_release(shared);
+    dict_delete(d);
+}
+
+int main(void)
+{
+    struct dict_opts opts;
+    struct dict *d;
+    
+    test_versions(0);
+    test_versions(DICT_F_OWN_KEYS);
+    test_garbage();
+    test_threads();
+    
+    // Only chained dicts can be snapshotted.
+    dict_opts_init(&opts);
+    opts.engine = DICT_ENGINE_PROBED;
+    d = dict_new_opts(&opts);
+    assert(dict_snapshot(d) == NULL);
+    dict_delete(d);
+    
+    exit(0);
+}
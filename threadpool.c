@@ -0,0 +1,169 @@
+/*
+ * Minimal thread pool for data-parallel loops.
+ *
+ * threadpool_run() hands out the indexes of a loop to the workers and the
+ * calling thread, which claim them one at a time from a shared counter, and
+ * returns once every index has been processed. One loop runs at a time;
+ * concurrent callers queue up behind it.
+ */
+
+#include <stdlib.h>
+
+#include "threadpool.h"
+
+/**
+ * Runs indexes of the current job until there are none left.
+ **/
+static void _drain(struct threadpool *pool)
+{
+    size_t i;
+    
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->n) {
+        pool->fn(pool->arg, i);
+        __atomic_fetch_add(&pool->done, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void *_worker(void *arg)
+{
+    struct threadpool *pool = arg;
+    unsigned long seen = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    for (;;) {
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        
+        if (pool->stop) {
+            break;
+        }
+        
+        // Counted as active, the job can't be replaced under us.
+        seen = pool->generation;
+        pool->active++;
+        pthread_mutex_unlock(&pool->lock);
+        
+        _drain(pool);
+        
+        pthread_mutex_lock(&pool->lock);
+        pool->active--;
+        pthread_cond_signal(&pool->done_cond);
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    
+    return NULL;
+}
+
+/**
+ * Starts a pool of nthreads workers. With 0 workers, threadpool_run() runs
+ * its loops on the calling thread.
+ *
+ * Returns the pool, or NULL on error.
+ **/
+struct threadpool *threadpool_new(unsigned nthreads)
+{
+    struct threadpool *pool;
+    unsigned i;
+    
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    
+    if (nthreads > 0) {
+        pool->threads = malloc(nthreads * sizeof(*pool->threads));
+        if (pool->threads == NULL) {
+            free(pool);
+            return NULL;
+        }
+    }
+    
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, _worker, pool) != 0) {
+            break;
+        }
+        
+        pool->nthreads++;
+    }
+    
+    return pool;
+}
+
+/**
+ * Stops the workers and frees the pool.
+ **/
+void threadpool_delete(struct threadpool *pool)
+{
+    unsigned i;
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * Calls fn(arg, i) for every i in [0, n), spread over the workers and the
+ * calling thread, and waits for all of them to finish. fn must be safe to
+ * call from several threads at once.
+ **/
+void threadpool_run(struct threadpool *pool, void (*fn)(void *arg, size_t i), void *arg, size_t n)
+{
+    size_t i;
+    
+    if (pool == NULL || pool->nthreads == 0 || n < 2) {
+        for (i = 0; i < n; i++) {
+            fn(arg, i);
+        }
+        
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->run_lock);
+    
+    // A worker that woke too late for the previous job may still be
+    // looking at it.
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->n = n;
+    pool->next = 0;
+    pool->done = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    
+    _drain(pool);
+    
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->done, __ATOMIC_ACQUIRE) < n || pool->active > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    
+    pthread_mutex_unlock(&pool->lock);
+    
+    pthread_mutex_unlock(&pool->run_lock);
+}
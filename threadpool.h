@@ -0,0 +1,35 @@
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct threadpool {
+    pthread_t *threads;
+    unsigned nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    pthread_mutex_t run_lock;
+    
+    // The job being run: fn(arg, i) for every i below n. Workers claim
+    // indexes from next, and count finished ones in done.
+    void (*fn)(void *arg, size_t i);
+    void *arg;
+    size_t n;
+    size_t next;
+    size_t done;
+    unsigned long generation;
+    unsigned active;
+    int stop;
+};
+
+struct threadpool *threadpool_new(unsigned nthreads);
+void threadpool_delete(struct threadpool *pool);
+void threadpool_run(struct threadpool *pool, void (*fn)(void *arg, size_t i), void *arg, size_t n);
+
+#ifdef __cplusplus
+}
+#endif